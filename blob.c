@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "blob.h"
+
+// Streamed blobs are read into a ring of buffers by a reader thread while
+// the previous buffers are sent, so a file of any size needs
+// BLOB_RING_BUFFERS * BLOB_RING_BUFFER_SIZE bytes per transfer.
+#define BLOB_RING_BUFFERS	4
+#define BLOB_RING_BUFFER_SIZE	(1024 * 1024)
+
+// Largest chunk passed to a blob_stream_fn. A mapped file smaller than this
+// is passed in a single call.
+#define BLOB_CHUNK_MAX		(1024 * 1024 * 1024)
+
+static struct blob *blob_alloc(void)
+{
+	struct blob *b = calloc(1, sizeof(*b));
+
+	if (!b)
+		return NULL;
+	b->refs = 1;
+	b->fd = -1;
+	return b;
+}
+
+// Returns a blob for 'size' bytes at 'offset' in the file which is read
+// by blob_stream() instead of being mapped.
+static struct blob *blob_stream_fd(int fd, off_t offset, size_t size)
+{
+	struct blob *b = blob_alloc();
+
+	if (!b)
+		return NULL;
+	b->fd = dup(fd);
+	if (b->fd < 0)
+	{
+		free(b);
+		return NULL;
+	}
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(b->fd, offset, size, POSIX_FADV_SEQUENTIAL);
+#endif
+	b->offset = offset;
+	b->size = size;
+	return b;
+}
+
+// Reads 'size' bytes at 'offset' from the file into memory. A copy can't
+// be invalidated by the file being truncated or rewritten in place, as a
+// mapping can, so small files are always read. The copy is page aligned
+// like a mapping so page aligned archive members stay aligned.
+static struct blob *blob_read_fd(int fd, off_t offset, size_t size)
+{
+	struct blob *b = blob_alloc();
+	void *data;
+
+	if (!b)
+		return NULL;
+	b->size = size;
+	if (size == 0)
+		return b;
+	b->heap = 1;
+	if (posix_memalign(&data, sysconf(_SC_PAGESIZE), size) != 0)
+	{
+		free(b);
+		return NULL;
+	}
+	b->data = data;
+	if (pread(fd, data, size, offset) == (ssize_t) size)
+		return b;
+
+	blob_close(b);
+	return NULL;
+}
+
+// Maps 'size' bytes at 'offset' from a large file. mmap requires a page
+// aligned offset so the mapping starts at the page containing the data. If
+// the file can't be mapped (e.g. some network filesystems) it is streamed.
+static struct blob *blob_map_fd(int fd, off_t offset, size_t size)
+{
+	struct blob *b = blob_alloc();
+	long page_size = sysconf(_SC_PAGESIZE);
+	off_t delta = offset % page_size;
+
+	if (!b)
+		return NULL;
+
+	b->size = size;
+	b->map_size = size + delta;
+	b->map = mmap(NULL, b->map_size, PROT_READ, MAP_PRIVATE, fd, offset - delta);
+	if (b->map != MAP_FAILED)
+	{
+#ifdef MADV_SEQUENTIAL
+		madvise(b->map, b->map_size, MADV_SEQUENTIAL);
+#endif
+		b->data = (const uint8_t *) b->map + delta;
+		return b;
+	}
+
+	free(b);
+	return blob_stream_fd(fd, offset, size);
+}
+
+struct blob *blob_open(const char *path)
+{
+	struct blob *b = NULL;
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+	{
+		if ((uint64_t) st.st_size > SIZE_MAX)
+			errno = EFBIG;
+		else
+			b = st.st_size < BLOB_MAP_MIN ? blob_read_fd(fd, 0, st.st_size) :
+				blob_map_fd(fd, 0, st.st_size);
+	}
+	close(fd);
+	return b;
+}
+
+struct blob *blob_static(const void *data, size_t size)
+{
+	struct blob *b = blob_alloc();
+
+	if (!b)
+		return NULL;
+	b->data = data;
+	b->size = size;
+	return b;
+}
+
+// Returns a blob which owns 'data', a buffer from malloc(). The buffer is
+// freed if the blob can't be allocated.
+struct blob *blob_heap(void *data, size_t size)
+{
+	struct blob *b = blob_alloc();
+
+	if (!b)
+	{
+		free(data);
+		return NULL;
+	}
+	b->data = data;
+	b->size = size;
+	b->heap = 1;
+	return b;
+}
+
+// Returns a blob for part of 'parent' which keeps the parent mapped until
+// the slice is closed. A slice of a streamed blob is streamed too.
+struct blob *blob_slice(struct blob *parent, size_t offset, size_t size)
+{
+	struct blob *b;
+
+	if (offset > parent->size || size > parent->size - offset)
+		return NULL;
+	if (parent->fd >= 0)
+		return blob_stream_fd(parent->fd, parent->offset + offset, size);
+
+	b = blob_alloc();
+	if (!b)
+		return NULL;
+	b->data = parent->data + offset;
+	b->size = size;
+	b->parent = blob_ref(parent);
+	return b;
+}
+
+struct blob *blob_ref(struct blob *b)
+{
+	if (b)
+		__atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+	return b;
+}
+
+void blob_close(struct blob *b)
+{
+	if (!b)
+		return;
+	if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	if (b->parent)
+		blob_close(b->parent);
+	else if (b->map)
+		munmap(b->map, b->map_size);
+	else if (b->heap)
+		free((void *) b->data);
+	if (b->fd >= 0)
+		close(b->fd);
+	free(b);
+}
+
+// Reads one byte from every page so that a mapped file is in memory before
+// it is needed. A streamed file is read ahead into the page cache instead.
+void blob_prefetch(const struct blob *b)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	volatile uint8_t sink = 0;
+	size_t i;
+
+	if (!b || !b->size)
+		return;
+	if (!b->data)
+	{
+#ifdef POSIX_FADV_WILLNEED
+		if (b->fd >= 0)
+			posix_fadvise(b->fd, b->offset, b->size, POSIX_FADV_WILLNEED);
+#endif
+		return;
+	}
+	for (i = 0; i < b->size; i += page_size)
+		sink += b->data[i];
+	sink += b->data[b->size - 1];
+}
+
+struct blob_ring {
+	const struct blob *b;
+	uint8_t *buf;
+	size_t len[BLOB_RING_BUFFERS];
+	int head;		// Next buffer to fill
+	int tail;		// Next buffer to send
+	int count;		// Filled buffers
+	int error;		// errno of a failed read
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *blob_ring_reader(void *arg)
+{
+	struct blob_ring *r = arg;
+	size_t pos = 0;
+
+	while (pos < r->b->size)
+	{
+		size_t len = r->b->size - pos < BLOB_RING_BUFFER_SIZE ? r->b->size - pos : BLOB_RING_BUFFER_SIZE;
+		uint8_t *buf;
+		ssize_t n;
+
+		pthread_mutex_lock(&r->lock);
+		while (r->count == BLOB_RING_BUFFERS && !r->stop)
+			pthread_cond_wait(&r->cond, &r->lock);
+		if (r->stop)
+		{
+			pthread_mutex_unlock(&r->lock);
+			break;
+		}
+		buf = r->buf + (size_t) r->head * BLOB_RING_BUFFER_SIZE;
+		pthread_mutex_unlock(&r->lock);
+
+		// The buffer at head isn't touched by the sender until it is counted
+		n = pread(r->b->fd, buf, len, r->b->offset + pos);
+
+		pthread_mutex_lock(&r->lock);
+		if (n != (ssize_t) len)
+		{
+			r->error = n < 0 ? errno : EIO;
+			pthread_cond_signal(&r->cond);
+			pthread_mutex_unlock(&r->lock);
+			break;
+		}
+		r->len[r->head] = len;
+		r->head = (r->head + 1) % BLOB_RING_BUFFERS;
+		r->count++;
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+		pos += len;
+	}
+	return NULL;
+}
+
+// Passes the contents of the blob to 'fn' in order. Mapped data is passed
+// directly; streamed blobs are read ahead by another thread so that disk
+// reads overlap with sending the previous chunk. Returns 0 once all of the
+// data has been passed, otherwise -1.
+int blob_stream(const struct blob *b, blob_stream_fn fn, void *ctx)
+{
+	struct blob_ring r;
+	pthread_t thread;
+	size_t pos = 0;
+	int ret = 0;
+
+	if (b->fd < 0)
+	{
+		for (pos = 0; pos < b->size; pos += BLOB_CHUNK_MAX)
+			if (fn(ctx, b->data + pos, b->size - pos < BLOB_CHUNK_MAX ? b->size - pos : BLOB_CHUNK_MAX) < 0)
+				return -1;
+		return 0;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.b = b;
+	r.buf = malloc((size_t) BLOB_RING_BUFFERS * BLOB_RING_BUFFER_SIZE);
+	if (!r.buf)
+		return -1;
+	pthread_mutex_init(&r.lock, NULL);
+	pthread_cond_init(&r.cond, NULL);
+	if (pthread_create(&thread, NULL, blob_ring_reader, &r) != 0)
+	{
+		free(r.buf);
+		return -1;
+	}
+
+	while (pos < b->size)
+	{
+		const uint8_t *buf;
+		size_t len;
+
+		pthread_mutex_lock(&r.lock);
+		while (r.count == 0 && !r.error)
+			pthread_cond_wait(&r.cond, &r.lock);
+		if (r.count == 0)
+		{
+			pthread_mutex_unlock(&r.lock);
+			fprintf(stderr, "Failed to read file: %s\n", strerror(r.error));
+			ret = -1;
+			break;
+		}
+		buf = r.buf + (size_t) r.tail * BLOB_RING_BUFFER_SIZE;
+		len = r.len[r.tail];
+		pthread_mutex_unlock(&r.lock);
+
+		if (fn(ctx, buf, len) < 0)
+		{
+			ret = -1;
+			break;
+		}
+		pos += len;
+
+		pthread_mutex_lock(&r.lock);
+		r.tail = (r.tail + 1) % BLOB_RING_BUFFERS;
+		r.count--;
+		pthread_cond_signal(&r.cond);
+		pthread_mutex_unlock(&r.lock);
+	}
+
+	pthread_mutex_lock(&r.lock);
+	r.stop = 1;
+	pthread_cond_signal(&r.cond);
+	pthread_mutex_unlock(&r.lock);
+	pthread_join(thread, NULL);
+
+	pthread_cond_destroy(&r.cond);
+	pthread_mutex_destroy(&r.lock);
+	free(r.buf);
+	return ret;
+}
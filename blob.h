@@ -0,0 +1,43 @@
+#ifndef BLOB_H
+#define BLOB_H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Files smaller than this are read into memory. Larger files are mapped,
+// or streamed from disk if they can't be mapped.
+#define BLOB_MAP_MIN		(32 * 1024 * 1024)
+
+// A read-only block of file data that can be passed directly to ep_write.
+// The data is either a copy of a small file, a memory mapped large file, a
+// slice of either (e.g. an archive member), an array compiled into rpiboot
+// or a buffer generated by rpiboot, so it is never copied again.
+// Truncating a mapped file raises SIGBUS when the missing pages are read,
+// so large files must be replaced by rename() rather than rewritten.
+// Large files which can't be mapped are instead read through a small ring
+// of buffers by blob_stream() and have no data pointer. Blobs are reference
+// counted and may be shared between threads.
+struct blob {
+	const uint8_t *data;
+	size_t size;
+	void *map;		// Start of the mapping if the data is mmap'd
+	size_t map_size;
+	int heap;		// Data was allocated, e.g. a copy of a small file
+	int fd;			// File a streamed blob is read from, otherwise -1
+	off_t offset;		// Start of a streamed blob in the file
+	int refs;
+	struct blob *parent;	// Blob that owns the data of a slice
+};
+
+// Called by blob_stream() for each chunk of data. Returns < 0 to stop.
+typedef int (*blob_stream_fn)(void *ctx, const uint8_t *buf, size_t len);
+
+struct blob *blob_open(const char *path);
+struct blob *blob_static(const void *data, size_t size);
+struct blob *blob_heap(void *data, size_t size);
+struct blob *blob_slice(struct blob *parent, size_t offset, size_t size);
+struct blob *blob_ref(struct blob *b);
+void blob_close(struct blob *b);
+void blob_prefetch(const struct blob *b);
+int blob_stream(const struct blob *b, blob_stream_fn fn, void *ctx);
+#endif
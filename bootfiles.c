@@ -2,12 +2,29 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "blob.h"
+#include "bootfiles.h"
+#include "dirindex.h"
+#include "sha256.h"
 
 // Reads bootloader files (e.g. DDR init) from a single packaged file
 // to ensure that the DDR init code, firmware and next stage are in sync.
 // For simplicity the implementation uses .tar and other files e.g. config.txt
 // maybe added to the package.
+//
+// The archive is mapped once and indexed by a single pass over the tar
+// headers. Files are returned as slices of the mapping so lookups don't
+// touch the archive again until it is modified.
+//
+// A v2 archive (see bootfiles.h) carries its own index at the end so it is
+// used in place of the tar headers, which are never read. Its members are
+// page aligned in the mapping and each member's digest is checked the first
+// time it is opened, without holding up the lookups of other members.
 
 extern int verbose;
 #define BLOCK_SIZE 512
@@ -24,77 +41,342 @@ struct tar_header{
    char lname[100];
 } __attribute__((packed));
 
-unsigned char *bootfiles_read(const char *archive, const char *filename, unsigned long *psize)
+struct bootfiles_entry {
+   char filename[100];
+   unsigned long offset;
+   unsigned long size;
+   int next;            // Next entry in the same hash bucket or -1
+};
+
+static struct {
+   char archive[256];
+   dev_t dev;
+   ino_t ino;
+   time_t mtime;
+   long mtime_ns;
+   off_t size;
+   struct blob *map;
+   struct bootfiles_entry *entries;
+   int num_entries;
+   int *buckets;
+   unsigned num_buckets;
+   const struct bootfiles_v2_entry *v2_entries;
+   const uint8_t *v2_buckets;
+   const char *v2_strings;
+   uint32_t v2_strings_size;
+   uint8_t *verified;   // BOOTFILES_* state of each v2 entry
+} bootfiles_index;
+
+#define BOOTFILES_UNVERIFIED  0
+#define BOOTFILES_VERIFYING   1
+#define BOOTFILES_VERIFIED    2
+#define BOOTFILES_CORRUPTED   3
+
+static unsigned long bootfiles_generation;   // Changes when the index is rebuilt
+static pthread_mutex_t bootfiles_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bootfiles_verified_cond = PTHREAD_COND_INITIALIZER;
+
+static uint32_t le32(const void *p)
 {
-   FILE *fp = NULL;
-   struct tar_header hdr;
-   unsigned char *data = NULL;
-   long archive_size;
+   const uint8_t *b = p;
 
-   fp = fopen(archive, "rb");
-   if (!fp){
-      goto fail;
+   return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+static uint64_t le64(const void *p)
+{
+   return le32(p) | ((uint64_t) le32((const uint8_t *) p + 4) << 32);
+}
+
+static void bootfiles_index_free(void)
+{
+   blob_close(bootfiles_index.map);
+   free(bootfiles_index.entries);
+   free(bootfiles_index.buckets);
+   free(bootfiles_index.verified);
+   memset(&bootfiles_index, 0, sizeof(bootfiles_index));
+}
+
+// Uses the index at the end of a v2 archive. Only the trailing blocks and
+// the index are read. Returns -1 if this is a plain tar archive.
+static int bootfiles_index_v2(void)
+{
+   const uint8_t *data = bootfiles_index.map->data;
+   unsigned long end = bootfiles_index.map->size;
+   const struct bootfiles_v2_footer *footer;
+   uint64_t index_offset, index_end;
+   uint32_t num_entries, num_buckets, strings_size;
+   int zero_blocks;
+
+   // Skip the end of archive blocks, allowing for padding to a 10 KiB tar record
+   for (zero_blocks = 0; zero_blocks < 40 && end >= BLOCK_SIZE; zero_blocks++, end -= BLOCK_SIZE)
+   {
+      unsigned i;
+
+      for (i = 0; i < BLOCK_SIZE && data[end - BLOCK_SIZE + i] == 0; i++)
+         ;
+      if (i < BLOCK_SIZE)
+         break;
    }
-   if (fseek(fp, 0, SEEK_END) < 0)
-      goto fail;
-   archive_size = ftell(fp);
+   if (end < sizeof(*footer))
+      return -1;
 
-   if (fseek(fp, 0, SEEK_SET) < 0)
-      goto fail;
-   do
+   footer = (const struct bootfiles_v2_footer *) (data + end - sizeof(*footer));
+   if (memcmp(footer->magic, BOOTFILES_V2_MAGIC, sizeof(BOOTFILES_V2_MAGIC)) != 0)
+      return -1;
+
+   index_offset = le64(&footer->index_offset);
+   num_entries = le32(&footer->num_entries);
+   num_buckets = le32(&footer->num_buckets);
+   strings_size = le32(&footer->strings_size);
+   index_end = index_offset + (uint64_t) num_entries * sizeof(struct bootfiles_v2_entry) +
+      (uint64_t) num_buckets * 4 + strings_size;
+   if (!num_buckets || (num_buckets & (num_buckets - 1)) || index_offset > end ||
+       index_end > end - sizeof(*footer) || num_entries > end / sizeof(struct bootfiles_v2_entry))
    {
-      unsigned long size;
-      long offset;
+      fprintf(stderr, "Corrupted archive index\n");
+      return -1;
+   }
 
-      offset = ftell(fp);
-      if (fread(&hdr, sizeof(hdr), 1, fp) != 1)
-         goto fail;
+   bootfiles_index.v2_entries = (const struct bootfiles_v2_entry *) (data + index_offset);
+   bootfiles_index.v2_buckets = (const uint8_t *) (bootfiles_index.v2_entries + num_entries);
+   bootfiles_index.v2_strings = (const char *) (bootfiles_index.v2_buckets + (size_t) num_buckets * 4);
+   bootfiles_index.v2_strings_size = strings_size;
+   bootfiles_index.num_entries = num_entries;
+   bootfiles_index.num_buckets = num_buckets;
+   bootfiles_index.verified = calloc(num_entries ? num_entries : 1, 1);
+   return bootfiles_index.verified ? 0 : -1;
+}
 
-      if (fseek(fp, BLOCK_SIZE - sizeof(hdr), SEEK_CUR) < 0)
-         goto fail;
-      offset = ftell(fp);
+static int bootfiles_index_build(const char *archive, const struct stat *st)
+{
+   const uint8_t *data;
+   unsigned long offset = 0;
+   unsigned long archive_size;
+   int max_entries;
+   unsigned i;
+
+   bootfiles_index_free();
+   bootfiles_generation++;
+   bootfiles_index.map = blob_open(archive);
+   if (!bootfiles_index.map)
+   {
+      printf("read_file: Failed to read \"%s\" - %s\n", archive, strerror(errno));
+      return -1;
+   }
+   data = bootfiles_index.map->data;
+   archive_size = bootfiles_index.map->size;
+   if (!data)
+   {
+      printf("read_file: Failed to map \"%s\"\n", archive);
+      bootfiles_index_free();
+      return -1;
+   }
+
+   if (bootfiles_index_v2() == 0)
+      goto done;
+
+   max_entries = archive_size / BLOCK_SIZE;
+   bootfiles_index.entries = calloc(max_entries ? max_entries : 1, sizeof(struct bootfiles_entry));
+   for (bootfiles_index.num_buckets = 16; bootfiles_index.num_buckets < (unsigned) max_entries * 2; )
+      bootfiles_index.num_buckets <<= 1;
+   bootfiles_index.buckets = malloc(bootfiles_index.num_buckets * sizeof(int));
+   if (!bootfiles_index.entries || !bootfiles_index.buckets)
+      goto fail;
+   for (i = 0; i < bootfiles_index.num_buckets; i++)
+      bootfiles_index.buckets[i] = -1;
 
-      if (offset == archive_size)
-          break;
+   while (offset + BLOCK_SIZE <= archive_size)
+   {
+      const struct tar_header *hdr = (const struct tar_header *) (data + offset);
+      struct bootfiles_entry *entry;
+      char size_str[sizeof(hdr->size) + 1];
+      unsigned long size;
+      uint32_t bucket;
 
-      size = strtoul(hdr.size, NULL, 8);
-      if (offset + size > (unsigned long) archive_size)
+      // The archive is terminated by empty blocks
+      if (hdr->filename[0] == 0)
+         break;
+
+      memcpy(size_str, hdr->size, sizeof(hdr->size));
+      size_str[sizeof(hdr->size)] = 0;
+      size = strtoul(size_str, NULL, 8);
+      offset += BLOCK_SIZE;
+      if (offset + size > archive_size)
       {
          fprintf(stderr, "Corrupted archive");
          goto fail;
       }
-      hdr.filename[sizeof(hdr.filename) - 1] = 0;
+
+      entry = &bootfiles_index.entries[bootfiles_index.num_entries];
+      memcpy(entry->filename, hdr->filename, sizeof(entry->filename));
+      entry->filename[sizeof(entry->filename) - 1] = 0;
+      entry->offset = offset;
+      entry->size = size;
       if (verbose > 1)
-          printf("%s position %08lx size %lu\n", hdr.filename, ftell(fp), size);
+         printf("%s position %08lx size %lu\n", entry->filename, offset, size);
 
-      if (strcasecmp(hdr.filename, filename) == 0)
+      // Insert at the tail of the bucket so that the first match in the
+      // archive wins, as it did with a linear search.
+      bucket = bootfiles_hash(entry->filename) & (bootfiles_index.num_buckets - 1);
+      entry->next = -1;
+      if (bootfiles_index.buckets[bucket] < 0)
       {
-         data = malloc(size);
-         if (fread(data, 1, size, fp) != size)
-            goto fail;
-         *psize = size;
-         goto end;
+         bootfiles_index.buckets[bucket] = bootfiles_index.num_entries;
       }
       else
       {
-         if (fseek(fp, (size + BLOCK_SIZE -1) & ~(BLOCK_SIZE -1), SEEK_CUR) < 0)
-            goto fail;
+         int e = bootfiles_index.buckets[bucket];
+         while (bootfiles_index.entries[e].next >= 0)
+            e = bootfiles_index.entries[e].next;
+         bootfiles_index.entries[e].next = bootfiles_index.num_entries;
       }
-   } while (!feof(fp));
+      bootfiles_index.num_entries++;
 
-   if (verbose > 1)
-       printf("File %s not found in %s\n", filename, archive);
+      offset += (size + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1);
+   }
 
-   goto end;
+done:
+   snprintf(bootfiles_index.archive, sizeof(bootfiles_index.archive), "%s", archive);
+   bootfiles_index.dev = st->st_dev;
+   bootfiles_index.ino = st->st_ino;
+   bootfiles_index.mtime = st->st_mtime;
+   bootfiles_index.mtime_ns = dirindex_mtime_ns(st);
+   bootfiles_index.size = st->st_size;
+   if (verbose)
+      printf("Indexed %d files in %s%s\n", bootfiles_index.num_entries, archive,
+             bootfiles_index.v2_entries ? " (v2)" : "");
+   return 0;
 
 fail:
-   if (data)
-      free(data);
-   printf("read_file: Failed to read \"%s\" from \"%s\" - \%s\n", filename, archive, strerror(errno));
+   bootfiles_index_free();
+   return -1;
+}
+
+// Finds 'filename' in the index. Returns 0 and the location of its data
+// or -1 if it isn't in the archive.
+static int bootfiles_find(const char *filename, unsigned long *offset, unsigned long *size, int *v2_entry)
+{
+   uint32_t hash = bootfiles_hash(filename);
+   int e;
+
+   *v2_entry = -1;
+   if (bootfiles_index.v2_entries)
+   {
+      uint32_t n = le32(bootfiles_index.v2_buckets + (size_t) (hash & (bootfiles_index.num_buckets - 1)) * 4);
+      uint32_t steps;
+
+      for (steps = 0; n && n <= (uint32_t) bootfiles_index.num_entries && steps < (uint32_t) bootfiles_index.num_entries; steps++)
+      {
+         const struct bootfiles_v2_entry *entry = &bootfiles_index.v2_entries[n - 1];
+         uint32_t name = le32(&entry->name);
+
+         if (le32(&entry->hash) == hash && name < bootfiles_index.v2_strings_size &&
+             memchr(bootfiles_index.v2_strings + name, 0, bootfiles_index.v2_strings_size - name) &&
+             strcasecmp(bootfiles_index.v2_strings + name, filename) == 0)
+         {
+            *offset = le64(&entry->offset);
+            *size = le64(&entry->size);
+            if (*offset > bootfiles_index.map->size || *size > bootfiles_index.map->size - *offset)
+            {
+               fprintf(stderr, "Corrupted archive index\n");
+               return -1;
+            }
+            *v2_entry = n - 1;
+            return 0;
+         }
+         n = le32(&entry->next);
+      }
+      return -1;
+   }
+
+   e = bootfiles_index.buckets[hash & (bootfiles_index.num_buckets - 1)];
+   while (e >= 0 && strcasecmp(bootfiles_index.entries[e].filename, filename) != 0)
+      e = bootfiles_index.entries[e].next;
+   if (e < 0)
+      return -1;
+   *offset = bootfiles_index.entries[e].offset;
+   *size = bootfiles_index.entries[e].size;
+   return 0;
+}
+
+// Returns a blob referencing 'filename' within the archive or NULL. The
+// index is rebuilt if the archive has been replaced or modified.
+struct blob *bootfiles_open(const char *archive, const char *filename)
+{
+   struct blob *b = NULL;
+   unsigned long offset, size;
+   struct stat st;
+   int v2_entry;
+
+   if (dirindex_stat(archive, &st) < 0)
+   {
+      printf("read_file: Failed to read \"%s\" from \"%s\" - \%s\n", filename, archive, strerror(errno));
+      return NULL;
+   }
+
+   pthread_mutex_lock(&bootfiles_lock);
+   if (!bootfiles_index.map ||
+       strcmp(bootfiles_index.archive, archive) != 0 ||
+       bootfiles_index.dev != st.st_dev ||
+       bootfiles_index.ino != st.st_ino ||
+       bootfiles_index.mtime != st.st_mtime ||
+       bootfiles_index.mtime_ns != dirindex_mtime_ns(&st) ||
+       bootfiles_index.size != st.st_size)
+   {
+      if (bootfiles_index_build(archive, &st) < 0)
+         goto end;
+   }
+
+   if (bootfiles_find(filename, &offset, &size, &v2_entry) < 0)
+   {
+      if (verbose > 1)
+         printf("File %s not found in %s\n", filename, archive);
+      goto end;
+   }
+
+   b = blob_slice(bootfiles_index.map, offset, size);
+
+   // The digest is checked without the lock so that other files can be
+   // opened meanwhile. Other threads opening the same file wait for it.
+   if (b && v2_entry >= 0)
+   {
+      unsigned long generation = bootfiles_generation;
+      uint8_t expected[SHA256_DIGEST_SIZE], digest[SHA256_DIGEST_SIZE];
+      int mark, ok;
+
+      memcpy(expected, bootfiles_index.v2_entries[v2_entry].digest, sizeof(expected));
+      while (generation == bootfiles_generation &&
+             bootfiles_index.verified[v2_entry] == BOOTFILES_VERIFYING)
+         pthread_cond_wait(&bootfiles_verified_cond, &bootfiles_lock);
+
+      // The entry can't be marked if the index was rebuilt meanwhile
+      mark = generation == bootfiles_generation;
+      ok = mark && bootfiles_index.verified[v2_entry] == BOOTFILES_VERIFIED;
+      if (mark && bootfiles_index.verified[v2_entry] == BOOTFILES_UNVERIFIED)
+         bootfiles_index.verified[v2_entry] = BOOTFILES_VERIFYING;
+      if (!mark || bootfiles_index.verified[v2_entry] == BOOTFILES_VERIFYING)
+      {
+         pthread_mutex_unlock(&bootfiles_lock);
+         sha256(b->data, b->size, digest);
+         ok = memcmp(digest, expected, sizeof(digest)) == 0;
+         pthread_mutex_lock(&bootfiles_lock);
+         if (mark && generation == bootfiles_generation)
+            bootfiles_index.verified[v2_entry] = ok ? BOOTFILES_VERIFIED : BOOTFILES_CORRUPTED;
+         pthread_cond_broadcast(&bootfiles_verified_cond);
+      }
+      if (!ok)
+      {
+         fprintf(stderr, "Digest mismatch for %s in %s\n", filename, archive);
+         blob_close(b);
+         b = NULL;
+         goto end;
+      }
+   }
+   if (verbose && b)
+      printf("Completed file-read %s in archive %s length %lu\n", filename, archive, (unsigned long) b->size);
+
 end:
-   if (fp)
-      fclose(fp);
-   if (verbose && data)
-      printf("Completed file-read %s in archive %s length %lu\n", filename, archive, *psize);
-   return data;
+   pthread_mutex_unlock(&bootfiles_lock);
+   return b;
 }
@@ -1,4 +1,59 @@
 #ifndef BOOTFILE_H
 #define BOOTFILE_H
-unsigned char *bootfiles_read(const char *archive, const char *filename, unsigned long *psize);
+#include <stdint.h>
+
+// bootfiles.bin v2 is still a tar archive but the data of every member
+// starts on a BOOTFILES_V2_ALIGN boundary (using BOOTFILES_V2_PAD members
+// to fill the gaps) and the last member, BOOTFILES_V2_INDEX, is a hash
+// table of the members ending with a footer. This lets a reader find any
+// member from the end of the archive without reading the tar headers.
+//
+// The index member contains, all little endian:
+//    struct bootfiles_v2_entry entries[num_entries]
+//    uint32_t buckets[num_buckets]   first entry + 1 in each bucket, or 0
+//    char strings[strings_size]      NUL terminated member names
+//    padding
+//    struct bootfiles_v2_footer      the last bytes of the member
+#define BOOTFILES_V2_MAGIC	"RPIBFv2"
+#define BOOTFILES_V2_ALIGN	4096
+#define BOOTFILES_V2_INDEX	".bootfiles-index"
+#define BOOTFILES_V2_PAD	".bootfiles-pad"
+
+struct bootfiles_v2_entry {
+   uint32_t hash;          // bootfiles_hash() of the name
+   uint32_t next;          // Next entry + 1 in the same bucket, or 0
+   uint32_t name;          // Offset of the name in strings
+   uint32_t reserved;
+   uint64_t offset;        // Offset of the data in the archive
+   uint64_t size;
+   uint8_t digest[32];     // SHA-256 of the data
+} __attribute__((packed));
+
+struct bootfiles_v2_footer {
+   char magic[8];
+   uint64_t index_offset;  // Offset of the index member data in the archive
+   uint32_t num_entries;
+   uint32_t num_buckets;   // A power of two
+   uint32_t strings_size;
+   uint32_t reserved;
+} __attribute__((packed));
+
+// FNV-1a of the lower case name. Filenames are matched case insensitively
+// (FAT semantics).
+static inline uint32_t bootfiles_hash(const char *name)
+{
+   uint32_t hash = 2166136261u;
+
+   while (*name)
+   {
+      uint8_t c = *name++;
+
+      hash ^= c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+struct blob;
+struct blob *bootfiles_open(const char *archive, const char *filename);
 #endif
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "blob.h"
+#include "bootfiles.h"
+#include "cache.h"
+#include "dirindex.h"
+
+// Process wide cache of file contents shared by all boot sessions. Each
+// entry is keyed by the source of the data (a path or an archive member)
+// plus the device, inode, size and mtime (to the nanosecond) of the file
+// so a modified file gets a new entry. Entries are immutable blobs; the
+// cache holds one reference and each user holds another so eviction never
+// invalidates data which is being sent. The least recently used entries
+// are evicted once the cached data exceeds the size limit.
+
+extern int verbose;
+
+#define CACHE_KEY_LEN 520
+
+struct cache_entry {
+	char key[CACHE_KEY_LEN];
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	long mtime_ns;
+	off_t size;
+	struct blob *blob;
+	struct cache_entry *prev;
+	struct cache_entry *next;
+};
+
+static struct cache_entry *cache_head;	// Most recently used
+static struct cache_entry *cache_tail;
+static size_t cache_max_bytes = 256 * 1024 * 1024;
+static struct cache_stats stats;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void cache_init(size_t max_bytes)
+{
+	cache_max_bytes = max_bytes;
+}
+
+static void cache_unlink(struct cache_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		cache_head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		cache_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void cache_push_front(struct cache_entry *e)
+{
+	e->next = cache_head;
+	e->prev = NULL;
+	if (cache_head)
+		cache_head->prev = e;
+	cache_head = e;
+	if (!cache_tail)
+		cache_tail = e;
+}
+
+static void cache_remove(struct cache_entry *e)
+{
+	cache_unlink(e);
+	stats.bytes -= e->blob->size;
+	stats.entries--;
+	blob_close(e->blob);
+	free(e);
+}
+
+static struct cache_entry *cache_find(const char *key)
+{
+	struct cache_entry *e;
+
+	for (e = cache_head; e; e = e->next)
+		if (strcmp(e->key, key) == 0)
+			return e;
+	return NULL;
+}
+
+// Returns a new reference to the cached data for 'key' if the source file
+// is unchanged. A stale entry is dropped.
+static struct blob *cache_lookup(const char *key, const struct stat *st)
+{
+	struct cache_entry *e;
+	struct blob *b = NULL;
+
+	pthread_mutex_lock(&cache_lock);
+	e = cache_find(key);
+	if (e && (e->dev != st->st_dev || e->ino != st->st_ino ||
+		e->mtime != st->st_mtime || e->mtime_ns != dirindex_mtime_ns(st) ||
+		e->size != st->st_size))
+	{
+		if (verbose > 1)
+			printf("Cache: %s changed\n", key);
+		cache_remove(e);
+		e = NULL;
+	}
+	if (e)
+	{
+		cache_unlink(e);
+		cache_push_front(e);
+		b = blob_ref(e->blob);
+		stats.hits++;
+	}
+	else
+	{
+		stats.misses++;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return b;
+}
+
+static void cache_insert(const char *key, const struct stat *st, struct blob *b)
+{
+	struct cache_entry *e;
+
+	if (b->size > cache_max_bytes || b->fd >= 0)
+		return;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return;
+	snprintf(e->key, sizeof(e->key), "%s", key);
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->mtime = st->st_mtime;
+	e->mtime_ns = dirindex_mtime_ns(st);
+	e->size = st->st_size;
+	e->blob = blob_ref(b);
+
+	pthread_mutex_lock(&cache_lock);
+	// Another session may have loaded the same file concurrently
+	if (cache_find(key))
+	{
+		pthread_mutex_unlock(&cache_lock);
+		blob_close(e->blob);
+		free(e);
+		return;
+	}
+	while (cache_tail && stats.bytes + b->size > cache_max_bytes)
+	{
+		stats.evictions++;
+		cache_remove(cache_tail);
+	}
+	cache_push_front(e);
+	stats.bytes += b->size;
+	stats.entries++;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+struct blob *cache_open(const char *path)
+{
+	struct blob *b;
+	struct stat st;
+
+	if (dirindex_stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+		return NULL;
+
+	if (cache_max_bytes == 0)
+		return blob_open(path);
+
+	b = cache_lookup(path, &st);
+	if (b)
+		return b;
+
+	b = blob_open(path);
+	if (b)
+		cache_insert(path, &st, b);
+	return b;
+}
+
+struct blob *cache_open_member(const char *archive, const char *member)
+{
+	char key[CACHE_KEY_LEN];
+	struct blob *b;
+	struct stat st;
+
+	if (cache_max_bytes == 0)
+		return bootfiles_open(archive, member);
+
+	if (dirindex_stat(archive, &st) < 0)
+		return bootfiles_open(archive, member);
+
+	snprintf(key, sizeof(key), "%s:%s", archive, member);
+	b = cache_lookup(key, &st);
+	if (b)
+		return b;
+
+	b = bootfiles_open(archive, member);
+	if (b)
+		cache_insert(key, &st, b);
+	return b;
+}
+
+void cache_get_stats(struct cache_stats *s)
+{
+	pthread_mutex_lock(&cache_lock);
+	*s = stats;
+	pthread_mutex_unlock(&cache_lock);
+}
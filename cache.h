@@ -0,0 +1,19 @@
+#ifndef CACHE_H
+#define CACHE_H
+#include <stddef.h>
+
+struct blob;
+
+struct cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	size_t bytes;
+	int entries;
+};
+
+void cache_init(size_t max_bytes);
+struct blob *cache_open(const char *path);
+struct blob *cache_open_member(const char *archive, const char *member);
+void cache_get_stats(struct cache_stats *stats);
+#endif
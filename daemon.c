@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+
+// Daemon mode. rpiboot keeps running with its USB context and caches and
+// boots devices for jobs submitted on a Unix domain socket. Jobs run one at
+// a time in the order they were submitted.
+//
+// Each connection carries one command line and gets a reply after which the
+// connection is closed:
+//
+//   submit [dir=DIR] [path=USBPATH] [port=N] [serial=SERIAL] [metadata=DIR] [count=N]
+//      -> ok ID
+//   status
+//      -> one line per job and per active device session
+//   cancel ID
+//      -> ok ID
+//
+// Errors are reported as "error <message>".
+
+extern int verbose;
+
+#define DAEMON_LINE_LEN		1024
+#define DAEMON_MAX_FINISHED	64
+
+static const char *job_states[] = { "queued", "running", "done", "cancelled", "failed" };
+
+static struct {
+	int fd;
+	char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+	struct job *jobs;	// In submission order
+	int next_id;
+	void (*status)(FILE *out);
+	void (*wake)(void);
+} daemon_state = { .fd = -1, .next_id = 1 };
+
+static pthread_mutex_t daemon_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void job_free(struct job *job)
+{
+	free(job->directory);
+	free(job->pathname);
+	free(job->serial);
+	free(job->metadata);
+	free(job);
+}
+
+// Forgets the oldest finished jobs
+static void daemon_prune(void)
+{
+	struct job **pj;
+	int finished = 0;
+
+	for (pj = &daemon_state.jobs; *pj; pj = &(*pj)->next)
+		finished += ((*pj)->state >= JOB_DONE);
+
+	for (pj = &daemon_state.jobs; *pj && finished > DAEMON_MAX_FINISHED; )
+	{
+		struct job *job = *pj;
+
+		if (job->state >= JOB_DONE)
+		{
+			*pj = job->next;
+			job_free(job);
+			finished--;
+			continue;
+		}
+		pj = &job->next;
+	}
+}
+
+static int job_set(struct job *job, const char *arg, FILE *out)
+{
+	const char *value = strchr(arg, '=');
+	size_t len;
+
+	if (!value || !value[1])
+	{
+		fprintf(out, "error expected key=value, got '%s'\n", arg);
+		return -1;
+	}
+	len = value++ - arg;
+
+	if (len == 3 && strncmp(arg, "dir", len) == 0)
+		job->directory = strdup(value);
+	else if (len == 4 && strncmp(arg, "path", len) == 0)
+		job->pathname = strdup(value);
+	else if (len == 6 && strncmp(arg, "serial", len) == 0)
+		job->serial = strdup(value);
+	else if (len == 8 && strncmp(arg, "metadata", len) == 0)
+		job->metadata = strdup(value);
+	else if (len == 4 && strncmp(arg, "port", len) == 0)
+	{
+		job->port = atoi(value);
+		if (job->port < 0 || job->port > 98)
+		{
+			fprintf(out, "error port must be 0 to 98\n");
+			return -1;
+		}
+	}
+	else if (len == 5 && strncmp(arg, "count", len) == 0)
+	{
+		job->count = atoi(value);
+		if (job->count < 1)
+		{
+			fprintf(out, "error count must be at least 1\n");
+			return -1;
+		}
+	}
+	else
+	{
+		fprintf(out, "error unknown key '%.*s'\n", (int) len, arg);
+		return -1;
+	}
+	return 0;
+}
+
+static void daemon_submit(char *args, FILE *out)
+{
+	struct job *job = calloc(1, sizeof(*job));
+	struct job **pj;
+	char *arg, *saveptr;
+
+	if (!job)
+	{
+		fprintf(out, "error out of memory\n");
+		return;
+	}
+	job->port = 99;
+	job->count = 1;
+	for (arg = strtok_r(args, " \t", &saveptr); arg; arg = strtok_r(NULL, " \t", &saveptr))
+	{
+		if (job_set(job, arg, out) < 0)
+		{
+			job_free(job);
+			return;
+		}
+	}
+	if (job->pathname && job->port != 99)
+	{
+		fprintf(out, "error path and port can't both be given\n");
+		job_free(job);
+		return;
+	}
+
+	pthread_mutex_lock(&daemon_lock);
+	job->id = daemon_state.next_id++;
+	for (pj = &daemon_state.jobs; *pj; pj = &(*pj)->next)
+		;
+	*pj = job;
+	daemon_prune();
+	pthread_mutex_unlock(&daemon_lock);
+
+	if (verbose)
+		printf("Job %d submitted\n", job->id);
+	fprintf(out, "ok %d\n", job->id);
+}
+
+static void daemon_cancel(const char *arg, FILE *out)
+{
+	struct job **pj;
+	int id = arg ? atoi(arg) : 0;
+
+	pthread_mutex_lock(&daemon_lock);
+	for (pj = &daemon_state.jobs; *pj && (*pj)->id != id; pj = &(*pj)->next)
+		;
+	if (!*pj || (*pj)->state >= JOB_DONE)
+	{
+		pthread_mutex_unlock(&daemon_lock);
+		fprintf(out, "error no active job %d\n", id);
+		return;
+	}
+	// A running job stops once its current sessions have finished
+	if ((*pj)->state == JOB_QUEUED)
+		(*pj)->state = JOB_CANCELLED;
+	else
+		(*pj)->cancel = 1;
+	pthread_mutex_unlock(&daemon_lock);
+	fprintf(out, "ok %d\n", id);
+}
+
+static void daemon_status(FILE *out)
+{
+	struct job *job;
+
+	pthread_mutex_lock(&daemon_lock);
+	for (job = daemon_state.jobs; job; job = job->next)
+	{
+		fprintf(out, "job %d %s %d/%d", job->id,
+			job->cancel && job->state == JOB_RUNNING ? "cancelling" : job_states[job->state],
+			job->completed, job->count);
+		if (job->directory)
+			fprintf(out, " dir=%s", job->directory);
+		if (job->pathname)
+			fprintf(out, " path=%s", job->pathname);
+		if (job->port != 99)
+			fprintf(out, " port=%d", job->port);
+		if (job->serial)
+			fprintf(out, " serial=%s", job->serial);
+		if (job->metadata)
+			fprintf(out, " metadata=%s", job->metadata);
+		fprintf(out, "\n");
+	}
+	pthread_mutex_unlock(&daemon_lock);
+	daemon_state.status(out);
+}
+
+static void daemon_handle(int fd)
+{
+	struct timeval tv = { 1, 0 };
+	char line[DAEMON_LINE_LEN];
+	char *command, *args, *saveptr;
+	size_t len = 0;
+	FILE *out;
+
+	// Don't let a client which doesn't send anything, or doesn't read the
+	// reply, block the socket
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	while (len < sizeof(line) - 1)
+	{
+		ssize_t n = read(fd, line + len, sizeof(line) - 1 - len);
+
+		if (n <= 0)
+			break;
+		len += n;
+		if (memchr(line, '\n', len))
+			break;
+	}
+	line[len] = 0;
+	line[strcspn(line, "\r\n")] = 0;
+
+	out = fdopen(fd, "w");
+	if (!out)
+	{
+		close(fd);
+		return;
+	}
+
+	command = strtok_r(line, " \t", &saveptr);
+	args = strtok_r(NULL, "", &saveptr);
+	if (!command)
+		fprintf(out, "error empty command\n");
+	else if (strcmp(command, "submit") == 0)
+		daemon_submit(args ? args : "", out);
+	else if (strcmp(command, "status") == 0)
+		daemon_status(out);
+	else if (strcmp(command, "cancel") == 0)
+		daemon_cancel(args, out);
+	else
+		fprintf(out, "error unknown command '%s'\n", command);
+	fclose(out);
+
+	daemon_state.wake();
+}
+
+static void *daemon_thread(void *arg)
+{
+	(void) arg;
+	for (;;)
+	{
+		int fd = accept(daemon_state.fd, NULL, NULL);
+
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		daemon_handle(fd);
+	}
+	return NULL;
+}
+
+int daemon_open(const char *path, void (*status)(FILE *out), void (*wake)(void))
+{
+	struct sockaddr_un addr;
+	pthread_attr_t attr;
+	pthread_t thread;
+	mode_t mask;
+	int ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Control socket path too long: %s\n", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	daemon_state.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (daemon_state.fd < 0)
+		return -1;
+	unlink(path);
+
+	// A client which hangs up before reading its reply mustn't kill rpiboot
+	signal(SIGPIPE, SIG_IGN);
+
+	// Only the user running rpiboot may submit jobs
+	mask = umask(077);
+	ret = bind(daemon_state.fd, (struct sockaddr *) &addr, sizeof(addr));
+	umask(mask);
+	if (ret < 0 || listen(daemon_state.fd, 8) < 0)
+	{
+		fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+		close(daemon_state.fd);
+		daemon_state.fd = -1;
+		return -1;
+	}
+	strcpy(daemon_state.path, path);
+	daemon_state.status = status;
+	daemon_state.wake = wake;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, daemon_thread, NULL) != 0)
+	{
+		pthread_attr_destroy(&attr);
+		daemon_close();
+		return -1;
+	}
+	pthread_attr_destroy(&attr);
+	printf("Listening for jobs on %s\n", path);
+	return 0;
+}
+
+// Returns the next queued job, which is marked as running, or NULL
+struct job *daemon_next_job(void)
+{
+	struct job *job;
+
+	pthread_mutex_lock(&daemon_lock);
+	for (job = daemon_state.jobs; job && job->state != JOB_QUEUED; job = job->next)
+		;
+	if (job)
+		job->state = JOB_RUNNING;
+	pthread_mutex_unlock(&daemon_lock);
+	return job;
+}
+
+// Adds completed devices to a running job. Returns 1 once the job should
+// stop taking new devices because it has booted enough or was cancelled.
+int daemon_job_progress(struct job *job, int completed)
+{
+	int done;
+
+	pthread_mutex_lock(&daemon_lock);
+	job->completed += completed;
+	done = job->cancel || job->completed >= job->count;
+	pthread_mutex_unlock(&daemon_lock);
+	return done;
+}
+
+void daemon_job_finish(struct job *job, int state)
+{
+	pthread_mutex_lock(&daemon_lock);
+	job->state = job->cancel && state == JOB_DONE ? JOB_CANCELLED : state;
+	printf("Job %d %s (%d/%d devices)\n", job->id, job_states[job->state], job->completed, job->count);
+	daemon_prune();
+	pthread_mutex_unlock(&daemon_lock);
+}
+
+void daemon_close(void)
+{
+	if (daemon_state.fd < 0)
+		return;
+	close(daemon_state.fd);
+	unlink(daemon_state.path);
+	daemon_state.fd = -1;
+}
+
+// Sends a command to a running daemon and prints the reply
+int daemon_command(const char *path, int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+	char buf[DAEMON_LINE_LEN];
+	int fd, i, ret = 0;
+	ssize_t n;
+	size_t len = 0;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+	{
+		fprintf(stderr, "Failed to connect to %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	for (i = 0; i < argc; i++)
+		len += snprintf(buf + len, len < sizeof(buf) ? sizeof(buf) - len : 0, "%s%s", i ? " " : "", argv[i]);
+	if (len >= sizeof(buf) - 1)
+	{
+		fprintf(stderr, "Command too long\n");
+		close(fd);
+		return -1;
+	}
+	buf[len++] = '\n';
+	if (write(fd, buf, len) != (ssize_t) len)
+		ret = -1;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+	{
+		if (strncmp(buf, "error", 5) == 0)
+			ret = -1;
+		fwrite(buf, 1, n, stdout);
+	}
+	close(fd);
+	return ret;
+}
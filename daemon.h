@@ -0,0 +1,33 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+#include <stdio.h>
+
+#define JOB_QUEUED	0
+#define JOB_RUNNING	1
+#define JOB_DONE	2
+#define JOB_CANCELLED	3
+#define JOB_FAILED	4
+
+// A provisioning job submitted over the control socket. The strings are
+// NULL if they weren't given.
+struct job {
+	int id;
+	char *directory;
+	char *pathname;		// -p
+	int port;		// -0 to -98, or 99 for any port
+	char *serial;		// -i
+	char *metadata;		// -j
+	int count;		// Devices to boot before the job is done
+	int completed;
+	int state;
+	int cancel;
+	struct job *next;
+};
+
+int daemon_open(const char *path, void (*status)(FILE *out), void (*wake)(void));
+struct job *daemon_next_job(void);
+int daemon_job_progress(struct job *job, int completed);
+void daemon_job_finish(struct job *job, int state);
+void daemon_close(void);
+int daemon_command(const char *path, int argc, char *argv[]);
+#endif
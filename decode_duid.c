@@ -42,8 +42,9 @@ int duid_decode_c40(char * str_of_words, char *c40_str)
 	int c40_list[DUID_LENGTH], i = 0, c;
 	uint32_t word;
 	uint16_t msig;
+	char *saveptr;
 
-	char *word_str = strtok(str_of_words, "_");
+	char *word_str = strtok_r(str_of_words, "_", &saveptr);
 	while (word_str != NULL)
 	{
 		word = strtoul(word_str, NULL, 16);
@@ -54,7 +55,7 @@ int duid_decode_c40(char * str_of_words, char *c40_str)
 		if (msig > 0)
 			decode_half_word(msig, c40_list, &i);
 
-		word_str = strtok(NULL, "_");
+		word_str = strtok_r(NULL, "_", &saveptr);
 	}
 
 	for (c = 0; c < i; c++)
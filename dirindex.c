@@ -0,0 +1,576 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "dirindex.h"
+
+// The boot directories are scanned once and the result of stat() for every
+// file and directory below them is kept in a hash table. An inotify watch on
+// each directory keeps the table current, so looking up a path below an
+// indexed directory needs no system calls and a path which isn't in the
+// table is known not to exist. Paths elsewhere, or on platforms without
+// inotify, fall back to stat().
+//
+// Changes to the target of a symbolic link are not reported, so a link is
+// indexed as such and is stat()ed on every lookup, as is any path below a
+// link to a directory. Directories containing links are not enumerated
+// from the index.
+
+extern int verbose;
+
+#define DIRINDEX_PATH_LEN	512
+#define DIRINDEX_MAX_ROOTS	8
+#define DIRINDEX_MAX_DEPTH	8
+
+struct dirindex_entry {
+	char *path;
+	uint32_t hash;
+	struct stat st;
+	int link;		// Symbolic link whose target must be stat()ed
+	struct dirindex_entry *next;
+};
+
+struct dirindex_watch {
+	int wd;
+	char *path;
+};
+
+static struct {
+	char *roots[DIRINDEX_MAX_ROOTS];
+	int num_roots;
+	struct dirindex_entry **buckets;
+	unsigned num_buckets;
+	unsigned num_entries;
+	struct dirindex_watch *watches;
+	int num_watches;
+	int max_watches;
+	int fd;
+	int started;
+	unsigned long generation;
+} dirindex = { .fd = -1 };
+
+static pthread_rwlock_t dirindex_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Paths are compared after removing repeated and trailing slashes
+static void dirindex_normalize(char *out, size_t len, const char *path)
+{
+	size_t n = 0;
+
+	for (; *path && n + 1 < len; path++)
+	{
+		if (*path == '/' && n > 0 && out[n - 1] == '/')
+			continue;
+		out[n++] = *path;
+	}
+	while (n > 1 && out[n - 1] == '/')
+		n--;
+	out[n] = 0;
+}
+
+static uint32_t dirindex_hash(const char *path)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*path)
+	{
+		hash ^= (uint8_t) *path++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static struct dirindex_entry **dirindex_find(const char *path, uint32_t hash)
+{
+	struct dirindex_entry **pe;
+
+	if (!dirindex.num_buckets)
+		return NULL;
+	for (pe = &dirindex.buckets[hash & (dirindex.num_buckets - 1)]; *pe; pe = &(*pe)->next)
+		if ((*pe)->hash == hash && strcmp((*pe)->path, path) == 0)
+			return pe;
+	return NULL;
+}
+
+static int dirindex_rehash(unsigned num_buckets)
+{
+	struct dirindex_entry **buckets = calloc(num_buckets, sizeof(*buckets));
+	unsigned i;
+
+	if (!buckets)
+		return -1;
+	for (i = 0; i < dirindex.num_buckets; i++)
+	{
+		struct dirindex_entry *e, *next;
+
+		for (e = dirindex.buckets[i]; e; e = next)
+		{
+			next = e->next;
+			e->next = buckets[e->hash & (num_buckets - 1)];
+			buckets[e->hash & (num_buckets - 1)] = e;
+		}
+	}
+	free(dirindex.buckets);
+	dirindex.buckets = buckets;
+	dirindex.num_buckets = num_buckets;
+	return 0;
+}
+
+static void dirindex_set(const char *path, const struct stat *st)
+{
+	uint32_t hash = dirindex_hash(path);
+	struct dirindex_entry **pe = dirindex_find(path, hash);
+	struct dirindex_entry *e;
+
+	if (pe)
+	{
+		(*pe)->st = *st;
+		(*pe)->link = S_ISLNK(st->st_mode);
+		return;
+	}
+
+	if (dirindex.num_entries >= dirindex.num_buckets &&
+		dirindex_rehash(dirindex.num_buckets ? dirindex.num_buckets * 2 : 256) < 0)
+		return;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return;
+	e->path = strdup(path);
+	if (!e->path)
+	{
+		free(e);
+		return;
+	}
+	e->hash = hash;
+	e->st = *st;
+	e->link = S_ISLNK(st->st_mode);
+	e->next = dirindex.buckets[hash & (dirindex.num_buckets - 1)];
+	dirindex.buckets[hash & (dirindex.num_buckets - 1)] = e;
+	dirindex.num_entries++;
+}
+
+// Removes 'path' and everything below it
+static void dirindex_remove(const char *path)
+{
+	size_t len = strlen(path);
+	unsigned i;
+
+	for (i = 0; i < dirindex.num_buckets; i++)
+	{
+		struct dirindex_entry **pe = &dirindex.buckets[i];
+
+		while (*pe)
+		{
+			struct dirindex_entry *e = *pe;
+
+			if (strncmp(e->path, path, len) == 0 && (e->path[len] == 0 || e->path[len] == '/'))
+			{
+				*pe = e->next;
+				free(e->path);
+				free(e);
+				dirindex.num_entries--;
+				continue;
+			}
+			pe = &e->next;
+		}
+	}
+}
+
+#ifdef __linux__
+#define DIRINDEX_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+	IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+static void dirindex_watch(const char *path)
+{
+	int wd = inotify_add_watch(dirindex.fd, path, DIRINDEX_EVENTS);
+	int i;
+
+	if (wd < 0)
+		return;
+	for (i = 0; i < dirindex.num_watches; i++)
+	{
+		if (dirindex.watches[i].wd == wd)
+		{
+			free(dirindex.watches[i].path);
+			dirindex.watches[i].path = strdup(path);
+			return;
+		}
+	}
+	if (dirindex.num_watches == dirindex.max_watches)
+	{
+		int max_watches = dirindex.max_watches ? dirindex.max_watches * 2 : 16;
+		struct dirindex_watch *watches = realloc(dirindex.watches, max_watches * sizeof(*watches));
+
+		if (!watches)
+			return;
+		dirindex.watches = watches;
+		dirindex.max_watches = max_watches;
+	}
+	dirindex.watches[dirindex.num_watches].wd = wd;
+	dirindex.watches[dirindex.num_watches].path = strdup(path);
+	dirindex.num_watches++;
+}
+
+static const char *dirindex_watch_path(int wd)
+{
+	int i;
+
+	for (i = 0; i < dirindex.num_watches; i++)
+		if (dirindex.watches[i].wd == wd)
+			return dirindex.watches[i].path;
+	return NULL;
+}
+
+static void dirindex_unwatch(int wd)
+{
+	int i;
+
+	for (i = 0; i < dirindex.num_watches; i++)
+	{
+		if (dirindex.watches[i].wd == wd)
+		{
+			free(dirindex.watches[i].path);
+			dirindex.watches[i] = dirindex.watches[--dirindex.num_watches];
+			return;
+		}
+	}
+}
+#else
+static void dirindex_watch(const char *path)
+{
+	(void) path;
+}
+#endif
+
+static void dirindex_scan(const char *path, int depth)
+{
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(path);
+	if (!d)
+		return;
+	dirindex_watch(path);
+
+	while ((de = readdir(d)) != NULL)
+	{
+		char child[DIRINDEX_PATH_LEN];
+		struct stat st;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (snprintf(child, sizeof(child), "%s/%s", path, de->d_name) >= (int) sizeof(child))
+			continue;
+		if (lstat(child, &st) < 0)
+			continue;
+		if (S_ISDIR(st.st_mode) && depth == DIRINDEX_MAX_DEPTH)
+			continue;
+		dirindex_set(child, &st);
+		if (S_ISDIR(st.st_mode))
+			dirindex_scan(child, depth + 1);
+	}
+	closedir(d);
+}
+
+// Returns the depth of 'path' below an indexed root or -1
+static int dirindex_root_depth(const char *path)
+{
+	int i;
+
+	for (i = 0; i < dirindex.num_roots; i++)
+	{
+		size_t len = strlen(dirindex.roots[i]);
+
+		if (strncmp(path, dirindex.roots[i], len) == 0 && (path[len] == 0 || path[len] == '/'))
+		{
+			int depth = 0;
+
+			for (path += len; *path; path++)
+				depth += (*path == '/');
+			return depth;
+		}
+	}
+	return -1;
+}
+
+#ifdef __linux__
+// Applies the changes reported by inotify to the index
+static void *dirindex_thread(void *arg)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	(void) arg;
+	for (;;)
+	{
+		ssize_t len = read(dirindex.fd, buf, sizeof(buf));
+		char *p;
+
+		if (len <= 0)
+		{
+			if (len < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+
+		pthread_rwlock_wrlock(&dirindex_lock);
+		for (p = buf; p < buf + len; )
+		{
+			const struct inotify_event *ev = (const struct inotify_event *) p;
+			const char *dir = dirindex_watch_path(ev->wd);
+			char path[DIRINDEX_PATH_LEN];
+			struct stat st;
+
+			p += sizeof(*ev) + ev->len;
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				// Events were lost so start again
+				int i;
+
+				if (verbose)
+					printf("Directory index overflowed, rescanning\n");
+				for (i = 0; i < dirindex.num_roots; i++)
+				{
+					dirindex_remove(dirindex.roots[i]);
+					if (stat(dirindex.roots[i], &st) == 0)
+					{
+						dirindex_set(dirindex.roots[i], &st);
+						dirindex_scan(dirindex.roots[i], 0);
+					}
+				}
+				continue;
+			}
+			if (ev->mask & IN_IGNORED)
+			{
+				dirindex_unwatch(ev->wd);
+				continue;
+			}
+			if (!dir || !ev->len)
+				continue;
+
+			snprintf(path, sizeof(path), "%s/%s", dir, ev->name);
+			if (verbose > 1)
+				printf("Directory index: %s changed (%x)\n", path, ev->mask);
+			if (lstat(path, &st) == 0)
+			{
+				int is_new_dir = S_ISDIR(st.st_mode) && !dirindex_find(path, dirindex_hash(path));
+
+				dirindex_set(path, &st);
+				if (is_new_dir && dirindex_root_depth(path) <= DIRINDEX_MAX_DEPTH)
+					dirindex_scan(path, dirindex_root_depth(path));
+			}
+			else
+			{
+				dirindex_remove(path);
+			}
+		}
+		__atomic_add_fetch(&dirindex.generation, 1, __ATOMIC_RELEASE);
+		pthread_rwlock_unlock(&dirindex_lock);
+	}
+	return NULL;
+}
+#endif
+
+// Indexes 'dir' and everything below it. Nothing is indexed if the
+// changes can't be watched.
+int dirindex_add(const char *dir)
+{
+	char root[DIRINDEX_PATH_LEN];
+	struct stat st;
+	int i;
+
+#ifdef __linux__
+	dirindex_normalize(root, sizeof(root), dir);
+	if (stat(root, &st) < 0 || !S_ISDIR(st.st_mode))
+		return -1;
+
+	pthread_rwlock_wrlock(&dirindex_lock);
+	for (i = 0; i < dirindex.num_roots; i++)
+	{
+		if (strcmp(dirindex.roots[i], root) == 0)
+		{
+			pthread_rwlock_unlock(&dirindex_lock);
+			return 0;
+		}
+	}
+	if (dirindex.fd < 0)
+		dirindex.fd = inotify_init();
+	if (dirindex.fd < 0 || dirindex.num_roots == DIRINDEX_MAX_ROOTS ||
+		dirindex_root_depth(root) >= 0)
+	{
+		pthread_rwlock_unlock(&dirindex_lock);
+		return -1;
+	}
+
+	dirindex_set(root, &st);
+	dirindex_scan(root, 0);
+	dirindex.roots[dirindex.num_roots++] = strdup(root);
+	__atomic_add_fetch(&dirindex.generation, 1, __ATOMIC_RELEASE);
+	if (verbose)
+		printf("Indexed %s (%u entries, %d directories watched)\n", root,
+			dirindex.num_entries, dirindex.num_watches);
+
+	if (!dirindex.started)
+	{
+		pthread_attr_t attr;
+		pthread_t thread;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		dirindex.started = (pthread_create(&thread, &attr, dirindex_thread, NULL) == 0);
+		pthread_attr_destroy(&attr);
+	}
+	pthread_rwlock_unlock(&dirindex_lock);
+	return 0;
+#else
+	(void) dir;
+	(void) root;
+	(void) st;
+	(void) i;
+	return -1;
+#endif
+}
+
+// Returns the entry of the nearest indexed parent of 'path'
+static struct dirindex_entry **dirindex_find_parent(const char *path)
+{
+	char parent[DIRINDEX_PATH_LEN];
+	char *slash;
+
+	snprintf(parent, sizeof(parent), "%s", path);
+	while ((slash = strrchr(parent, '/')) != NULL && slash != parent)
+	{
+		struct dirindex_entry **pe;
+
+		*slash = 0;
+		pe = dirindex_find(parent, dirindex_hash(parent));
+		if (pe)
+			return pe;
+	}
+	return NULL;
+}
+
+// Returns 1 if there is a symbolic link at or below 'path'
+static int dirindex_has_links(const char *path)
+{
+	size_t len = strlen(path);
+	unsigned i;
+
+	for (i = 0; i < dirindex.num_buckets; i++)
+	{
+		struct dirindex_entry *e;
+
+		for (e = dirindex.buckets[i]; e; e = e->next)
+			if (e->link && strncmp(e->path, path, len) == 0 && (e->path[len] == 0 || e->path[len] == '/'))
+				return 1;
+	}
+	return 0;
+}
+
+// Returns 1 if every child of the directory 'e' is in the index. The
+// subdirectories of the directories at the maximum depth are left out.
+static int dirindex_scanned(const struct dirindex_entry *e)
+{
+	return S_ISDIR(e->st.st_mode) && dirindex_root_depth(e->path) < DIRINDEX_MAX_DEPTH;
+}
+
+// stat() which answers from the index for paths below an indexed directory.
+// Paths which are too long or too deep to be indexed are passed to stat().
+int dirindex_stat(const char *path, struct stat *st)
+{
+	char norm[DIRINDEX_PATH_LEN];
+	struct dirindex_entry **pe;
+	int ret;
+
+	if (strlen(path) >= sizeof(norm))
+		return stat(path, st);
+	dirindex_normalize(norm, sizeof(norm), path);
+	pthread_rwlock_rdlock(&dirindex_lock);
+	if (!dirindex.started || dirindex_root_depth(norm) < 0)
+	{
+		pthread_rwlock_unlock(&dirindex_lock);
+		return stat(path, st);
+	}
+	pe = dirindex_find(norm, dirindex_hash(norm));
+	if (!pe)
+		pe = dirindex_find_parent(norm);
+	if (pe && (*pe)->link)
+	{
+		pthread_rwlock_unlock(&dirindex_lock);
+		return stat(path, st);
+	}
+	if (pe && strcmp((*pe)->path, norm) == 0)
+	{
+		*st = (*pe)->st;
+		ret = 0;
+	}
+	else if (pe && dirindex_scanned(*pe))
+	{
+		errno = ENOENT;
+		ret = -1;
+	}
+	else
+	{
+		// Below a directory which was too deep to scan
+		pthread_rwlock_unlock(&dirindex_lock);
+		return stat(path, st);
+	}
+	pthread_rwlock_unlock(&dirindex_lock);
+	return ret;
+}
+
+// Returns 1 if changes to 'path' are tracked by the index
+int dirindex_contains(const char *path)
+{
+	char norm[DIRINDEX_PATH_LEN];
+	int ret;
+
+	dirindex_normalize(norm, sizeof(norm), path);
+	pthread_rwlock_rdlock(&dirindex_lock);
+	ret = dirindex.started && dirindex_root_depth(norm) >= 0 && !dirindex_has_links(norm);
+	pthread_rwlock_unlock(&dirindex_lock);
+	return ret;
+}
+
+// Changes whenever the contents of an indexed directory change
+unsigned long dirindex_generation(void)
+{
+	return __atomic_load_n(&dirindex.generation, __ATOMIC_ACQUIRE);
+}
+
+// Calls fn for each regular file below 'dir' with its path relative to
+// 'dir'. Returns -1 if 'dir' isn't indexed or contains symbolic links.
+int dirindex_foreach(const char *dir, void (*fn)(void *ctx, const char *name, const struct stat *st), void *ctx)
+{
+	char norm[DIRINDEX_PATH_LEN];
+	size_t len;
+	unsigned i;
+
+	dirindex_normalize(norm, sizeof(norm), dir);
+	len = strlen(norm);
+	pthread_rwlock_rdlock(&dirindex_lock);
+	if (!dirindex.started || dirindex_root_depth(norm) < 0 || dirindex_has_links(norm))
+	{
+		pthread_rwlock_unlock(&dirindex_lock);
+		return -1;
+	}
+	for (i = 0; i < dirindex.num_buckets; i++)
+	{
+		struct dirindex_entry *e;
+
+		for (e = dirindex.buckets[i]; e; e = e->next)
+			if (S_ISREG(e->st.st_mode) && strncmp(e->path, norm, len) == 0 && e->path[len] == '/')
+				fn(ctx, e->path + len + 1, &e->st);
+	}
+	pthread_rwlock_unlock(&dirindex_lock);
+	return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+#include <sys/stat.h>
+
+// In-memory index of the boot directories kept current with inotify.
+int dirindex_add(const char *dir);
+int dirindex_stat(const char *path, struct stat *st);
+int dirindex_contains(const char *path);
+unsigned long dirindex_generation(void);
+int dirindex_foreach(const char *dir, void (*fn)(void *ctx, const char *name, const struct stat *st), void *ctx);
+
+// Sub-second part of the mtime, so that files rewritten within the same
+// second are seen to change
+static inline long dirindex_mtime_ns(const struct stat *st)
+{
+#ifdef __APPLE__
+	return st->st_mtimespec.tv_nsec;
+#else
+	return st->st_mtim.tv_nsec;
+#endif
+}
+#endif
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "eeprom.h"
+#include "sha256.h"
+
+// Replaces the bootloader config in a pieeprom image in the same way as
+// rpi-eeprom-config --config and writes the pieeprom.sig text that
+// rpi-eeprom-digest would, so per-device images can be generated without
+// the Python tools. Signed configs (bootconf.sig) aren't supported.
+//
+// The image is a sequence of sections, each starting on an 8 byte boundary
+// with a big endian magic and the length of the rest of the section. File
+// sections then have a 12 byte name and a reserved word before the data.
+
+#define EEPROM_MAGIC		0x55aaf00f
+#define EEPROM_MAGIC_MASK	0xfffff00f
+#define EEPROM_FILE_MAGIC	0x55aaf11f
+#define EEPROM_PAD_MAGIC	0x55aafeef
+#define EEPROM_FILENAME_LEN	12
+#define EEPROM_FILE_HDR_LEN	24
+#define EEPROM_ERASE_SIZE	4096	// The last sector is the bootloader's scratch space
+#define EEPROM_CONFIG_FILE	"bootconf.txt"
+
+static uint32_t be32(const uint8_t *p)
+{
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+// Finds the config section and the space available for it. Returns -1 if
+// the image is corrupt or has no config.
+int eeprom_parse(const uint8_t *image, size_t size, struct eeprom_layout *layout)
+{
+	size_t offset = 0;
+	int found = 0;
+
+	memset(layout, 0, sizeof(*layout));
+	layout->size = size;
+	if (size < 2 * EEPROM_ERASE_SIZE)
+	{
+		fprintf(stderr, "EEPROM image is too small\n");
+		return -1;
+	}
+	layout->config_end = size - EEPROM_ERASE_SIZE;
+
+	while (offset + 8 <= size)
+	{
+		uint32_t magic = be32(image + offset);
+		uint32_t length = be32(image + offset + 4);
+
+		if (magic == 0 || magic == 0xffffffff)
+			break;
+		if ((magic & EEPROM_MAGIC_MASK) != EEPROM_MAGIC || length > size - offset - 8)
+		{
+			fprintf(stderr, "EEPROM image is corrupt at offset %zu\n", offset);
+			return -1;
+		}
+
+		if (found && magic != EEPROM_PAD_MAGIC)
+		{
+			layout->config_end = offset;
+			break;
+		}
+		if (magic == EEPROM_FILE_MAGIC && length >= EEPROM_FILE_HDR_LEN - 8 &&
+			strncmp((const char *) image + offset + 8, EEPROM_CONFIG_FILE, EEPROM_FILENAME_LEN) == 0)
+		{
+			layout->config_offset = offset;
+			found = 1;
+		}
+		offset = (offset + 8 + length + 7) & ~(size_t) 7;
+	}
+
+	if (!found)
+	{
+		fprintf(stderr, "EEPROM image has no %s\n", EEPROM_CONFIG_FILE);
+		return -1;
+	}
+	if (layout->config_end > size - EEPROM_ERASE_SIZE)
+		layout->config_end = size - EEPROM_ERASE_SIZE;
+	return 0;
+}
+
+// Replaces the config in 'image', which must be a copy of the image that
+// was parsed. Space freed by a shorter config becomes a padding section.
+int eeprom_set_config(uint8_t *image, const struct eeprom_layout *layout, const void *config, size_t len)
+{
+	size_t end = layout->config_offset + EEPROM_FILE_HDR_LEN + len;
+
+	if (end > layout->config_end)
+	{
+		fprintf(stderr, "Bootloader config is too large (%zu bytes, at most %zu)\n", len,
+			layout->config_end - layout->config_offset - EEPROM_FILE_HDR_LEN);
+		return -1;
+	}
+
+	put_be32(image + layout->config_offset + 4, len + EEPROM_FILE_HDR_LEN - 8);
+	memcpy(image + layout->config_offset + EEPROM_FILE_HDR_LEN, config, len);
+
+	// Erased flash reads as all ones
+	while (end % 8)
+		image[end++] = 0xff;
+	if (layout->config_end - end >= 8)
+	{
+		put_be32(image + end, EEPROM_PAD_MAGIC);
+		put_be32(image + end + 4, layout->config_end - end - 8);
+		end += 8;
+	}
+	memset(image + end, 0xff, layout->config_end - end);
+	return 0;
+}
+
+// Writes the contents of pieeprom.sig: the SHA-256 of the image and the
+// update timestamp. Returns the length of the text.
+int eeprom_sig(const uint8_t *image, size_t size, uint64_t ts, char *sig, size_t len)
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	char hex[2 * SHA256_DIGEST_SIZE + 1];
+	int i;
+
+	sha256(image, size, digest);
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+	return snprintf(sig, len, "%s\nts: %llu\n", hex, (unsigned long long) ts);
+}
@@ -0,0 +1,18 @@
+#ifndef EEPROM_H
+#define EEPROM_H
+#include <stddef.h>
+#include <stdint.h>
+
+// Location of the bootloader config (bootconf.txt) in a pieeprom image
+struct eeprom_layout {
+	size_t size;
+	size_t config_offset;	// Start of the bootconf.txt section
+	size_t config_end;	// Start of the next section which isn't padding
+};
+
+#define EEPROM_SIG_MAX	96
+
+int eeprom_parse(const uint8_t *image, size_t size, struct eeprom_layout *layout);
+int eeprom_set_config(uint8_t *image, const struct eeprom_layout *layout, const void *config, size_t len);
+int eeprom_sig(const uint8_t *image, size_t size, uint64_t ts, char *sig, size_t len);
+#endif
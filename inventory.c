@@ -0,0 +1,591 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "inventory.h"
+
+// Append-only store of device metadata for a whole fleet.
+//
+// inventory.ndjson holds one JSON object per boot, in the order the devices
+// were booted, so an export is a copy of the file. inventory.idx holds a
+// fixed size entry for each record giving the offset and length of the
+// record, the hash of the serial number or of the FACTORY_UUID and the
+// previous entry in the same hash bucket. inventory.hash holds the latest
+// entry of each bucket so a point lookup only reads the entries in the
+// key's bucket, newest first. Records are made durable by an fsync of the
+// data and the index once every INVENTORY_SYNC_BATCH records or
+// INVENTORY_SYNC_MS milliseconds.
+//
+// The store may be shared by several rpiboot processes. Writers append
+// under an exclusive flock of inventory.ndjson and readers take a shared
+// one. The index is written after the record and the bucket heads after
+// the index so if rpiboot stops between the writes the missing entries
+// and heads are rebuilt from the tail of the data and of the index by the
+// next writer.
+
+extern int verbose;
+
+#define INVENTORY_DATA		"inventory.ndjson"
+#define INVENTORY_INDEX		"inventory.idx"
+#define INVENTORY_HASH		"inventory.hash"
+#define INVENTORY_HASH_MAGIC	0x48564e49
+#define INVENTORY_BUCKETS	65536
+#define INVENTORY_PATH_LEN	512
+#define INVENTORY_SYNC_BATCH	32
+#define INVENTORY_SYNC_MS	1000
+#define INVENTORY_MAX_RECORD	(64 * 1024)
+
+#define KEY_SERIAL	1
+#define KEY_UUID	2
+
+struct inventory_index_entry {
+	uint64_t hash;
+	uint64_t offset;
+	uint32_t length;
+	uint32_t kind;
+	uint64_t prev;		// 1 + previous entry in the bucket, 0 for none
+};
+
+// Followed by the 1 + latest entry of each bucket, 0 for none
+struct inventory_hash_header {
+	uint32_t magic;
+	uint32_t buckets;
+	uint64_t entries;	// Index entries included in the heads
+};
+
+struct inventory_record {
+	char serial[64];
+	char uuid[64];
+	char *json;
+	size_t len;
+	size_t size;
+};
+
+static struct {
+	int data_fd;
+	int index_fd;
+	int hash_fd;
+	uint64_t data_size;	// Only valid while the store is locked
+	uint64_t index_entries;	// Only valid while the store is locked
+	int pending;		// Records written since the last fsync
+	uint64_t last_sync_ms;
+} inventory = { -1, -1, -1, 0, 0, 0, 0 };
+
+static pthread_mutex_t inventory_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t inventory_hash(const char *key)
+{
+	uint64_t hash = 14695981039346656037ull;
+
+	while (*key)
+	{
+		hash ^= (uint8_t) *key++;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static uint64_t inventory_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len)
+	{
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static off_t head_offset(uint64_t hash)
+{
+	return sizeof(struct inventory_hash_header) + (hash % INVENTORY_BUCKETS) * sizeof(uint64_t);
+}
+
+static int read_head(int fd, uint64_t hash, uint64_t *head)
+{
+	return pread(fd, head, sizeof(*head), head_offset(hash)) == sizeof(*head) ? 0 : -1;
+}
+
+static int write_head(uint64_t hash, uint64_t head)
+{
+	return pwrite(inventory.hash_fd, &head, sizeof(head), head_offset(hash)) == sizeof(head) ? 0 : -1;
+}
+
+static int write_hash_header(uint64_t entries)
+{
+	struct inventory_hash_header header = { INVENTORY_HASH_MAGIC, INVENTORY_BUCKETS, entries };
+
+	return pwrite(inventory.hash_fd, &header, sizeof(header), 0) == sizeof(header) ? 0 : -1;
+}
+
+// Returns the number of index entries included in the bucket heads, or 0
+// if the heads don't match the index and can't be used.
+static uint64_t read_hash_header(int fd, uint64_t index_entries)
+{
+	struct inventory_hash_header header;
+
+	if (fd < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+		header.magic != INVENTORY_HASH_MAGIC || header.buckets != INVENTORY_BUCKETS ||
+		header.entries > index_entries)
+		return 0;
+	return header.entries;
+}
+
+// Brings the bucket heads up to date with the index
+static int inventory_hash_update(void)
+{
+	struct inventory_index_entry entry;
+	uint64_t i = read_hash_header(inventory.hash_fd, inventory.index_entries);
+
+	if (i && i == inventory.index_entries)
+		return 0;
+	if (i == 0)
+	{
+		// Start again, e.g. for a new store or after the index was truncated
+		if (ftruncate(inventory.hash_fd, 0) < 0 ||
+			ftruncate(inventory.hash_fd, sizeof(struct inventory_hash_header) +
+				INVENTORY_BUCKETS * sizeof(uint64_t)) < 0)
+			return -1;
+	}
+	for (; i < inventory.index_entries; i++)
+	{
+		if (pread(inventory.index_fd, &entry, sizeof(entry), i * sizeof(entry)) != sizeof(entry) ||
+			write_head(entry.hash, i + 1) < 0)
+			return -1;
+	}
+	return write_hash_header(inventory.index_entries);
+}
+
+static int append_index(uint64_t offset, uint32_t length, int kind, const char *key)
+{
+	struct inventory_index_entry entry;
+
+	if (!key[0])
+		return 0;
+	memset(&entry, 0, sizeof(entry));
+	entry.hash = inventory_hash(key);
+	entry.offset = offset;
+	entry.length = length;
+	entry.kind = kind;
+	if (read_head(inventory.hash_fd, entry.hash, &entry.prev) < 0 ||
+		write_all(inventory.index_fd, &entry, sizeof(entry)) < 0)
+		return -1;
+	inventory.index_entries++;
+	if (write_head(entry.hash, inventory.index_entries) < 0)
+		return -1;
+	return write_hash_header(inventory.index_entries);
+}
+
+// Extracts the string value of "name" from a record written by this file
+static int record_field(const char *json, const char *name, char *out, size_t out_len)
+{
+	char pattern[80];
+	const char *p;
+	size_t n = 0;
+
+	snprintf(pattern, sizeof(pattern), "\"%s\":\"", name);
+	p = strstr(json, pattern);
+	if (!p)
+		return -1;
+	for (p += strlen(pattern); *p && *p != '"' && n + 1 < out_len; p++)
+	{
+		if (*p == '\\' && p[1])
+			p++;
+		out[n++] = *p;
+	}
+	out[n] = 0;
+	return 0;
+}
+
+// Adds index entries for the records after the last indexed one. Called
+// with the store locked, so it also picks up the records appended by
+// other processes.
+static int inventory_recover(void)
+{
+	struct inventory_index_entry entry;
+	uint64_t indexed = 0;
+	off_t index_size = lseek(inventory.index_fd, 0, SEEK_END);
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	FILE *fp;
+
+	inventory.data_size = lseek(inventory.data_fd, 0, SEEK_END);
+
+	// Drop a partially written entry and any that point past the data
+	index_size -= index_size % sizeof(entry);
+	while (index_size > 0)
+	{
+		if (pread(inventory.index_fd, &entry, sizeof(entry), index_size - sizeof(entry)) != sizeof(entry))
+			return -1;
+		if (entry.offset + entry.length <= inventory.data_size)
+		{
+			indexed = entry.offset + entry.length;
+			break;
+		}
+		index_size -= sizeof(entry);
+	}
+	if (ftruncate(inventory.index_fd, index_size) < 0)
+		return -1;
+	inventory.index_entries = index_size / sizeof(entry);
+	if (inventory_hash_update() < 0)
+		return -1;
+	if (indexed == inventory.data_size)
+		return 0;
+
+	fp = fdopen(dup(inventory.data_fd), "r");
+	if (!fp || fseeko(fp, indexed, SEEK_SET) < 0)
+	{
+		if (fp)
+			fclose(fp);
+		return -1;
+	}
+	while ((len = getline(&line, &line_size, fp)) > 0)
+	{
+		char serial[64], uuid[64];
+
+		if (line[len - 1] != '\n')
+		{
+			// Incomplete record
+			if (ftruncate(inventory.data_fd, indexed) < 0)
+				break;
+			inventory.data_size = indexed;
+			break;
+		}
+		if (record_field(line, "serial", serial, sizeof(serial)) == 0)
+			append_index(indexed, len, KEY_SERIAL, serial);
+		if (record_field(line, "FACTORY_UUID", uuid, sizeof(uuid)) == 0)
+			append_index(indexed, len, KEY_UUID, uuid);
+		indexed += len;
+	}
+	if (verbose)
+		printf("Inventory: rebuilt the index up to offset %llu\n", (unsigned long long) indexed);
+	free(line);
+	fclose(fp);
+	return 0;
+}
+
+// Opens the data, index and bucket heads. The heads are optional when
+// reading.
+static int inventory_open_files(const char *dir, int flags, int *data_fd, int *index_fd, int *hash_fd)
+{
+	char path[INVENTORY_PATH_LEN];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, INVENTORY_DATA);
+	*data_fd = open(path, flags, 0644);
+	if (*data_fd < 0)
+		return -1;
+	snprintf(path, sizeof(path), "%s/%s", dir, INVENTORY_INDEX);
+	*index_fd = open(path, flags, 0644);
+	if (*index_fd < 0)
+	{
+		close(*data_fd);
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/%s", dir, INVENTORY_HASH);
+	*hash_fd = open(path, flags & ~O_APPEND, 0644);
+	if (*hash_fd < 0 && (flags & O_CREAT))
+	{
+		close(*data_fd);
+		close(*index_fd);
+		return -1;
+	}
+	return 0;
+}
+
+int inventory_open(const char *dir)
+{
+	int ret;
+
+	mkdir(dir, 0755);
+	if (inventory_open_files(dir, O_RDWR | O_CREAT | O_APPEND, &inventory.data_fd, &inventory.index_fd,
+		&inventory.hash_fd) < 0)
+	{
+		fprintf(stderr, "Failed to open the inventory in %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	flock(inventory.data_fd, LOCK_EX);
+	ret = inventory_recover();
+	flock(inventory.data_fd, LOCK_UN);
+	if (ret < 0)
+	{
+		fprintf(stderr, "Failed to recover the inventory index in %s\n", dir);
+		inventory_close();
+		return -1;
+	}
+	inventory.last_sync_ms = inventory_now_ms();
+	return 0;
+}
+
+int inventory_enabled(void)
+{
+	return inventory.data_fd >= 0;
+}
+
+static void record_append(struct inventory_record *r, const char *str, size_t len)
+{
+	if (r->len + len + 1 > r->size)
+	{
+		size_t size = r->size ? r->size * 2 : 256;
+		char *json;
+
+		while (size < r->len + len + 1)
+			size *= 2;
+		json = realloc(r->json, size);
+		if (!json)
+			return;
+		r->json = json;
+		r->size = size;
+	}
+	memcpy(r->json + r->len, str, len);
+	r->len += len;
+	r->json[r->len] = 0;
+}
+
+static void record_append_string(struct inventory_record *r, const char *str)
+{
+	record_append(r, "\"", 1);
+	for (; *str; str++)
+	{
+		char esc[8];
+
+		if (*str == '"' || *str == '\\')
+		{
+			esc[0] = '\\';
+			esc[1] = *str;
+			record_append(r, esc, 2);
+		}
+		else if ((unsigned char) *str < 0x20)
+		{
+			snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char) *str);
+			record_append(r, esc, strlen(esc));
+		}
+		else
+		{
+			record_append(r, str, 1);
+		}
+	}
+	record_append(r, "\"", 1);
+}
+
+struct inventory_record *inventory_record_create(const char *serial)
+{
+	struct inventory_record *r = calloc(1, sizeof(*r));
+	char time_str[32];
+
+	if (!r)
+		return NULL;
+	snprintf(r->serial, sizeof(r->serial), "%s", serial);
+	snprintf(time_str, sizeof(time_str), "%lld", (long long) time(NULL));
+	record_append(r, "{\"serial\":", 10);
+	record_append_string(r, serial);
+	record_append(r, ",\"time\":", 8);
+	record_append(r, time_str, strlen(time_str));
+	return r;
+}
+
+void inventory_record_add(struct inventory_record *r, const char *property, const char *value)
+{
+	if (!r || strcmp(property, "serial") == 0 || strcmp(property, "time") == 0)
+		return;
+	if (strcmp(property, "FACTORY_UUID") == 0)
+		snprintf(r->uuid, sizeof(r->uuid), "%s", value);
+	record_append(r, ",", 1);
+	record_append_string(r, property);
+	record_append(r, ":", 1);
+	record_append_string(r, value);
+}
+
+// Appends the record to the store and frees it
+int inventory_record_commit(struct inventory_record *r)
+{
+	int ret = -1;
+
+	if (!r)
+		return -1;
+	record_append(r, "}\n", 2);
+
+	pthread_mutex_lock(&inventory_lock);
+	if (inventory.data_fd >= 0 && r->json && r->len <= INVENTORY_MAX_RECORD &&
+		flock(inventory.data_fd, LOCK_EX) == 0)
+	{
+		// Another process may have appended to the store since it was opened
+		if (inventory_recover() == 0 && write_all(inventory.data_fd, r->json, r->len) == 0)
+		{
+			uint64_t offset = inventory.data_size;
+
+			inventory.data_size += r->len;
+			if (append_index(offset, r->len, KEY_SERIAL, r->serial) == 0 &&
+				append_index(offset, r->len, KEY_UUID, r->uuid) == 0)
+				ret = 0;
+			inventory.pending++;
+		}
+		flock(inventory.data_fd, LOCK_UN);
+	}
+	pthread_mutex_unlock(&inventory_lock);
+
+	if (ret < 0)
+		fprintf(stderr, "Failed to write the inventory record for %s\n", r->serial);
+	else if (verbose)
+		printf("Inventory: added %s\n", r->serial);
+	inventory_flush(0);
+
+	inventory_record_free(r);
+	return ret;
+}
+
+void inventory_record_free(struct inventory_record *r)
+{
+	if (!r)
+		return;
+	free(r->json);
+	free(r);
+}
+
+// Syncs the store once enough records are pending or enough time has passed
+void inventory_flush(int force)
+{
+	uint64_t now = inventory_now_ms();
+
+	pthread_mutex_lock(&inventory_lock);
+	if (inventory.data_fd >= 0 && inventory.pending &&
+		(force || inventory.pending >= INVENTORY_SYNC_BATCH ||
+		 now - inventory.last_sync_ms >= INVENTORY_SYNC_MS))
+	{
+		fsync(inventory.data_fd);
+		fsync(inventory.index_fd);
+		inventory.pending = 0;
+		inventory.last_sync_ms = now;
+	}
+	pthread_mutex_unlock(&inventory_lock);
+}
+
+void inventory_close(void)
+{
+	inventory_flush(1);
+	if (inventory.data_fd >= 0)
+		close(inventory.data_fd);
+	if (inventory.index_fd >= 0)
+		close(inventory.index_fd);
+	if (inventory.hash_fd >= 0)
+		close(inventory.hash_fd);
+	inventory.data_fd = inventory.index_fd = inventory.hash_fd = -1;
+}
+
+// Prints the record of the index entry if it is for 'key'
+static int lookup_entry(int data_fd, const struct inventory_index_entry *entry, const char *key,
+	uint64_t hash, char *record, FILE *out)
+{
+	char value[64];
+
+	if (entry->hash != hash || entry->length > INVENTORY_MAX_RECORD ||
+		pread(data_fd, record, entry->length, entry->offset) != (ssize_t) entry->length)
+		return 0;
+	record[entry->length] = 0;
+	// Check the key itself in case of a hash collision
+	if (record_field(record, entry->kind == KEY_SERIAL ? "serial" : "FACTORY_UUID", value, sizeof(value)) < 0 ||
+		strcmp(value, key) != 0)
+		return 0;
+	fputs(record, out);
+	return 1;
+}
+
+// Prints the latest record whose serial number or FACTORY_UUID is 'key'
+int inventory_lookup(const char *dir, const char *key, FILE *out)
+{
+	struct inventory_index_entry entry;
+	uint64_t hash = inventory_hash(key);
+	uint64_t entries, hashed, i;
+	char *record = malloc(INVENTORY_MAX_RECORD + 1);
+	int data_fd, index_fd, hash_fd;
+	int found = 0;
+
+	if (!record)
+		return -1;
+	if (inventory_open_files(dir, O_RDONLY, &data_fd, &index_fd, &hash_fd) < 0)
+	{
+		fprintf(stderr, "Failed to open the inventory in %s: %s\n", dir, strerror(errno));
+		free(record);
+		return -1;
+	}
+	flock(data_fd, LOCK_SH);
+	entries = lseek(index_fd, 0, SEEK_END) / sizeof(entry);
+	hashed = read_hash_header(hash_fd, entries);
+
+	// Entries which aren't in the bucket heads yet are searched one by one,
+	// newest first, then the bucket's chain is followed.
+	for (i = entries; i > hashed && !found; i--)
+	{
+		if (pread(index_fd, &entry, sizeof(entry), (i - 1) * sizeof(entry)) != sizeof(entry))
+			break;
+		found = lookup_entry(data_fd, &entry, key, hash, record, out);
+	}
+	if (!found && hashed && read_head(hash_fd, hash, &i) == 0)
+	{
+		while (i > 0 && i <= hashed && !found)
+		{
+			if (pread(index_fd, &entry, sizeof(entry), (i - 1) * sizeof(entry)) != sizeof(entry) ||
+				entry.prev >= i)
+				break;
+			found = lookup_entry(data_fd, &entry, key, hash, record, out);
+			i = entry.prev;
+		}
+	}
+
+	flock(data_fd, LOCK_UN);
+	free(record);
+	close(data_fd);
+	close(index_fd);
+	if (hash_fd >= 0)
+		close(hash_fd);
+	if (!found)
+		fprintf(stderr, "%s not found in the inventory\n", key);
+	return found ? 0 : -1;
+}
+
+// Streams every record as NDJSON
+int inventory_export(const char *dir, FILE *out)
+{
+	char path[INVENTORY_PATH_LEN];
+	char buf[65536];
+	size_t n;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, INVENTORY_DATA);
+	fp = fopen(path, "r");
+	if (!fp)
+	{
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		if (fwrite(buf, 1, n, out) != n)
+			break;
+	fclose(fp);
+	return ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,18 @@
+#ifndef INVENTORY_H
+#define INVENTORY_H
+#include <stdio.h>
+
+struct inventory_record;
+
+int inventory_open(const char *dir);
+int inventory_enabled(void);
+struct inventory_record *inventory_record_create(const char *serial);
+void inventory_record_add(struct inventory_record *r, const char *property, const char *value);
+int inventory_record_commit(struct inventory_record *r);
+void inventory_record_free(struct inventory_record *r);
+void inventory_flush(int force);
+void inventory_close(void);
+
+int inventory_lookup(const char *dir, const char *key, FILE *out);
+int inventory_export(const char *dir, FILE *out);
+#endif
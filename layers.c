@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "blob.h"
+#include "cache.h"
+#include "dirindex.h"
+#include "layers.h"
+
+// A file requested by a device is taken from the first of a list of layers
+// that has it: directories (e.g. per-serial, per-port, per-hub overlays,
+// the chip directory and the boot directory) and bootfiles.bin.
+//
+// Once compiled, the directory layers have been scanned into a hash table
+// mapping each file name to the set of layers that contain it, so a request
+// is a single lookup followed by opening the file from the winning layer.
+// Without compiling, every layer is tried in turn.
+
+#define LAYERS_MAX	8
+#define LAYERS_PATH_LEN	256
+#define LAYERS_MAX_DEPTH 8
+
+struct layer {
+	const char *name;
+	char path[LAYERS_PATH_LEN];	// Directory or archive
+	char prefix[16];		// Archive member prefix
+	int archive;
+	int flags;
+};
+
+struct layers_entry {
+	char *name;
+	uint32_t hash;
+	unsigned mask;		// Directory layers containing the file
+	int next;
+};
+
+struct layers {
+	struct layer layer[LAYERS_MAX];
+	int num_layers;
+	int compiled;
+	unsigned long generation;	// Of the directory index when compiled
+	struct layers_entry *entries;
+	int num_entries;
+	int max_entries;
+	int *buckets;
+	unsigned num_buckets;
+};
+
+static uint32_t layers_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*name)
+	{
+		hash ^= (uint8_t) *name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+struct layers *layers_create(void)
+{
+	return calloc(1, sizeof(struct layers));
+}
+
+void layers_add_dir(struct layers *l, const char *name, const char *dir, int flags)
+{
+	struct layer *layer;
+
+	if (!l || l->num_layers == LAYERS_MAX)
+		return;
+	layer = &l->layer[l->num_layers++];
+	memset(layer, 0, sizeof(*layer));
+	layer->name = name;
+	layer->flags = flags;
+	snprintf(layer->path, sizeof(layer->path), "%s", dir);
+}
+
+void layers_add_archive(struct layers *l, const char *name, const char *archive, const char *prefix)
+{
+	struct layer *layer;
+
+	if (!l || l->num_layers == LAYERS_MAX)
+		return;
+	layer = &l->layer[l->num_layers++];
+	memset(layer, 0, sizeof(*layer));
+	layer->name = name;
+	layer->archive = 1;
+	snprintf(layer->path, sizeof(layer->path), "%s", archive);
+	snprintf(layer->prefix, sizeof(layer->prefix), "%s", prefix);
+}
+
+static struct layers_entry *layers_find(const struct layers *l, const char *name)
+{
+	uint32_t hash = layers_hash(name);
+	int e;
+
+	if (!l->num_buckets)
+		return NULL;
+	for (e = l->buckets[hash & (l->num_buckets - 1)]; e >= 0; e = l->entries[e].next)
+		if (l->entries[e].hash == hash && strcmp(l->entries[e].name, name) == 0)
+			return &l->entries[e];
+	return NULL;
+}
+
+static int layers_rehash(struct layers *l, unsigned num_buckets)
+{
+	int *buckets = malloc(num_buckets * sizeof(int));
+	unsigned i;
+	int e;
+
+	if (!buckets)
+		return -1;
+	for (i = 0; i < num_buckets; i++)
+		buckets[i] = -1;
+	for (e = 0; e < l->num_entries; e++)
+	{
+		unsigned b = l->entries[e].hash & (num_buckets - 1);
+
+		l->entries[e].next = buckets[b];
+		buckets[b] = e;
+	}
+	free(l->buckets);
+	l->buckets = buckets;
+	l->num_buckets = num_buckets;
+	return 0;
+}
+
+static int layers_insert(struct layers *l, const char *name, int layer)
+{
+	struct layers_entry *entry = layers_find(l, name);
+
+	if (entry)
+	{
+		entry->mask |= 1u << layer;
+		return 0;
+	}
+
+	if (l->num_entries == l->max_entries)
+	{
+		int max_entries = l->max_entries ? l->max_entries * 2 : 64;
+		struct layers_entry *entries = realloc(l->entries, max_entries * sizeof(*entries));
+
+		if (!entries)
+			return -1;
+		l->entries = entries;
+		l->max_entries = max_entries;
+	}
+	entry = &l->entries[l->num_entries];
+	entry->name = strdup(name);
+	if (!entry->name)
+		return -1;
+	entry->hash = layers_hash(name);
+	entry->mask = 1u << layer;
+	l->num_entries++;
+
+	if ((unsigned) l->num_entries > l->num_buckets)
+		return layers_rehash(l, l->num_buckets ? l->num_buckets * 2 : 64);
+
+	entry->next = l->buckets[entry->hash & (l->num_buckets - 1)];
+	l->buckets[entry->hash & (l->num_buckets - 1)] = l->num_entries - 1;
+	return 0;
+}
+
+// The boot directory contains the chip directories, the per-device overlays
+// and the serial/ and hub/ trees, which are layers of their own.
+static int is_layer_dir(const char *name)
+{
+	return strcmp(name, "serial") == 0 || strcmp(name, "hub") == 0 ||
+		strspn(name, "0123456789-.") == strlen(name);
+}
+
+static int layers_scan(struct layers *l, int layer, const char *rel, int depth)
+{
+	char path[LAYERS_PATH_LEN * 2];
+	struct dirent *de;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "%s%s%s", l->layer[layer].path, rel[0] ? "/" : "", rel);
+	d = opendir(path);
+	if (!d)
+		return 0;
+
+	while ((de = readdir(d)) != NULL)
+	{
+		char name[LAYERS_PATH_LEN];
+		struct stat st;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		snprintf(name, sizeof(name), "%s%s%s", rel, rel[0] ? "/" : "", de->d_name);
+		snprintf(path, sizeof(path), "%s/%s", l->layer[layer].path, name);
+		if (stat(path, &st) < 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode))
+		{
+			if (depth == LAYERS_MAX_DEPTH ||
+				(depth == 0 && (l->layer[layer].flags & LAYER_BASE) && is_layer_dir(de->d_name)))
+				continue;
+			layers_scan(l, layer, name, depth + 1);
+		}
+		else if (S_ISREG(st.st_mode) && layers_insert(l, name, layer) < 0)
+		{
+			closedir(d);
+			return -1;
+		}
+	}
+	closedir(d);
+	return 0;
+}
+
+struct layers_index_ctx {
+	struct layers *l;
+	int layer;
+	int ret;
+};
+
+static void layers_index_file(void *arg, const char *name, const struct stat *st)
+{
+	struct layers_index_ctx *ctx = arg;
+	char top[LAYERS_PATH_LEN];
+
+	(void) st;
+	snprintf(top, sizeof(top), "%.*s", (int) strcspn(name, "/"), name);
+	if (name[strlen(top)] == '/' && (ctx->l->layer[ctx->layer].flags & LAYER_BASE) && is_layer_dir(top))
+		return;
+	if (layers_insert(ctx->l, name, ctx->layer) < 0)
+		ctx->ret = -1;
+}
+
+// Builds the table of files in the directory layers from the directory
+// index, or by scanning directories which aren't indexed. If the directory
+// index changes later each layer is tried in turn again.
+int layers_compile(struct layers *l)
+{
+	int i;
+
+	if (!l)
+		return -1;
+	l->generation = dirindex_generation();
+	for (i = 0; i < l->num_layers; i++)
+	{
+		struct layers_index_ctx ctx = { l, i, 0 };
+
+		if (l->layer[i].archive)
+			continue;
+		if (dirindex_foreach(l->layer[i].path, layers_index_file, &ctx) < 0)
+			ctx.ret = layers_scan(l, i, "", 0);
+		if (ctx.ret < 0)
+			return -1;
+	}
+	l->compiled = 1;
+	return 0;
+}
+
+// Opens 'fname' from the highest priority layer that has it. The layer name
+// is returned in *source and the path, which is empty for an archive, in
+// 'path'.
+struct blob *layers_open(const struct layers *l, const char *fname, int flags,
+	const char **source, char *path, size_t len)
+{
+	const struct layers_entry *entry = NULL;
+	unsigned mask = ~0u;
+	int i;
+
+	if (l->compiled && l->generation == dirindex_generation())
+	{
+		entry = layers_find(l, fname);
+		mask = entry ? entry->mask : 0;
+	}
+
+	for (i = 0; i < l->num_layers; i++)
+	{
+		const struct layer *layer = &l->layer[i];
+		struct blob *b;
+
+		if ((layer->flags & LAYER_DEVICE) && (flags & LAYERS_SKIP_DEVICE))
+			continue;
+
+		if (layer->archive)
+		{
+			char member[LAYERS_PATH_LEN];
+
+			if (flags & LAYERS_SKIP_ARCHIVE)
+				continue;
+			snprintf(member, sizeof(member), "%s/%s", layer->prefix, fname);
+			b = cache_open_member(layer->path, member);
+			path[0] = 0;
+		}
+		else
+		{
+			if (!(mask & (1u << i)))
+				continue;
+			snprintf(path, len, "%s/%s", layer->path, fname);
+			b = cache_open(path);
+		}
+
+		if (b)
+		{
+			*source = layer->name;
+			return b;
+		}
+	}
+	return NULL;
+}
+
+// Returns the priority of the layer called 'source', 0 being the highest,
+// or -1 if there is no such layer.
+int layers_rank(const struct layers *l, const char *source)
+{
+	int i;
+
+	for (i = 0; i < l->num_layers; i++)
+		if (strcmp(l->layer[i].name, source) == 0)
+			return i;
+	return -1;
+}
+
+// Lists each file in the directory layers and the layer that serves it
+void layers_dump(const struct layers *l, FILE *fp)
+{
+	int i, e;
+
+	for (i = 0; i < l->num_layers; i++)
+		fprintf(fp, "Layer %d %-13s %s%s%s\n", i, l->layer[i].name, l->layer[i].path,
+			l->layer[i].archive ? ":" : "", l->layer[i].prefix);
+
+	for (e = 0; e < l->num_entries; e++)
+	{
+		const struct layers_entry *entry = &l->entries[e];
+
+		for (i = 0; i < l->num_layers; i++)
+		{
+			// A member of an archive above this layer would be served instead
+			if (l->layer[i].archive)
+			{
+				fprintf(fp, "  %-40s %s or %s\n", entry->name, l->layer[i].name,
+					l->layer[__builtin_ctz(entry->mask)].name);
+				break;
+			}
+			if (entry->mask & (1u << i))
+			{
+				fprintf(fp, "  %-40s %s\n", entry->name, l->layer[i].name);
+				break;
+			}
+		}
+	}
+}
+
+void layers_free(struct layers *l)
+{
+	int e;
+
+	if (!l)
+		return;
+	for (e = 0; e < l->num_entries; e++)
+		free(l->entries[e].name);
+	free(l->entries);
+	free(l->buckets);
+	free(l);
+}
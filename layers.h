@@ -0,0 +1,26 @@
+#ifndef LAYERS_H
+#define LAYERS_H
+#include <stddef.h>
+#include <stdio.h>
+
+struct blob;
+struct layers;
+
+// Directory layer flags
+#define LAYER_DEVICE	1	// Per-device overlay, skipped for the bootcode
+#define LAYER_BASE	2	// Boot directory, which contains the other layers
+
+// layers_open flags
+#define LAYERS_SKIP_DEVICE	1
+#define LAYERS_SKIP_ARCHIVE	2
+
+struct layers *layers_create(void);
+void layers_add_dir(struct layers *l, const char *name, const char *dir, int flags);
+void layers_add_archive(struct layers *l, const char *name, const char *archive, const char *prefix);
+int layers_compile(struct layers *l);
+struct blob *layers_open(const struct layers *l, const char *fname, int flags,
+	const char **source, char *path, size_t len);
+int layers_rank(const struct layers *l, const char *source);
+void layers_dump(const struct layers *l, FILE *fp);
+void layers_free(struct layers *l);
+#endif
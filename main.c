@@ -5,24 +5,32 @@
 #include <ctype.h>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
+#include "blob.h"
 #include "bootfiles.h"
+#include "cache.h"
+#include "daemon.h"
 #include "decode_duid.h"
+#include "dirindex.h"
+#include "eeprom.h"
+#include "inventory.h"
+#include "layers.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "simulate.h"
+#include "stats.h"
+#include "trace.h"
+#include "tune.h"
+#include "transport.h"
 #include "msd/bootcode.h"
 #include "msd/start.h"
 #include "msd/bootcode4.h"
 // 2712 doesn't use start5.elf
 
-/*
- * Old OS X/BSD do not implement fmemopen().  If the version of POSIX
- * supported is old enough that fmemopen() isn't included, assume
- * we're on a BSD compatible system and define a fallback fmemopen()
- * that depends on funopen().
- */
-#if _POSIX_VERSION <= 200112L
-#include "fmemopen.c"
-#endif
-
 #define SELECTION_MODE_VID	0
 #define SELECTION_MODE_SERIAL	1
 
@@ -30,37 +38,118 @@ int selection_mode = SELECTION_MODE_VID;
 char * target_serialno = NULL;
 int signed_boot = 0;
 int verbose = 0;
-int metadata = 0;
 int loop = 0;
 int overlay = 0;
+int max_sessions = 1;
+int transfer_size = 16 * 1024;
+int transfer_depth = 4;
+static int usbfs_staging;
+long cache_size = 256;
 long delay = 500;
+int simulate_count = 0;
+char * simulate_files = "config.txt,boot.img";
+int simulate_chip = 2712;
+char * replay_path = NULL;
+char * daemon_path = NULL;
+int replay_paced = 0;
+char * manifest_dir = NULL;
+int dump_layers = 0;
 char * directory = NULL;
 char * metadata_path = NULL;
-char pathname[18] = {0};
 char * targetpathname = NULL;
 uint8_t targetPortNo = 99;
 
-int out_ep;
-int in_ep;
-int bcm2711;
-int bcm2712;
-
 #define MAX_PATH_LEN 256
 #define FILE_NAME_LENGTH 250
 #define DUID_LENGTH 36
+#define USB_PATH_LEN 18
 
-unsigned char serial_num[MAX_PATH_LEN];
 static char bootfiles_path[MAX_PATH_LEN];
 static int use_bootfiles;
-static void *bootfile_data;
-static FILE * check_file(const char * dir, const char *fname, int use_fmem);
-static int second_stage_prep(FILE *fp, FILE *fp_sig);
 
 typedef struct MESSAGE_S {
 		int length;
 		unsigned char signature[20];
 } boot_message_t;
 
+#define SESSION_STAGE_BOOTCODE		0
+#define SESSION_STAGE_FILE_SERVER	1
+
+#define SESSION_STATE_RUNNING	0
+#define SESSION_STATE_FINISHED	1	// Thread has exited but has not been joined
+#define SESSION_STATE_IDLE	2	// Joined, waiting for the device to go away
+
+// All of the state for one attached device. Each session is driven by its
+// own thread so that multiple devices can be booted at the same time.
+struct boot_session {
+	libusb_device *dev;
+	libusb_device_handle *usb_device;
+	struct libusb_device_descriptor desc;
+	int sys_fd;		// usbfs node wrapped by libusb for direct attach or -1
+	uint8_t *dma_buf;	// usbfs memory for the queued bulk transfers or NULL
+	size_t dma_size;
+	int transfer_size;	// Bulk transfer size and queue depth for this device
+	int transfer_depth;
+	struct tune *tune;	// With --autotune
+	struct transport transport;
+	uint8_t bus;
+	uint8_t address;
+	int out_ep;
+	int bcm2711;
+	int bcm2712;
+	int stage;
+	int state;
+	int present;
+	int opened;
+	uint64_t boot_start_us;	// When the device was first seen, for the boot time
+	struct session_stats stats;
+	const char *file_source;	// Where check_file() found the last file
+	int prefetch;		// Only used to prefetch files, don't log them
+	struct manifest *learned;	// Files requested by the second stage
+	struct layers *layers;	// Compiled when the file server starts
+	int metadata;
+	int metadata_disabled;
+	struct inventory_record *inventory;
+	char pathname[USB_PATH_LEN];
+	unsigned char serial_num[MAX_PATH_LEN];
+	struct blob *file;
+	boot_message_t boot_message;
+	struct blob *second_stage;
+	struct blob *eeprom;	// pieeprom.bin generated for this device
+	struct blob *eeprom_sig;
+	pthread_t thread;
+	struct boot_session *next;
+};
+
+static struct boot_session *sessions;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The device re-enumerates between the first and second stage so the time
+// at which the first stage started is remembered for each USB path.
+#define MAX_BOOT_STARTS 64
+static struct {
+	char pathname[USB_PATH_LEN];
+	uint64_t time_us;
+} boot_starts[MAX_BOOT_STARTS];
+
+// Rather than sleeping for a fixed time while a device becomes ready the
+// operations are retried with a short exponential backoff until a deadline.
+#define OPEN_DEADLINE_MS	2000
+#define RETCODE_DEADLINE_MS	2000
+#define BACKOFF_MIN_US		1000
+#define BACKOFF_MAX_US		100000
+
+// When libusb supports hotplug the bus is only scanned after an arrive/leave
+// event or when a session finishes. Otherwise the bus is polled every 'delay' us.
+#define HOTPLUG_EVENT_TIMEOUT_MS 1000
+static libusb_context *usb_ctx;
+static int hotplug;
+static int rescan_pending = 1;
+static int direct_attach;
+
+static struct blob * check_file(struct boot_session *s, const char * dir, const char *fname, int use_fmem);
+static int second_stage_prep(struct boot_session *s, struct blob *second_stage, struct blob *sig);
+
 void usage(int error)
 {
 	FILE * dest = error ? stderr : stdout;
@@ -78,327 +167,395 @@ void usage(int error)
 	fprintf(dest, "rpiboot -d [directory]   : Boot the device using the boot files in 'directory'\n");
 	fprintf(dest, "Further options:\n");
 	fprintf(dest, "        -l               : Loop forever\n");
+	fprintf(dest, "        -c count         : Boot up to 'count' devices concurrently (default 1)\n");
 	fprintf(dest, "        -o               : Use files from overlay subdirectory if they exist (when using a custom directory)\n");
 	fprintf(dest, "                           USB Path (1-1.3.2 for example) is shown in verbose mode.\n");
 	fprintf(dest, "                           (bootcode.bin is always preloaded from the base directory)\n");
 	fprintf(dest, "        -m delay         : Microseconds delay between checking for new devices (default 500)\n");
+	fprintf(dest, "                           Only used if libusb does not support hotplug events\n");
+	fprintf(dest, "        -C size          : Size of the file cache shared by all devices in MiB (default 256, 0 to disable)\n");
+	fprintf(dest, "        -b size          : Bulk transfer size in bytes (default 16384)\n");
+	fprintf(dest, "        -q depth         : Number of bulk transfers to keep queued (default 4)\n");
+	fprintf(dest, "        --usbfs-staging  : Copy bulk data into usbfs memory for the transfers (Linux)\n");
+	fprintf(dest, "        --autotune file  : Find the best bulk transfer size and depth for each USB path and keep them in 'file'\n");
+	fprintf(dest, "        --stats[=file]   : Write JSON performance statistics for each device session to stdout or 'file'\n");
+	fprintf(dest, "        --metrics file   : Keep Prometheus metrics for boot throughput and latency up to date in 'file'\n");
+	fprintf(dest, "        --metrics-socket socket : Serve Prometheus metrics to clients of the Unix socket 'socket'\n");
 	fprintf(dest, "        -v               : Verbose\n");
 	fprintf(dest, "        -V               : Displays the version string and exits\n");
 	fprintf(dest, "        -s               : Signed using bootsig.bin\n");
 	fprintf(dest, "        -0/1/2/.../98    : Only look for CMs attached to USB port number 0-98\n");
 	fprintf(dest, "        -p [pathname]    : Only look for CM with USB pathname\n");
 	fprintf(dest, "        -i [serialno]    : Only look for a Raspberry Pi Device with a given serialno\n");
+	fprintf(dest, "        --inventory dir  : Append the metadata of each device to the inventory store in 'dir' (BCM2712/2711)\n");
+	fprintf(dest, "        --inventory-get dir key : Print the latest inventory record with the serial number or FACTORY_UUID 'key' and exit\n");
+	fprintf(dest, "        --inventory-export dir  : Print every inventory record as NDJSON and exit\n");
 	fprintf(dest, "        -j [path]        : Write metadata JSON object to a file at the given path (BCM2712/2711)\n");
+	fprintf(dest, "        --simulate count : Benchmark the host with 'count' simulated devices instead of USB\n");
+	fprintf(dest, "        --sim-files list : Comma separated files requested by each simulated device (default config.txt,boot.img)\n");
+	fprintf(dest, "        --sim-chip chip  : Chip of the simulated devices 2710, 2711 or 2712 (default 2712)\n");
+	fprintf(dest, "        --dump-layers    : Show the overlay layers of each device and the layer each file is served from\n");
+	fprintf(dest, "        --manifests dir  : Learn the files requested by each device in 'dir' and prefetch them during the first stage\n");
+	fprintf(dest, "        --record file    : Record every USB request of each session to a trace file\n");
+	fprintf(dest, "        --replay file    : Serve the devices in a trace file instead of USB\n");
+	fprintf(dest, "        --replay-paced   : Replay device requests at their recorded times rather than at full speed\n");
+	fprintf(dest, "        --import-usbmon pcap file : Convert a Linux usbmon capture to a trace file and exit\n");
+	fprintf(dest, "        --daemon socket  : Keep running and boot devices for the jobs submitted on the Unix socket 'socket'\n");
+	fprintf(dest, "        --control socket command : Send 'submit [dir=D] [path=P] [port=N] [serial=S] [metadata=M] [count=N]',\n");
+	fprintf(dest, "                           'status' or 'cancel id' to a daemon and print the reply\n");
 	fprintf(dest, "        -h               : This help\n");
 
 	exit(error ? -1 : 0);
 }
 
-libusb_device_handle * LIBUSB_CALL open_device_with_serialno(
-	libusb_context *ctx, char *serialno)
+static uint64_t time_now_us(void)
 {
-	struct libusb_device **devices;
-	struct libusb_device *cursor;
-	struct libusb_device_handle *handle = NULL;
-	int r = 0;
+	struct timespec ts;
 
-	if (libusb_get_device_list(ctx, &devices) < 0)
-		return NULL;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	uint32_t device_index = 0;
-	unsigned char *serial_buffer = calloc(33, sizeof(uint8_t));
-	if (serial_buffer == NULL)
-		goto out_serialno;
+// Sleeps for the current backoff interval and doubles it for the next
+// attempt. Returns 0 without sleeping once the deadline has passed.
+static int backoff(uint64_t deadline, unsigned *delay_us)
+{
+	uint64_t now = time_now_us();
+
+	if (now >= deadline)
+		return 0;
+	if (*delay_us > deadline - now)
+		*delay_us = deadline - now;
+	usleep(*delay_us);
+	*delay_us = *delay_us * 2 > BACKOFF_MAX_US ? BACKOFF_MAX_US : *delay_us * 2;
+	return 1;
+}
 
-	while ((cursor = devices[device_index++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		r = libusb_get_device_descriptor(cursor, &desc);
-		if (r < 0)
-			goto out_serialno;
-
-		r = libusb_open(cursor, &handle);
-		if (r < 0)
-			goto out_serialno;
-		
-		if (handle != NULL) {
-			if (libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, serial_buffer, 31) >= 0) {
-				if (strncmp(serialno, (char *)serial_buffer, 32)) {
-					libusb_close(handle);
-					handle = NULL;
-					continue;
-				}
-				
-				// Match the magic numbers for Raspberry Pi generations
-				if (desc.idVendor == 0x0a5c) {
-					if (desc.idProduct == 0x2763 ||
-						desc.idProduct == 0x2764 ||
-						desc.idProduct == 0x2711 ||
-						desc.idProduct == 0x2712)
-					{
-						FILE *fp_second_stage = NULL;
-						FILE *fp_sign = NULL;
-						const char *second_stage;
-
-						bcm2711 = (desc.idProduct == 0x2711);
-						bcm2712 = (desc.idProduct == 0x2712);
-						if (bcm2711)
-							second_stage = "bootcode4.bin";
-						else if (bcm2712)
-							second_stage = "bootcode5.bin";
-						else
-							second_stage = "bootcode.bin";
-
-						fp_second_stage = check_file(directory, second_stage, 1);
-						if (!fp_second_stage) {
-							fprintf(stderr, "Failed to open %s\n", second_stage);
-							exit(EXIT_FAILURE);
-						}
-
-						if (signed_boot && !bcm2711 && !bcm2712) { // Signed boot uses a different mechanism on BCM2711 and BCM2712
-							const char *sig_file = "bootcode.sig";
-							fp_sign = check_file(directory, sig_file, 1);
-							if (!fp_sign)
-							{
-								fprintf(stderr, "Unable to open '%s'\n", sig_file);
-								usage(1);
-								exit(EXIT_FAILURE);
-							}
-						}
-
-						if (second_stage_prep(fp_second_stage, fp_sign) != 0) {
-							fprintf(stderr, "Failed to prepare the second stage bootcode\n");
-							exit(EXIT_FAILURE);
-						}
-
-						if (fp_second_stage)
-							fclose(fp_second_stage);
-
-						if (fp_sign)
-							fclose(fp_sign);
-
-						break;
-					} else {
-						// Serial number matches, VID matches, but we don't know about this product. Abort.
-						fprintf(stderr, "Unknown Raspberry Pi Product, wanted 2763, 2764, 2711 or 2712. Got: %04x\n", desc.idProduct);
-						libusb_close(handle);
-						handle = NULL;
-						continue;
-					}
-				} else {
-					// Serial number matches, but the VID doesn't. Invalid action.
-					fprintf(stderr, "Unknown USB Vendor ID. Wanted 0a5c. Got: %04x\n", desc.idVendor);
-					libusb_close(handle);
-					handle = NULL;
-					continue;
-				}
-			} else {
-				// No serial number specified, not a good sign at all.
-				libusb_close(handle);
-				handle = NULL;
-				continue;
-			}
+static int is_bcm_product(uint16_t product_id)
+{
+	return product_id == 0x2763 ||
+		product_id == 0x2764 ||
+		product_id == 0x2711 ||
+		product_id == 0x2712;
+}
+
+// Formats the USB path e.g. 1-1.3.2 which is used for overlays and -p
+static void get_usb_pathname(libusb_device *dev, char *pathname)
+{
+	uint8_t path[8];	// Needed for libusb_get_port_numbers
+	int r, j, len = 0;
+
+	r = libusb_get_port_numbers(dev, path, sizeof(path));
+	len = snprintf(&pathname[len], USB_PATH_LEN-len, "%d", libusb_get_bus_number(dev));
+	if (r > 0) {
+		len += snprintf(&pathname[len], USB_PATH_LEN-len, "-");
+		len += snprintf(&pathname[len], USB_PATH_LEN-len, "%d", path[0]);
+		for (j = 1; j < r; j++)
+		{
+			len += snprintf(&pathname[len], USB_PATH_LEN-len, ".%d", path[j]);
 		}
 	}
-
-out_serialno:
-	if (serial_buffer)
-		free(serial_buffer);
-
-	libusb_free_device_list(devices, 1);
-	return handle;
 }
 
-libusb_device_handle * LIBUSB_CALL open_device_with_vid(
-	libusb_context *ctx, uint16_t vendor_id)
+// With -i the serial number of each Raspberry Pi device is read once and
+// remembered for as long as the device stays at the same bus, port path and
+// address. Only the discovery thread uses the cache so it isn't locked.
+#define MAX_SERIAL_CACHE 64
+static struct {
+	uint8_t bus;
+	uint8_t address;
+	char pathname[USB_PATH_LEN];
+	char serial[33];
+	int valid;
+	int seen;	// Present in the current scan
+} serial_cache[MAX_SERIAL_CACHE];
+
+static void serial_cache_mark(uint8_t bus, uint8_t address)
 {
-	struct libusb_device **devs;
-	struct libusb_device *found = NULL;
-	struct libusb_device *dev;
-	struct libusb_device_handle *handle = NULL;
-	uint32_t i = 0;
-	int r, j, len;
-	uint8_t path[8];	// Needed for libusb_get_port_numbers
-	uint8_t portNo = 0;
+	int i;
 
-	if (libusb_get_device_list(ctx, &devs) < 0)
-		return NULL;
+	for (i = 0; i < MAX_SERIAL_CACHE; i++)
+		if (serial_cache[i].valid && serial_cache[i].bus == bus && serial_cache[i].address == address)
+			serial_cache[i].seen = 1;
+}
 
-	while ((dev = devs[i++]) != NULL) {
-		len = 0;
-		struct libusb_device_descriptor desc;
-		r = libusb_get_device_descriptor(dev, &desc);
-		if (r < 0)
-			goto out;
-
-		if(overlay || verbose == 2 || targetpathname!=NULL)
-		{
-			r = libusb_get_port_numbers(dev, path, sizeof(path));
-			len = snprintf(&pathname[len], 18-len, "%d", libusb_get_bus_number(dev));
-			if (r > 0) {
-				len += snprintf(&pathname[len], 18-len, "-");
-				len += snprintf(&pathname[len], 18-len, "%d", path[0]);
-				for (j = 1; j < r; j++)
-				{
-					len += snprintf(&pathname[len], 18-len, ".%d", path[j]);
-				}
-			}
-		}
+// Drops devices which were not seen in the last scan and starts a new one
+static void serial_cache_sweep(void)
+{
+	int i;
 
-		/*
-		  http://libusb.sourceforge.net/api-1.0/group__dev.html#ga14879a0ea7daccdcddb68852d86c00c4
+	for (i = 0; i < MAX_SERIAL_CACHE; i++)
+	{
+		if (!serial_cache[i].seen)
+			serial_cache[i].valid = 0;
+		serial_cache[i].seen = 0;
+	}
+}
 
-		  The port number returned by this call is usually guaranteed to be uniquely tied to a physical port,
-		  meaning that different devices plugged on the same physical port should return the same port number.
-		*/
-		portNo = libusb_get_port_number(dev);
+// Returns 1 if the device has the requested serial number. The caller has
+// already checked that it is a Raspberry Pi device. If the device had to be
+// opened to read the serial number then the handle is returned in *handle
+// for the session to use.
+static int serial_matches(libusb_device *dev, struct libusb_device_descriptor *desc,
+	const char *pathname, const char *serialno, libusb_device_handle **handle)
+{
+	uint8_t bus = libusb_get_bus_number(dev);
+	uint8_t address = libusb_get_device_address(dev);
+	unsigned char serial_buffer[33] = {0};
+	int i, slot = -1;
 
-		if(verbose == 2)
+	for (i = 0; i < MAX_SERIAL_CACHE; i++)
+	{
+		if (serial_cache[i].valid && serial_cache[i].bus == bus &&
+			serial_cache[i].address == address &&
+			strcmp(serial_cache[i].pathname, pathname) == 0)
 		{
-			printf("Found device %u idVendor=0x%04x idProduct=0x%04x\n", i, desc.idVendor, desc.idProduct);
-			printf("Bus: %d, Device: %d Path: %s\n",libusb_get_bus_number(dev), libusb_get_device_address(dev), pathname);
+			serial_cache[i].seen = 1;
+			return strncmp(serialno, serial_cache[i].serial, 32) == 0;
 		}
-		
-		if (desc.idVendor == vendor_id) {
-			if(desc.idProduct == 0x2763 ||
-			   desc.idProduct == 0x2764 ||
-			   desc.idProduct == 0x2711 ||
-			   desc.idProduct == 0x2712)
-			{
-				FILE *fp_second_stage = NULL;
-				FILE *fp_sign = NULL;
-				const char *second_stage;
-
-				if(verbose == 2)
-					printf("Found candidate Compute Module...\n");
+		if (!serial_cache[i].valid && slot < 0)
+			slot = i;
+	}
 
-				// Check if we should match against a specific port number or path
-				if ((targetPortNo == 99 || portNo == targetPortNo) &&
-					(targetpathname == NULL || strcmp(targetpathname, pathname) == 0))
-				{
-					if(verbose)
-						printf("Device located successfully\n");
-					found = dev;
-				}
-				else
-				{
-					if(verbose == 2)
-						printf("Device port / path does not match, trying again\n");
+	if (desc->iSerialNumber != 0)
+	{
+		if (libusb_open(dev, handle) < 0 || *handle == NULL)
+		{
+			// Possibly not accessible yet so try again on the next scan
+			*handle = NULL;
+			return 0;
+		}
+		// No serial number specified, not a good sign at all.
+		if (libusb_get_string_descriptor_ascii(*handle, desc->iSerialNumber, serial_buffer, 31) < 0)
+			serial_buffer[0] = 0;
+	}
 
-					continue;
-				}
+	if (verbose == 2)
+		printf("Serial number of %s is '%s'\n", pathname, serial_buffer);
+	if (slot >= 0)
+	{
+		serial_cache[slot].bus = bus;
+		serial_cache[slot].address = address;
+		snprintf(serial_cache[slot].pathname, sizeof(serial_cache[slot].pathname), "%s", pathname);
+		memcpy(serial_cache[slot].serial, serial_buffer, sizeof(serial_cache[slot].serial));
+		serial_cache[slot].valid = 1;
+		serial_cache[slot].seen = 1;
+	}
 
-				bcm2711 = (desc.idProduct == 0x2711);
-				bcm2712 = (desc.idProduct == 0x2712);
-				if (bcm2711)
-					second_stage = "bootcode4.bin";
-				else if (bcm2712)
-					second_stage = "bootcode5.bin";
-				else
-					second_stage = "bootcode.bin";
+	if (serial_buffer[0] == 0 || strncmp(serialno, (char *) serial_buffer, 32) != 0)
+	{
+		if (*handle)
+			libusb_close(*handle);
+		*handle = NULL;
+		return 0;
+	}
+	return 1;
+}
 
-				if ((bcm2711 || bcm2712) && !directory) {
-					directory = DEFAULT_MSG_DIR;
-					use_bootfiles = 1;
-					snprintf(bootfiles_path, sizeof(bootfiles_path),"%s%s", directory, "bootfiles.bin");
-					printf("Directory not specified - trying default %s\n", directory);
+// If no directory was specified then BCM2711 and BCM2712 boot the mass-storage-gadget
+// from the install prefix or from the local checkout. This updates the global
+// boot directory so it is done by the discovery thread before any session starts.
+static void select_default_directory(struct boot_session *s)
+{
+	const char *second_stage = s->bcm2711 ? "bootcode4.bin" : "bootcode5.bin";
+	struct blob *bootcode;
 
-					fp_second_stage = check_file(directory, second_stage, 1);
-					if (!fp_second_stage)
-					{
-						directory = "mass-storage-gadget64/";
-						snprintf(bootfiles_path, sizeof(bootfiles_path),"%s%s", directory, "bootfiles.bin");
-						printf("Trying local path %s\n", directory);
-						fp_second_stage = check_file(directory, second_stage, 1);
-					}
-				}
-				else {
-					fp_second_stage = check_file(directory, second_stage, 1);
-				}
+	if (!(s->bcm2711 || s->bcm2712) || directory)
+		return;
 
-				if (!fp_second_stage)
-				{
-					fprintf(stderr, "Failed to open second stage bootloader (%s)\n", second_stage);
-					fprintf(stderr, "\nPlease try specifying the directory e.g. rpiboot -d mass-storage-gadget64\n");
-					exit(1);
-				}
+	directory = DEFAULT_MSG_DIR;
+	use_bootfiles = 1;
+	snprintf(bootfiles_path, sizeof(bootfiles_path),"%s%s", directory, "bootfiles.bin");
+	printf("Directory not specified - trying default %s\n", directory);
 
-				if (signed_boot && !bcm2711 && !bcm2712) // Signed boot use a different mechanism on BCM2711 and BCM2712
-				{
-					const char *sig_file = "bootcode.sig";
-					fp_sign = check_file(directory, sig_file, 1);
-					if (!fp_sign)
-					{
-						fprintf(stderr, "Unable to open '%s'\n", sig_file);
-						usage(1);
-					}
-				}
+	bootcode = check_file(s, directory, second_stage, 1);
+	if (!bootcode)
+	{
+		directory = "mass-storage-gadget64/";
+		snprintf(bootfiles_path, sizeof(bootfiles_path),"%s%s", directory, "bootfiles.bin");
+		printf("Trying local path %s\n", directory);
+		bootcode = check_file(s, directory, second_stage, 1);
+	}
+	blob_close(bootcode);
+	dirindex_add(directory);
+}
 
-				if (second_stage_prep(fp_second_stage, fp_sign) != 0)
-				{
-					fprintf(stderr, "Failed to prepare the second stage bootcode\n");
-					exit(-1);
-				}
-				if (fp_second_stage)
-					fclose(fp_second_stage);
+// The first stage for each chip is prepared once and shared by every
+// session until the boot directory changes. If the directory isn't indexed
+// the files are looked up again, which the file cache makes cheap.
+static struct {
+	struct blob *bootcode;
+	boot_message_t boot_message;
+	char *directory;
+	unsigned long generation;
+} stage1_cache[3];
+static pthread_mutex_t stage1_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int load_second_stage(struct boot_session *s)
+{
+	struct blob *bootcode = NULL;
+	struct blob *sig = NULL;
+	const char *second_stage;
+	int chip = s->bcm2712 ? 2 : s->bcm2711 ? 1 : 0;
+
+	pthread_mutex_lock(&stage1_lock);
+	if (stage1_cache[chip].bootcode &&
+		(stage1_cache[chip].directory && directory ?
+		 strcmp(stage1_cache[chip].directory, directory) == 0 :
+		 stage1_cache[chip].directory == directory) &&
+		(!directory || (dirindex_contains(directory) &&
+		 stage1_cache[chip].generation == dirindex_generation())))
+	{
+		blob_close(s->second_stage);
+		s->second_stage = blob_ref(stage1_cache[chip].bootcode);
+		s->boot_message = stage1_cache[chip].boot_message;
+		pthread_mutex_unlock(&stage1_lock);
+		if (verbose == 2)
+			printf("Using prepared bootcode (%d bytes)\n", s->boot_message.length);
+		return 0;
+	}
+	stage1_cache[chip].generation = dirindex_generation();
 
-				if (fp_sign)
-					fclose(fp_sign);
+	if (s->bcm2711)
+		second_stage = "bootcode4.bin";
+	else if (s->bcm2712)
+		second_stage = "bootcode5.bin";
+	else
+		second_stage = "bootcode.bin";
 
-				if (found)
-					break;
-			}
-		}
+	bootcode = check_file(s, directory, second_stage, 1);
+	if (!bootcode)
+	{
+		fprintf(stderr, "Failed to open second stage bootloader (%s)\n", second_stage);
+		fprintf(stderr, "\nPlease try specifying the directory e.g. rpiboot -d mass-storage-gadget64\n");
+		exit(1);
 	}
 
-	if (found) {
-		sleep(1);
-		r = libusb_open(found, &handle);
-		if (r == LIBUSB_ERROR_ACCESS)
-		{
-			printf("Permission to access USB device denied. Make sure you are a member of the plugdev group.\n");
-			exit(-1);
-		}
-		else if (r < 0)
+	if (signed_boot && !s->bcm2711 && !s->bcm2712) // Signed boot use a different mechanism on BCM2711 and BCM2712
+	{
+		const char *sig_file = "bootcode.sig";
+		sig = check_file(s, directory, sig_file, 1);
+		if (!sig)
 		{
-			if(verbose) printf("Failed to open the requested device\n");
-			handle = NULL;
+			fprintf(stderr, "Unable to open '%s'\n", sig_file);
+			usage(1);
 		}
 	}
 
-out:
-	libusb_free_device_list(devs, 1);
-	return handle;
+	if (second_stage_prep(s, bootcode, sig) != 0)
+	{
+		fprintf(stderr, "Failed to prepare the second stage bootcode\n");
+		exit(-1);
+	}
+	blob_close(sig);
+
+	blob_close(stage1_cache[chip].bootcode);
+	stage1_cache[chip].bootcode = blob_ref(s->second_stage);
+	stage1_cache[chip].boot_message = s->boot_message;
+	free(stage1_cache[chip].directory);
+	stage1_cache[chip].directory = directory ? strdup(directory) : NULL;
+	pthread_mutex_unlock(&stage1_lock);
+
+	return 0;
+}
+
+static const struct transport_ops libusb_transport_ops;
+
+static struct boot_session *session_alloc(const char *pathname)
+{
+	struct boot_session *s = calloc(1, sizeof(*s));
+
+	if (!s)
+		return NULL;
+
+	s->present = 1;
+	s->sys_fd = -1;
+	s->transfer_size = transfer_size;
+	s->transfer_depth = transfer_depth;
+	s->stats.discovered_us = time_now_us();
+	snprintf(s->pathname, sizeof(s->pathname), "%s", pathname);
+	return s;
+}
+
+static struct boot_session *session_create(libusb_device *dev,
+	struct libusb_device_descriptor *desc, const char *pathname)
+{
+	struct boot_session *s = session_alloc(pathname);
+
+	if (!s)
+		return NULL;
+
+	s->dev = libusb_ref_device(dev);
+	s->desc = *desc;
+	s->bus = libusb_get_bus_number(dev);
+	s->address = libusb_get_device_address(dev);
+	s->bcm2711 = (desc->idProduct == 0x2711);
+	s->bcm2712 = (desc->idProduct == 0x2712);
+	s->transport.ops = &libusb_transport_ops;
+	s->transport.priv = s;
+	return s;
+}
+
+static void session_close_device(struct boot_session *s)
+{
+#if LIBUSBX_API_VERSION >= 0x01000105
+	if (s->dma_buf)
+		libusb_dev_mem_free(s->usb_device, s->dma_buf, s->dma_size);
+#endif
+	s->dma_buf = NULL;
+	if (s->usb_device)
+		libusb_close(s->usb_device);
+	s->usb_device = NULL;
+	if (s->sys_fd >= 0)
+		close(s->sys_fd);
+	s->sys_fd = -1;
+}
 
+static void session_free(struct boot_session *s)
+{
+	blob_close(s->file);
+	blob_close(s->second_stage);
+	blob_close(s->eeprom);
+	blob_close(s->eeprom_sig);
+	stats_free(&s->stats);
+	manifest_free(s->learned);
+	layers_free(s->layers);
+	inventory_record_free(s->inventory);
+	if (s->dev)
+		libusb_unref_device(s->dev);
+	free(s);
 }
 
-int Initialize_Device(libusb_context ** ctx, libusb_device_handle ** usb_device)
+int Initialize_Device(struct boot_session *s)
 {
 	int ret = 0;
 	int interface;
 	struct libusb_config_descriptor *config;
+	uint64_t deadline = time_now_us() + OPEN_DEADLINE_MS * 1000;
+	unsigned delay_us = BACKOFF_MIN_US;
 
-	switch (selection_mode) {
-		case SELECTION_MODE_SERIAL: {
-			*usb_device = open_device_with_serialno(*ctx, target_serialno);
-			if (*usb_device == NULL)
-			{
-				usleep(200);
-				return -1;
-			}
-		}
-		break;
-		case SELECTION_MODE_VID: {
-			*usb_device = open_device_with_vid(*ctx, 0x0a5c);
-			if (*usb_device == NULL)
+	// The device node may not be accessible as soon as the device has
+	// enumerated (e.g. whilst udev applies the permissions) so retry.
+	while (s->usb_device == NULL)
+	{
+		ret = libusb_open(s->dev, &s->usb_device);
+		if (ret == 0)
+			break;
+
+		s->usb_device = NULL;
+		if (ret == LIBUSB_ERROR_NO_DEVICE || !backoff(deadline, &delay_us))
+		{
+			if (ret == LIBUSB_ERROR_ACCESS)
 			{
-				usleep(200);
-				return -1;
+				printf("Permission to access USB device denied. Make sure you are a member of the plugdev group.\n");
+				exit(-1);
 			}
+			if(verbose) printf("Failed to open the requested device\n");
+			return ret;
 		}
-		break;
 	}
 
-	libusb_get_active_config_descriptor(libusb_get_device(*usb_device), &config);
+	libusb_get_active_config_descriptor(s->dev, &config);
 	if(config == NULL)
 	{
 		printf("Failed to read config descriptor\n");
@@ -410,72 +567,341 @@ int Initialize_Device(libusb_context ** ctx, libusb_device_handle ** usb_device)
 	if(config->bNumInterfaces == 1)
 	{
 		interface = 0;
-		out_ep = 1;
-		in_ep = 2;
+		s->out_ep = 1;
 	}
 	else
 	{
 		interface = 1;
-		out_ep = 3;
-		in_ep = 4;
+		s->out_ep = 3;
 	}
+	libusb_free_config_descriptor(config);
 
-	ret = libusb_claim_interface(*usb_device, interface);
+	delay_us = BACKOFF_MIN_US;
+	while ((ret = libusb_claim_interface(s->usb_device, interface)) != 0 &&
+		ret != LIBUSB_ERROR_NO_DEVICE && backoff(deadline, &delay_us))
+		;
 	if (ret)
 	{
-		libusb_close(*usb_device);
+		session_close_device(s);
 		printf("Failed to claim interface\n");
 		return ret;
 	}
 
-	if(verbose) printf("Initialised device correctly\n");
+	// With --usbfs-staging bulk data is copied into usbfs memory, which the
+	// kernel uses for the transfers without copying it again. That only
+	// moves the copy from the kernel into rpiboot, so by default the
+	// transfers are made from the caller's buffers.
+#if LIBUSBX_API_VERSION >= 0x01000105
+	if (usbfs_staging)
+	{
+		s->dma_size = (size_t) s->transfer_depth * s->transfer_size;
+		if (s->tune && s->dma_size < TUNE_MAX_IN_FLIGHT)
+			s->dma_size = TUNE_MAX_IN_FLIGHT;
+		s->dma_buf = libusb_dev_mem_alloc(s->usb_device, s->dma_size);
+	}
+#endif
+	if(verbose) printf("Initialised device correctly%s\n", s->dma_buf ? " (usbfs staging)" : "");
+	s->opened = 1;
+	s->stats.opened_us = time_now_us();
 
 	return ret;
 }
 
-#define LIBUSB_MAX_TRANSFER (16 * 1024)
+#define LIBUSB_MAX_TRANSFER (1024 * 1024)
+#define LIBUSB_MAX_DEPTH 64
+
+// State shared by the bulk transfers queued by one ep_write call
+struct bulk_write {
+	const uint8_t *buf;
+	int dma;	// Each transfer has its own buffer in usbfs memory
+	int transfer_size;
+	int len;
+	int submitted;	// Bytes queued so far
+	int sent;	// Bytes acknowledged by the device
+	int in_flight;
+	int completed;
+	int ret;
+	pthread_mutex_t lock;	// Callbacks may run on another session's thread
+};
+
+static void LIBUSB_CALL bulk_write_cb(struct libusb_transfer *transfer)
+{
+	struct bulk_write *w = transfer->user_data;
+
+	pthread_mutex_lock(&w->lock);
+	w->in_flight--;
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+	{
+		w->sent += transfer->actual_length;
+		if (transfer->actual_length != transfer->length && !w->ret)
+			w->ret = LIBUSB_ERROR_IO;
+	}
+	else if (!w->ret)
+	{
+		w->ret = transfer->status == LIBUSB_TRANSFER_TIMED_OUT ? LIBUSB_ERROR_TIMEOUT :
+			transfer->status == LIBUSB_TRANSFER_NO_DEVICE ? LIBUSB_ERROR_NO_DEVICE :
+			transfer->status == LIBUSB_TRANSFER_STALL ? LIBUSB_ERROR_PIPE : LIBUSB_ERROR_IO;
+	}
+
+	// Re-use this transfer for the next chunk so that the queue stays full
+	if (!w->ret && w->submitted < w->len)
+	{
+		int sending = w->len - w->submitted < w->transfer_size ? w->len - w->submitted : w->transfer_size;
+
+		if (w->dma)
+			memcpy(transfer->buffer, w->buf + w->submitted, sending);
+		else
+			transfer->buffer = (uint8_t *) w->buf + w->submitted;
+		transfer->length = sending;
+		w->submitted += sending;
+		w->in_flight++;
+		if (libusb_submit_transfer(transfer) != 0)
+		{
+			w->in_flight--;
+			w->ret = LIBUSB_ERROR_IO;
+		}
+	}
+
+	if (w->in_flight == 0)
+		w->completed = 1;
+	pthread_mutex_unlock(&w->lock);
+}
+
+// Sends the buffer as a sequence of bulk transfers keeping up to
+// s->transfer_depth of them queued so that the bus is never idle between URBs.
+static int usb_bulk_out(struct transport *t, const uint8_t *buf, int len, int *ret)
+{
+	struct boot_session *s = t->priv;
+	struct libusb_transfer *transfers[LIBUSB_MAX_DEPTH] = {0};
+	struct bulk_write w = {0};
+	int cancelled = 0;
+	int i;
+
+	pthread_mutex_init(&w.lock, NULL);
+	w.buf = buf;
+	w.dma = s->dma_buf && (size_t) s->transfer_depth * s->transfer_size <= s->dma_size;
+	w.transfer_size = s->transfer_size;
+	w.len = len;
+	for (i = 0; i < s->transfer_depth; i++)
+	{
+		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+		uint8_t *chunk;
+		int sending, err;
+
+		if (!transfer)
+		{
+			pthread_mutex_lock(&w.lock);
+			w.ret = LIBUSB_ERROR_NO_MEM;
+			pthread_mutex_unlock(&w.lock);
+			break;
+		}
+
+		// Claim the chunk and count the transfer before it is submitted
+		// because earlier transfers may complete and queue more chunks
+		// on another thread meanwhile.
+		pthread_mutex_lock(&w.lock);
+		if (w.ret || w.submitted >= len)
+		{
+			pthread_mutex_unlock(&w.lock);
+			libusb_free_transfer(transfer);
+			break;
+		}
+		sending = len - w.submitted < w.transfer_size ? len - w.submitted : w.transfer_size;
+		chunk = (uint8_t *) w.buf + w.submitted;
+		if (w.dma)
+		{
+			chunk = s->dma_buf + (size_t) i * w.transfer_size;
+			memcpy(chunk, w.buf + w.submitted, sending);
+		}
+		w.submitted += sending;
+		w.in_flight++;
+		pthread_mutex_unlock(&w.lock);
+
+		transfers[i] = transfer;
+		libusb_fill_bulk_transfer(transfer, s->usb_device, s->out_ep,
+			chunk, sending, bulk_write_cb, &w, 5000);
+		err = libusb_submit_transfer(transfer);
+		if (err)
+		{
+			pthread_mutex_lock(&w.lock);
+			w.in_flight--;
+			if (!w.ret)
+				w.ret = err;
+			pthread_mutex_unlock(&w.lock);
+			break;
+		}
+	}
+
+	// Nothing is left to complete if no transfer was queued
+	pthread_mutex_lock(&w.lock);
+	if (w.in_flight == 0)
+		w.completed = 1;
+	pthread_mutex_unlock(&w.lock);
+
+	while (!w.completed)
+	{
+		int failed;
+
+		pthread_mutex_lock(&w.lock);
+		failed = w.ret != 0;
+		pthread_mutex_unlock(&w.lock);
+
+		// After an error cancel the rest of the queue and wait for it to drain
+		if (failed && !cancelled)
+		{
+			for (i = 0; i < s->transfer_depth && transfers[i]; i++)
+				libusb_cancel_transfer(transfers[i]);
+			cancelled = 1;
+		}
+		libusb_handle_events_completed(usb_ctx, &w.completed);
+	}
+
+	// Wait for the last callback to release the lock before 'w' goes away
+	pthread_mutex_lock(&w.lock);
+	pthread_mutex_unlock(&w.lock);
+	pthread_mutex_destroy(&w.lock);
+
+	for (i = 0; i < s->transfer_depth; i++)
+		libusb_free_transfer(transfers[i]);
+
+	*ret = w.ret;
+	return w.sent;
+}
+
+static int usb_control_out(struct transport *t, uint32_t length)
+{
+	struct boot_session *s = t->priv;
+
+	return libusb_control_transfer(s->usb_device, LIBUSB_REQUEST_TYPE_VENDOR, 0,
+				       length & 0xffff, length >> 16, NULL, 0, 1000);
+}
+
+static int usb_control_in(struct transport *t, void *buf, int len)
+{
+	struct boot_session *s = t->priv;
+
+	return libusb_control_transfer(s->usb_device,
+				       LIBUSB_REQUEST_TYPE_VENDOR |
+				       LIBUSB_ENDPOINT_IN, 0, len & 0xffff,
+				       len >> 16, buf, len, 20000);
+}
+
+static const struct transport_ops libusb_transport_ops = {
+	.name = "libusb",
+	.control_out = usb_control_out,
+	.control_in = usb_control_in,
+	.bulk_out = usb_bulk_out,
+};
+
+static void ep_write_done(struct boot_session *s, uint64_t sent, int ret, uint64_t start)
+{
+	uint64_t elapsed = time_now_us() - start;
+
+	if (ret < 0)
+		metrics_usb_error(1, ret);
+	if (sent)
+		metrics_ep_write(sent, elapsed);
+
+	if(verbose)
+	{
+		printf("libusb_bulk_transfer sent %llu bytes; returned %d", (unsigned long long) sent, ret);
+		if (sent && elapsed)
+			printf(" (%.2f MB/s, %d x %d bytes in flight)", (double) sent / elapsed,
+				s->transfer_depth, s->transfer_size);
+		printf("\n");
+	}
+}
 
-int ep_write(void *buf, int len, libusb_device_handle * usb_device)
+int ep_write(void *buf, int len, struct boot_session *s)
 {
 	int a_len = 0;
-	int sending, sent;
-	int ret =
-	    libusb_control_transfer(usb_device, LIBUSB_REQUEST_TYPE_VENDOR, 0,
-				    len & 0xffff, len >> 16, NULL, 0, 1000);
+	uint64_t start;
+	int ret = s->transport.ops->control_out(&s->transport, len);
 
 	if(ret != 0)
 	{
 		printf("Failed control transfer (%d,%d)\n", ret, len);
+		metrics_usb_error(1, ret);
 		return ret;
 	}
 
-	while(len > 0)
+	start = time_now_us();
+	if (len > 0)
+		a_len = s->transport.ops->bulk_out(&s->transport, buf, len, &ret);
+	ep_write_done(s, a_len, ret, start);
+
+	return a_len;
+}
+
+struct blob_write {
+	struct boot_session *s;
+	uint64_t sent;
+	int ret;
+};
+
+// While the transfer settings are being tuned the data is sent in pieces
+// so that each sample of the throughput uses one set of settings.
+static int blob_write_chunk(void *ctx, const uint8_t *buf, size_t len)
+{
+	struct blob_write *w = ctx;
+	struct boot_session *s = w->s;
+
+	while (len)
 	{
-		sending = len < LIBUSB_MAX_TRANSFER ? len : LIBUSB_MAX_TRANSFER;
-		ret = libusb_bulk_transfer(usb_device, out_ep, buf, sending, &sent, 5000);
-		if (ret)
-			break;
-		a_len += sent;
-		buf += sent;
-		len -= sent;
+		size_t n = s->tune ? tune_sample_left(s->tune) : 0;
+		uint64_t start = time_now_us();
+		int sent;
+
+		if (!n || n > len)
+			n = len;
+		sent = s->transport.ops->bulk_out(&s->transport, buf, (int) n, &w->ret);
+		if (sent > 0)
+			w->sent += sent;
+		if (!w->ret && (size_t) sent != n)
+			w->ret = LIBUSB_ERROR_IO;
+		if (w->ret)
+			return -1;
+		if (s->tune)
+			tune_report(s->tune, n, time_now_us() - start, &s->transfer_size, &s->transfer_depth);
+		buf += n;
+		len -= n;
 	}
-	if(verbose)
-		printf("libusb_bulk_transfer sent %d bytes; returned %d\n", a_len, ret);
+	return 0;
+}
 
-	return a_len;
+// Sends a whole file in reply to ReadFile. The length is announced once
+// and the data follows as one or more bulk writes so that large files are
+// streamed from disk. Returns the number of bytes sent or a libusb error.
+static int64_t ep_write_blob(struct blob *b, struct boot_session *s)
+{
+	struct blob_write w = { s, 0, 0 };
+	uint64_t start;
+	int ret = s->transport.ops->control_out(&s->transport, (uint32_t) b->size);
+
+	if(ret != 0)
+	{
+		printf("Failed control transfer (%d,%llu)\n", ret, (unsigned long long) b->size);
+		metrics_usb_error(1, ret);
+		return ret;
+	}
+
+	start = time_now_us();
+	if (blob_stream(b, blob_write_chunk, &w) < 0 && !w.ret)
+		w.ret = LIBUSB_ERROR_IO;
+	ep_write_done(s, w.sent, w.ret, start);
+
+	return w.sent;
 }
 
-int ep_read(void *buf, int len, libusb_device_handle * usb_device)
+int ep_read(void *buf, int len, struct boot_session *s)
 {
-	int ret =
-	    libusb_control_transfer(usb_device,
-				    LIBUSB_REQUEST_TYPE_VENDOR |
-				    LIBUSB_ENDPOINT_IN, 0, len & 0xffff,
-				    len >> 16, buf, len, 20000);
+	int ret = s->transport.ops->control_in(&s->transport, buf, len);
+
 	if(ret >= 0)
 		return len;
-	else
-		return ret;
+
+	metrics_usb_error(0, ret);
+	return ret;
 }
 
 void print_version(void)
@@ -511,35 +937,193 @@ void get_options(int argc, char *argv[])
 		{
 			loop = 1;
 		}
-		else if(strcmp(*argv, "-v") == 0)
+		else if(strcmp(*argv, "-c") == 0)
 		{
-			verbose = 1;
+			argv++; argc--;
+			if(argc < 1)
+				usage(1);
+			max_sessions = atoi(*argv);
 		}
-		else if((strcmp(*argv, "-V") == 0) || (strcmp(*argv, "--version")) == 0)
+		else if(strcmp(*argv, "-C") == 0)
 		{
-			print_version();
-			exit(0);
+			argv++; argc--;
+			if(argc < 1)
+				usage(1);
+			cache_size = atol(*argv);
 		}
-		else if(strcmp(*argv, "-o") == 0)
+		else if(strcmp(*argv, "-b") == 0)
 		{
-			overlay = 1;
+			argv++; argc--;
+			if(argc < 1)
+				usage(1);
+			transfer_size = atoi(*argv);
 		}
-		else if(strcmp(*argv, "-m") == 0)
+		else if(strcmp(*argv, "-q") == 0)
 		{
 			argv++; argc--;
 			if(argc < 1)
 				usage(1);
-			delay = atol(*argv);
+			transfer_depth = atoi(*argv);
 		}
-		else if(strcmp(*argv, "-vv") == 0)
+		else if(strcmp(*argv, "--usbfs-staging") == 0)
 		{
-			verbose = 2;
+			usbfs_staging = 1;
 		}
-		else if(strcmp(*argv, "-s") == 0)
+		else if(strcmp(*argv, "--autotune") == 0)
 		{
-			signed_boot = 1;
-		}
-		else if(strcmp(*argv, "-j") == 0)
+			argv++; argc--;
+			if(argc < 1)
+				usage(1);
+			tune_open(*argv);
+		}
+		else if(strcmp(*argv, "--stats") == 0)
+		{
+			stats_open(NULL);
+		}
+		else if(strncmp(*argv, "--stats=", 8) == 0)
+		{
+			stats_open(*argv + 8);
+		}
+		else if(strcmp(*argv, "--metrics") == 0 || strcmp(*argv, "--metrics-socket") == 0)
+		{
+			int socket = (*argv)[9] != 0;
+
+			argv++; argc--;
+			if(argc < 1)
+				usage(1);
+			if ((socket ? metrics_open_socket(*argv) : metrics_open_file(*argv)) < 0)
+			{
+				fprintf(stderr, "Unable to export metrics to '%s'\n", *argv);
+				exit(-1);
+			}
+		}
+		else if(strcmp(*argv, "--simulate") == 0)
+		{
+			argv++; argc--;
+			if(argc < 1)
+				usage(1);
+			simulate_count = atoi(*argv);
+			if (simulate_count < 1)
+				usage(1);
+		}
+		else if(strcmp(*argv, "--sim-files") == 0)
+		{
+			argv++; argc--;
+			if(argc < 1)
+				usage(1);
+			simulate_files = *argv;
+		}
+		else if(strcmp(*argv, "--sim-chip") == 0)
+		{
+			argv++; argc--;
+			if(argc < 1)
+				usage(1);
+			simulate_chip = atoi(*argv);
+			if (simulate_chip != 2710 && simulate_chip != 2711 && simulate_chip != 2712)
+				usage(1);
+		}
+		else if(strcmp(*argv, "--dump-layers") == 0)
+		{
+			dump_layers = 1;
+		}
+		else if(strcmp(*argv, "--inventory") == 0)
+		{
+			argv++; argc--;
+			if(argc < 1)
+				usage(1);
+			if (inventory_open(*argv) < 0)
+				exit(-1);
+		}
+		else if(strcmp(*argv, "--inventory-get") == 0)
+		{
+			if(argc < 3)
+				usage(1);
+			exit(inventory_lookup(argv[1], argv[2], stdout) ? -1 : 0);
+		}
+		else if(strcmp(*argv, "--inventory-export") == 0)
+		{
+			if(argc < 2)
+				usage(1);
+			exit(inventory_export(argv[1], stdout) ? -1 : 0);
+		}
+		else if(strcmp(*argv, "--manifests") == 0)
+		{
+			argv++; argc--;
+			if(argc < 1)
+				usage(1);
+			manifest_dir = *argv;
+		}
+		else if(strcmp(*argv, "--record") == 0)
+		{
+			argv++; argc--;
+			if(argc < 1)
+				usage(1);
+			if (trace_record_open(*argv) < 0)
+			{
+				fprintf(stderr, "Unable to create trace '%s'\n", *argv);
+				exit(-1);
+			}
+		}
+		else if(strcmp(*argv, "--replay") == 0)
+		{
+			argv++; argc--;
+			if(argc < 1)
+				usage(1);
+			replay_path = *argv;
+		}
+		else if(strcmp(*argv, "--replay-paced") == 0)
+		{
+			replay_paced = 1;
+		}
+		else if(strcmp(*argv, "--import-usbmon") == 0)
+		{
+			if(argc < 3)
+				usage(1);
+			exit(trace_import_usbmon(argv[1], argv[2]) ? -1 : 0);
+		}
+		else if(strcmp(*argv, "--daemon") == 0)
+		{
+			argv++; argc--;
+			if(argc < 1)
+				usage(1);
+			daemon_path = *argv;
+			loop = 1;
+		}
+		else if(strcmp(*argv, "--control") == 0)
+		{
+			if(argc < 3)
+				usage(1);
+			exit(daemon_command(argv[1], argc - 2, argv + 2) ? -1 : 0);
+		}
+		else if(strcmp(*argv, "-v") == 0)
+		{
+			verbose = 1;
+		}
+		else if((strcmp(*argv, "-V") == 0) || (strcmp(*argv, "--version")) == 0)
+		{
+			print_version();
+			exit(0);
+		}
+		else if(strcmp(*argv, "-o") == 0)
+		{
+			overlay = 1;
+		}
+		else if(strcmp(*argv, "-m") == 0)
+		{
+			argv++; argc--;
+			if(argc < 1)
+				usage(1);
+			delay = atol(*argv);
+		}
+		else if(strcmp(*argv, "-vv") == 0)
+		{
+			verbose = 2;
+		}
+		else if(strcmp(*argv, "-s") == 0)
+		{
+			signed_boot = 1;
+		}
+		else if(strcmp(*argv, "-j") == 0)
 		{
 			if ((argc > 1) && (argv[1][0] != '-')) {
 				argv++; argc--;
@@ -581,75 +1165,73 @@ void get_options(int argc, char *argv[])
 	{
 		usage(1);
 	}
+	if(max_sessions < 1 || cache_size < 0)
+	{
+		usage(1);
+	}
+	if(transfer_size < 512 || transfer_size > LIBUSB_MAX_TRANSFER ||
+		transfer_depth < 1 || transfer_depth > LIBUSB_MAX_DEPTH)
+	{
+		usage(1);
+	}
 	if((targetPortNo != 99) && (targetpathname != NULL))
 	{
 		usage(1);
 	}
 }
 
-boot_message_t boot_message;
-void *second_stage_txbuf;
-
-int second_stage_prep(FILE *fp, FILE *fp_sig)
+// The second stage is sent directly from the blob. Ownership of the
+// blob passes to the session.
+int second_stage_prep(struct boot_session *s, struct blob *second_stage, struct blob *sig)
 {
-	int size;
-
-	fseek(fp, 0, SEEK_END);
-	boot_message.length = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
+	blob_close(s->second_stage);
+	s->second_stage = second_stage;
+	s->boot_message.length = second_stage->size;
 
-	if(fp_sig != NULL)
+	if(sig != NULL)
 	{
-		size = fread(boot_message.signature, 1, sizeof(boot_message.signature), fp_sig);
-		if (size != sizeof(boot_message.signature))
+		if (sig->size < sizeof(s->boot_message.signature))
 		{
 			fprintf(stderr, "Failed to read bootcode signature \n");
 			return -1;
 		}
-	}
-
-	if (second_stage_txbuf)
-		free(second_stage_txbuf);
-	second_stage_txbuf = NULL;
-
-	second_stage_txbuf = (uint8_t *) malloc(boot_message.length);
-	if (second_stage_txbuf == NULL)
-	{
-		fprintf(stderr, "Failed to allocate memory\n");
-		return -1;
-	}
-
-	size = fread(second_stage_txbuf, 1, boot_message.length, fp);
-	if(size != boot_message.length)
-	{
-		fprintf(stderr, "Failed to read second stage\n");
-		return -1;
+		memcpy(s->boot_message.signature, sig->data, sizeof(s->boot_message.signature));
 	}
 
 	return 0;
 }
 
-int second_stage_boot(libusb_device_handle *usb_device)
+int second_stage_boot(struct boot_session *s)
 {
 	int size, retcode = 0;
+	uint64_t deadline;
+	unsigned delay_us = BACKOFF_MIN_US;
 
-	size = ep_write(&boot_message, sizeof(boot_message), usb_device);
-	if (size != sizeof(boot_message))
+	s->stats.stage1_start_us = time_now_us();
+	size = ep_write(&s->boot_message, sizeof(s->boot_message), s);
+	if (size != sizeof(s->boot_message))
 	{
 		printf("Failed to write correct length, returned %d\n", size);
 		return -1;
 	}
 
-	if(verbose) printf("Writing %d bytes\n", boot_message.length);
-	size = ep_write(second_stage_txbuf, boot_message.length, usb_device);
-	if (size != boot_message.length)
+	if(verbose) printf("Writing %d bytes\n", s->boot_message.length);
+	size = ep_write((void *) s->second_stage->data, s->boot_message.length, s);
+	if (size != s->boot_message.length)
 	{
 		printf("Failed to read correct length, returned %d\n", size);
 		return -1;
 	}
+	s->stats.stage1_end_us = time_now_us();
+	s->stats.stage1_bytes = sizeof(s->boot_message) + s->boot_message.length;
 
-	sleep(1);
-	size = ep_read((unsigned char *)&retcode, sizeof(retcode), usb_device);
+	// Poll for the return code until the device is ready to report it
+	deadline = time_now_us() + RETCODE_DEADLINE_MS * 1000;
+	do
+	{
+		size = ep_read((unsigned char *)&retcode, sizeof(retcode), s);
+	}
+	while (size < 0 && size != LIBUSB_ERROR_NO_DEVICE && backoff(deadline, &delay_us));
 
 	if (size > 0 && retcode == 0)
 	{
@@ -665,108 +1247,223 @@ int second_stage_boot(libusb_device_handle *usb_device)
 }
 
 
-FILE * check_file(const char * dir, const char *fname, int use_fmem)
+// Files are looked for in these layers, highest priority first. With -o
+// the serial/<serial>/, <USB path>/ and hub/<hub USB path>/ subdirectories
+// of the boot directory are overlays for a single device or for every
+// device on a hub. Next are the chip directory (2710, 2711 or 2712),
+// bootfiles.bin if it is being used and finally the boot directory itself.
+static struct layers *session_layers(const struct boot_session *s, const char *dir)
 {
-	FILE * fp = NULL;
+	const char *prefix = s->bcm2712 ? "2712" : s->bcm2711 ? "2711" : "2710";
+	struct layers *l = layers_create();
 	char path[MAX_PATH_LEN];
-	const char *prefix = bcm2712 ? "2712" : bcm2711 ? "2711" : "2710";
 
-	// Prevent USB device from requesting files in parent directories
-	if(strstr(fname, ".."))
-	{
-		printf("Denying request for filename containing .. to prevent path traversal\n");
+	if (!l)
 		return NULL;
-	}
 
-	if (use_bootfiles && use_fmem)
+	if (dir && overlay)
 	{
-		unsigned long length = 0;
+		const char *serial = (const char *) s->serial_num;
 
-		// If 'dir' is specified and the file exists then load this in preference
-		// to the file in bootfiles.bin e.g. use a custom config.txt or cmdline.txt
-		// to override settings in the mass-storage-gadget
-		if (dir)
+		// The serial number comes from the device so it must not be a path
+		if (serial[0] && strspn(serial, "0123456789abcdefABCDEF") == strlen(serial))
 		{
-			snprintf(path, sizeof(path), "%s/%s/%s", dir, prefix, fname);
-			path[sizeof(path) - 1] = 0;
-			fp = fopen(path, "rb");
-
-			if (fp)
-			{
-				printf("Loading bootfiles.bin overlay: %s\n", path);
-				return fp;
-			}
+			snprintf(path, sizeof(path), "%s/serial/%.32s", dir, serial);
+			layers_add_dir(l, "serial", path, LAYER_DEVICE);
 		}
+		if (s->pathname[0])
+		{
+			int hub_len = strcspn(s->pathname, ".");
+
+			snprintf(path, sizeof(path), "%s/%s", dir, s->pathname);
+			layers_add_dir(l, "port", path, LAYER_DEVICE);
 
-		snprintf(path, sizeof(path), "%s/%s", prefix, fname);
-		path[sizeof(path) - 1] = 0;
-		if (bootfile_data)
-			free(bootfile_data);
-		bootfile_data = bootfiles_read(bootfiles_path, path, &length);
-		if (bootfile_data)
-			fp = fmemopen(bootfile_data, length, "rb");
-		if (fp)
-			return fp;
+			// The hub is the path without the last port number
+			if (strrchr(s->pathname, '.'))
+				hub_len = strrchr(s->pathname, '.') - s->pathname;
+			snprintf(path, sizeof(path), "%s/hub/%.*s", dir, hub_len, s->pathname);
+			layers_add_dir(l, "hub", path, LAYER_DEVICE);
+		}
+	}
+	if (dir)
+	{
+		snprintf(path, sizeof(path), "%s/%s", dir, prefix);
+		layers_add_dir(l, "chip", path, 0);
 	}
+	if (use_bootfiles)
+		layers_add_archive(l, "bootfiles.bin", bootfiles_path, prefix);
+	if (dir)
+		layers_add_dir(l, "directory", dir, LAYER_BASE);
+	return l;
+}
+
+// Returns the newer of 'ts' and the mtime of 'path', if it is a file
+static uint64_t newer_mtime(uint64_t ts, const char *path)
+{
+	struct stat st;
+
+	if (path[0] && dirindex_stat(path, &st) == 0 && (uint64_t) st.st_mtime > ts)
+		return st.st_mtime;
+	return ts;
+}
 
-	if(dir)
+// Generates pieeprom.bin and pieeprom.sig in memory by applying boot.conf
+// to pieeprom.original.bin, as update-pieeprom.sh would, if boot.conf comes
+// from a higher priority layer than any pieeprom.bin. A per-serial boot.conf
+// therefore gives each device its own EEPROM image without writing one to
+// disk. The image is generated once per session and the timestamp in the
+// signature is the mtime of the newest input so it doesn't change between
+// boots.
+static struct blob *eeprom_file(struct boot_session *s, const struct layers *l, const char *fname, int flags)
+{
+	const char *conf_source, *source;
+	struct blob *conf, *b, *original;
+	struct eeprom_layout layout;
+	char path[MAX_PATH_LEN];
+	char sig[EEPROM_SIG_MAX];
+	uint8_t *image;
+	uint64_t ts;
+	int len;
+
+	if (!s->eeprom)
 	{
-		if(overlay && (pathname[0] != 0) &&
-				(strcmp(fname, "bootcode5.bin") != 0) &&
-				(strcmp(fname, "bootcode4.bin") != 0) &&
-				(strcmp(fname, "bootcode.bin") != 0))
+		conf = layers_open(l, "boot.conf", flags, &conf_source, path, sizeof(path));
+		if (!conf)
+			return NULL;
+		ts = newer_mtime(0, path);
+
+		// A signed config or a public key must be added by update-pieeprom.sh
+		// with the signing key so don't replace it with an unsigned image.
+		b = layers_open(l, "bootconf.sig", flags, &source, path, sizeof(path));
+		if (!b)
+			b = layers_open(l, "pubkey.bin", flags, &source, path, sizeof(path));
+		if (b)
 		{
-			snprintf(path, sizeof(path), "%s/%s/%s", dir, pathname, fname);
-			path[sizeof(path) - 1] = 0;
-			fp = fopen(path, "rb");
-			if (fp)
-				printf("Loading: %s\n", path);
-			memset(path, 0, sizeof(path));
+			if (verbose)
+				printf("Not generating pieeprom.bin from boot.conf because of %s\n", path);
+			blob_close(b);
+			blob_close(conf);
+			return NULL;
 		}
 
-		if (fp == NULL)
+		b = layers_open(l, "pieeprom.bin", flags, &source, path, sizeof(path));
+		if (b)
 		{
-			// try to open file in  device specific sub folder first (eg. 2712/...)
-			snprintf(path, sizeof(path), "%s/%s/%s", dir, prefix, fname);
-			path[sizeof(path) - 1] = 0;
-			fp = fopen(path, "rb");
-
-			// fallback to top level and look for requested file
-			if (fp == NULL)
+			blob_close(b);
+			if (layers_rank(l, source) <= layers_rank(l, conf_source))
 			{
-				snprintf(path, sizeof(path), "%s/%s", dir, fname);
-				path[sizeof(path) - 1] = 0;
-				fp = fopen(path, "rb");
+				blob_close(conf);
+				return NULL;
 			}
+		}
+
+		original = layers_open(l, "pieeprom.original.bin", flags, &source, path, sizeof(path));
+		image = original && original->data ? malloc(original->size) : NULL;
+		if (!image || eeprom_parse(original->data, original->size, &layout) < 0)
+		{
+			free(image);
+			blob_close(original);
+			blob_close(conf);
+			return NULL;
+		}
+		ts = newer_mtime(ts, path);
+		memcpy(image, original->data, original->size);
+		blob_close(original);
 
-			if (fp)
-				printf("Loading: %s\n", path);
+		if (eeprom_set_config(image, &layout, conf->size ? conf->data : (const uint8_t *) "", conf->size) < 0)
+		{
+			free(image);
+			blob_close(conf);
+			return NULL;
+		}
+		blob_close(conf);
+
+		len = eeprom_sig(image, layout.size, ts, sig, sizeof(sig));
+		s->eeprom = blob_heap(image, layout.size);
+		s->eeprom_sig = blob_heap(strdup(sig), len);
+		if (!s->eeprom || !s->eeprom_sig || !s->eeprom_sig->data)
+		{
+			blob_close(s->eeprom);
+			blob_close(s->eeprom_sig);
+			s->eeprom = s->eeprom_sig = NULL;
+			return NULL;
 		}
+		printf("Generated pieeprom.bin from boot.conf (%s)\n", conf_source);
+	}
+
+	s->file_source = "eeprom";
+	return blob_ref(strcmp(fname, "pieeprom.sig") == 0 ? s->eeprom_sig : s->eeprom);
+}
+
+struct blob * check_file(struct boot_session *s, const char * dir, const char *fname, int use_fmem)
+{
+	struct blob * file = NULL;
+	char path[MAX_PATH_LEN];
+	struct layers *l = s->layers;
+	int flags = 0;
+
+	// Prevent USB device from requesting files in parent directories
+	if(strstr(fname, ".."))
+	{
+		printf("Denying request for filename containing .. to prevent path traversal\n");
+		return NULL;
 	}
 
+	// Sessions which haven't compiled their layers try each one in turn.
+	// Prefetch sessions always use theirs as the boot directory may change
+	// while they run.
+	if (!l || (!s->prefetch && dir != directory))
+		l = session_layers(s, dir);
+
+	if (strcmp(fname, "bootcode5.bin") == 0 ||
+		strcmp(fname, "bootcode4.bin") == 0 ||
+		strcmp(fname, "bootcode.bin") == 0)
+		flags |= LAYERS_SKIP_DEVICE;
+	if (!use_fmem)
+		flags |= LAYERS_SKIP_ARCHIVE;
+
+	path[0] = 0;
+	if (l && use_fmem && (strcmp(fname, "pieeprom.bin") == 0 || strcmp(fname, "pieeprom.sig") == 0))
+		file = eeprom_file(s, l, fname, flags);
+	if (l && !file)
+		file = layers_open(l, fname, flags, &s->file_source, path, sizeof(path));
+	if (file && path[0] && !s->prefetch)
+	{
+		if (dump_layers)
+			printf("Loading (%s): %s\n", s->file_source, path);
+		else
+			printf("Loading: %s\n", path);
+	}
+	if (l != s->layers)
+		layers_free(l);
+
 	// Failover to fmem unless use_fmem is zero in which case this function
 	// is being used to check if a file exists.
-	if(fp == NULL && use_fmem)
+	if(file == NULL && use_fmem)
 	{
-		if (bcm2711)
+		if (s->bcm2711)
 		{
 			if(strcmp(fname, "bootcode4.bin") == 0)
-				fp = fmemopen(msd_bootcode4_bin, msd_bootcode4_bin_len, "rb");
+				file = blob_static(msd_bootcode4_bin, msd_bootcode4_bin_len);
 			else if(strcmp(fname, "start4.elf") == 0)
-				fp = fmemopen(msd_start_elf, msd_start_elf_len, "rb");
+				file = blob_static(msd_start_elf, msd_start_elf_len);
 		}
 		else
 		{
 			if(strcmp(fname, "bootcode.bin") == 0)
-				fp = fmemopen(msd_bootcode_bin, msd_bootcode_bin_len, "rb");
+				file = blob_static(msd_bootcode_bin, msd_bootcode_bin_len);
 			else if(strcmp(fname, "start.elf") == 0)
-				fp = fmemopen(msd_start_elf, msd_start_elf_len, "rb");
+				file = blob_static(msd_start_elf, msd_start_elf_len);
+		}
+		if (file)
+		{
+			if (!s->prefetch)
+				printf("Loading embedded: %s\n", fname);
+			s->file_source = "embedded";
 		}
-		if (fp)
-			printf("Loading embedded: %s\n", fname);
 	}
 
-	return fp;
+	return file;
 }
 
 void close_metadata_file(FILE ** fp){
@@ -777,12 +1474,12 @@ void close_metadata_file(FILE ** fp){
 
 void write_metadata_file(char *metadata_str, FILE **fp, int index)
 {
-	char *token, *property, *value;
+	char *token, *property, *value, *saveptr;
 
-	token = strtok(metadata_str, "*");
+	token = strtok_r(metadata_str, "*", &saveptr);
 	if(!token) return;
 	property = strdup(token);
-	token = strtok(NULL, "*");
+	token = strtok_r(NULL, "*", &saveptr);
 
 	if(token)
 	{
@@ -809,7 +1506,32 @@ void write_metadata_file(char *metadata_str, FILE **fp, int index)
 	free(property);
 }
 
-void create_metadata_file(FILE ** fp)
+// Adds a PROPERTY*value metadata message to the session's inventory record
+static void inventory_add_metadata(struct boot_session *s, const char *metadata)
+{
+	char property[FILE_NAME_LENGTH];
+	char value[FILE_NAME_LENGTH];
+	const char *sep = strchr(metadata, '*');
+
+	if (!sep || sep == metadata)
+		return;
+	snprintf(property, sizeof(property), "%.*s", (int) (sep - metadata), metadata);
+	snprintf(value, sizeof(value), "%s", sep + 1);
+
+	if (!s->inventory)
+		s->inventory = inventory_record_create((const char *) s->serial_num);
+	if (strcmp(property, "FACTORY_UUID") == 0)
+	{
+		char c40_str[DUID_LENGTH];
+
+		if (duid_decode_c40(value, c40_str) == -1)
+			return;
+		snprintf(value, sizeof(value), "%s", c40_str);
+	}
+	inventory_record_add(s->inventory, property, value);
+}
+
+void create_metadata_file(struct boot_session *s, FILE ** fp)
 {
 	if (metadata_path == NULL)
 	{
@@ -817,7 +1539,7 @@ void create_metadata_file(FILE ** fp)
 		return;
 	}
 	char fname[MAX_PATH_LEN + FILE_NAME_LENGTH + 5]; // + 5 for extension ".json"
-	snprintf(fname, sizeof(fname), "%s/%s.json", metadata_path, (char *)serial_num);
+	snprintf(fname, sizeof(fname), "%s/%s.json", metadata_path, (char *)s->serial_num);
 
 	*fp = fopen(fname, "w");
 	if (*fp)
@@ -831,124 +1553,142 @@ void create_metadata_file(FILE ** fp)
 	}
 }
 
-int file_server(libusb_device_handle * usb_device)
+int file_server(struct boot_session *s)
 {
 	int going = 1;
 	struct file_message {
 		int command;
 		char fname[MAX_PATH_LEN];
 	} message;
-	static FILE * fp = NULL;
 	FILE * metadata_fp = NULL;
 	char metadata_fname[FILE_NAME_LENGTH];
 	int metadata_index = 0;
+	unsigned delay_us = BACKOFF_MIN_US;
+	struct file_stats *fstats;
+	int file_index = -1;	// Stats entry of the last GetFileSize
 
 	while(going)
 	{
 		char message_name[][20] = {"GetFileSize", "ReadFile", "Done"};
-		int i = ep_read(&message, sizeof(message), usb_device);
+		int i = ep_read(&message, sizeof(message), s);
 		if(i < 0)
 		{
 			// Drop out if the device goes away
 			if(i == LIBUSB_ERROR_NO_DEVICE || i == LIBUSB_ERROR_IO)
 				break;
-			sleep(1);
+			// Each ep_read waits up to its own timeout for the next request
+			// so there is no overall deadline, just a bounded backoff.
+			backoff(UINT64_MAX, &delay_us);
 			continue;
 		}
+		delay_us = BACKOFF_MIN_US;
 		if(verbose) printf("Received message %s: %s\n", message_name[message.command], message.fname);
 
 		// Done can also just be null filename
 		if(strlen(message.fname) == 0)
 		{
-			ep_write(NULL, 0, usb_device);
+			ep_write(NULL, 0, s);
 			break;
 		}
 
 		// Metadata files
 		if ((message.fname[0] == '*') && (message.command != 2))
 		{
-			if (!metadata_fp)
+			if (inventory_enabled() && (s->bcm2711 || s->bcm2712))
+				inventory_add_metadata(s, message.fname + 1);
+
+			// With an inventory the metadata is only written as JSON with -j
+			if (!metadata_fp && !s->metadata_disabled && (metadata_path || !inventory_enabled()))
 			{
-				if (bcm2711 || bcm2712)
+				if (s->bcm2711 || s->bcm2712)
 				{
-					create_metadata_file(&metadata_fp);
-					metadata = 1;
+					create_metadata_file(s, &metadata_fp);
+					s->metadata = 1;
 				}
 			}
-			if (metadata)
+			if (s->metadata)
 			{
 				strcpy(metadata_fname, message.fname);
 				write_metadata_file(metadata_fname + 1, &metadata_fp, metadata_index++);
 			}
-			ep_write(NULL, 0, usb_device);
+			ep_write(NULL, 0, s);
 			continue;
 		}
 
 		switch(message.command)
 		{
 			case 0: // Get file size
-				if(fp)
-					fclose(fp);
-				fp = check_file(directory, message.fname, 1);
-				if(strlen(message.fname) && fp != NULL)
+				blob_close(s->file);
+				s->file = check_file(s, directory, message.fname, 1);
+				fstats = stats_add_file(&s->stats, message.fname);
+				file_index = fstats ? s->stats.num_files - 1 : -1;
+				if (fstats)
 				{
-					int file_size;
+					fstats->get_size_us = time_now_us();
+					fstats->source = s->file ? s->file_source : NULL;
+					fstats->size = s->file ? s->file->size : 0;
+				}
+				// The size is sent in the 32 bit length of the control request
+				if (s->file && (uint64_t) s->file->size > UINT32_MAX)
+				{
+					printf("%s is too large to send (%llu bytes)\n", message.fname,
+						(unsigned long long) s->file->size);
+					blob_close(s->file);
+					s->file = NULL;
+				}
+				if(strlen(message.fname) && s->file != NULL)
+				{
+					uint64_t file_size = s->file->size;
 
-					fseek(fp, 0, SEEK_END);
-					file_size = ftell(fp);
-					fseek(fp, 0, SEEK_SET);
+					if (manifest_dir)
+					{
+						if (!s->learned)
+							s->learned = calloc(1, sizeof(*s->learned));
+						if (s->learned)
+							manifest_add(s->learned, message.fname);
+					}
 
 					if(verbose || !file_size)
-						printf("File size = %d bytes\n", file_size);
+						printf("File size = %llu bytes\n", (unsigned long long) file_size);
 
-					int sz = libusb_control_transfer(usb_device, LIBUSB_REQUEST_TYPE_VENDOR, 0,
-					    file_size & 0xffff, file_size >> 16, NULL, 0, 1000);
+					int sz = s->transport.ops->control_out(&s->transport, file_size);
 
 					if(sz < 0)
 						return -1;
 				}
 				else
 				{
-					ep_write(NULL, 0, usb_device);
+					ep_write(NULL, 0, s);
 					printf("Cannot open file %s\n", message.fname);
 					break;
 				}
 				break;
 
 			case 1: // Read file
-				if(fp != NULL)
+				if(s->file != NULL)
 				{
-					int file_size;
-					void *buf;
+					int64_t file_size = s->file->size;
 
 					printf("File read: %s\n", message.fname);
 
-					fseek(fp, 0, SEEK_END);
-					file_size = ftell(fp);
-					fseek(fp, 0, SEEK_SET);
-
 					if (!file_size)
 						printf("WARNING: %s is empty\n", message.fname);
 
-					buf = malloc(file_size);
-					if(buf == NULL)
-					{
-						printf("Failed to allocate buffer for file %s\n", message.fname);
-						return -1;
-					}
-					int read = fread(buf, 1, file_size, fp);
-					if(read != file_size)
+					uint64_t read_start_us = time_now_us();
+					int64_t sz = ep_write_blob(s->file, s);
+					uint64_t read_end_us = time_now_us();
+
+					fstats = file_index >= 0 ? &s->stats.files[file_index] : NULL;
+					if (fstats)
 					{
-						printf("Failed to read from input file\n");
-						free(buf);
-						return -1;
+						fstats->read_start_us = read_start_us;
+						fstats->read_end_us = read_end_us;
 					}
+					if (sz == file_size)
+						metrics_file_served(file_size, read_end_us - read_start_us);
 
-					int sz = ep_write(buf, file_size, usb_device);
-
-					free(buf);
-					fclose(fp);
-					fp = NULL;
+					blob_close(s->file);
+					s->file = NULL;
 
 					if(sz != file_size)
 					{
@@ -959,7 +1699,7 @@ int file_server(libusb_device_handle * usb_device)
 				else
 				{
 					if(verbose) printf("No file %s found\n", message.fname);
-					ep_write(NULL, 0, usb_device);
+					ep_write(NULL, 0, s);
 				}
 				break;
 
@@ -974,154 +1714,1032 @@ int file_server(libusb_device_handle * usb_device)
 		}
 	}
 
-	if (metadata)
+	if (s->metadata)
 		close_metadata_file(&metadata_fp);
+	if (s->inventory)
+	{
+		inventory_record_commit(s->inventory);
+		s->inventory = NULL;
+	}
 
 	printf("Second stage boot server done\n");
 	return 0;
 }
 
-int main(int argc, char *argv[])
+static void request_rescan(void)
+{
+	pthread_mutex_lock(&sessions_lock);
+	rescan_pending = 1;
+	pthread_mutex_unlock(&sessions_lock);
+#if LIBUSBX_API_VERSION >= 0x01000105
+	if (hotplug)
+		libusb_interrupt_event_handler(usb_ctx);
+#endif
+}
+
+static int take_rescan(void)
+{
+	int pending;
+
+	pthread_mutex_lock(&sessions_lock);
+	pending = rescan_pending;
+	rescan_pending = 0;
+	pthread_mutex_unlock(&sessions_lock);
+	return pending;
+}
+
+static int LIBUSB_CALL hotplug_callback(libusb_context *ctx, libusb_device *dev,
+	libusb_hotplug_event event, void *user_data)
 {
-	libusb_context *ctx;
-	libusb_device_handle *usb_device;
 	struct libusb_device_descriptor desc;
-	struct libusb_config_descriptor *config;
 
-	get_options(argc, argv);
-	print_version();
-	printf("\nPlease fit the EMMC_DISABLE / nRPIBOOT jumper before connecting the power and USB cables to the target device.\n");
-	printf("If the device fails to connect then please see https://rpltd.co/rpiboot for debugging tips.\n\n");
+	(void) ctx;
+	(void) user_data;
 
-	// flush immediately
-	setbuf(stdout, NULL);
+	if (libusb_get_device_descriptor(dev, &desc) < 0)
+		return 0;
 
-	// If the boot directory is specified then check that it contains bootcode files.
-	if (directory)
-	{
-		FILE *f, *f4, *f5;
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED && !is_bcm_product(desc.idProduct))
+		return 0;
 
-		if (verbose)
-			printf("Boot directory '%s'\n", directory);
+	if (verbose == 2)
+		printf("Hotplug: device %04x %s bus %d address %d\n", desc.idProduct,
+			event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ? "arrived" : "left",
+			libusb_get_bus_number(dev), libusb_get_device_address(dev));
 
-		f = check_file(directory, "bootfiles.bin", 0);
-		if (f)
-		{
-			snprintf(bootfiles_path, sizeof(bootfiles_path),"%s/%s", directory, "bootfiles.bin");
-			printf("Using %s\n", bootfiles_path);
-			bootfiles_path[sizeof(bootfiles_path) - 1] = 0;
-			use_bootfiles = 1;
-			fclose(f);
-			f = NULL;
-		}
-		else
-		{
-			f = check_file(directory, "bootcode.bin", 0);
-			f4 = check_file(directory, "bootcode4.bin", 0);
-			f5 = check_file(directory, "bootcode5.bin", 0);
-			if (!f && !f4 && !f5)
-			{
-				fprintf(stderr, "No 'bootcode' files found in '%s'\n", directory);
-				usage(1);
-			}
-			if (f)
-				fclose(f);
-			if (f4)
-				fclose(f4);
-			if (f5)
-				fclose(f5);
-		}
+	request_rescan();
+	return 0;
+}
 
-		if (signed_boot)
-		{
-			f = check_file(directory, "bootsig.bin", 0);
-			if (!f)
-			{
-				fprintf(stderr, "Unable to open 'bootsig.bin' from %s\n", directory);
-				usage(1);
-			}
-			fclose(f);
-		}
-	}
+// Boot manifests are keyed by everything that changes which files
+// check_file() returns: the chip, the boot directory and the overlays.
+static void manifest_key(const struct boot_session *s, char *key, size_t len)
+{
+	snprintf(key, len, "%s %s %s %s", s->bcm2712 ? "2712" : s->bcm2711 ? "2711" : "2710",
+		directory ? directory : "-", overlay && s->pathname[0] ? s->pathname : "-",
+		overlay && s->serial_num[0] ? (const char *) s->serial_num : "-");
+}
 
-	int ret = libusb_init(&ctx);
-	if (ret)
+// Saves the files requested by a successful second stage if they differ
+// from the manifest that was used for the prefetch.
+static void manifest_update(struct boot_session *s)
+{
+	struct manifest *m;
+	char key[MAX_PATH_LEN * 2];
+
+	if (!manifest_dir || !s->learned)
+		return;
+
+	manifest_key(s, key, sizeof(key));
+	m = manifest_load(manifest_dir, key);
+	if (!manifest_equal(m, s->learned))
 	{
-		printf("Failed to initialise libUSB\n");
-		exit(-1);
+		if (manifest_save(manifest_dir, key, s->learned) < 0)
+			fprintf(stderr, "Failed to save boot manifest in %s\n", manifest_dir);
+		else if (verbose)
+			printf("Saved boot manifest of %d files for %s\n", s->learned->num_names, key);
 	}
+	manifest_free(m);
+}
 
-#if LIBUSBX_API_VERSION < 0x01000106
-	libusb_set_debug(ctx, (verbose == 2)? LIBUSB_LOG_LEVEL_WARNING : 0);
-#else
-	libusb_set_option(
-		ctx,
-		LIBUSB_OPTION_LOG_LEVEL,
-		verbose ? verbose == 2 ? LIBUSB_LOG_LEVEL_INFO : LIBUSB_LOG_LEVEL_WARNING : 0
-		);
-#endif
+// Loads the files in the manifest into the cache while the device runs
+// the second stage bootcode and re-enumerates. The manifest key and the
+// layers are set up when the thread is started so that it never reads the
+// boot directory, which changes between daemon jobs.
+struct prefetch {
+	struct boot_session *s;
+	char key[MAX_PATH_LEN * 2];
+};
 
-	do
+static void *prefetch_thread(void *arg)
+{
+	struct prefetch *p = arg;
+	struct boot_session *s = p->s;
+	struct manifest *m;
+	uint64_t start = time_now_us();
+	size_t bytes = 0;
+	int i;
+
+	m = s->layers ? manifest_load(manifest_dir, p->key) : NULL;
+	for (i = 0; m && i < m->num_names; i++)
 	{
-		int last_serial = -1;
+		struct blob *b = check_file(s, NULL, m->names[i], 1);
 
-		printf("Waiting for BCM2835/6/7/2711/2712...\n\n");
+		blob_prefetch(b);
+		bytes += b ? b->size : 0;
+		blob_close(b);
+	}
+	if (verbose && m)
+		printf("Prefetched %d files (%lu bytes) for %s in %.3f seconds\n", m->num_names,
+			(unsigned long) bytes, s->pathname, (time_now_us() - start) / 1e6);
+
+	manifest_free(m);
+	session_free(s);
+	free(p);
+	return NULL;
+}
+
+static void start_prefetch(const struct boot_session *stage1)
+{
+	struct prefetch *p;
+	struct boot_session *s;
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if (!manifest_dir)
+		return;
+
+	p = calloc(1, sizeof(*p));
+	s = session_alloc(stage1->pathname);
+	if (!p || !s)
+	{
+		free(p);
+		free(s);
+		return;
+	}
+	s->bcm2711 = stage1->bcm2711;
+	s->bcm2712 = stage1->bcm2712;
+	memcpy(s->serial_num, stage1->serial_num, sizeof(s->serial_num));
+	s->prefetch = 1;
+	s->layers = session_layers(s, directory);
+	manifest_key(s, p->key, sizeof(p->key));
+	p->s = s;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, prefetch_thread, p) != 0)
+	{
+		session_free(s);
+		free(p);
+	}
+	pthread_attr_destroy(&attr);
+}
 
-		// Wait for a device to get plugged in
-		do
+// Runs the current stage of the boot protocol on an open session
+static int session_run(struct boot_session *s)
+{
+	int chip = s->bcm2712 ? 2712 : s->bcm2711 ? 2711 : 2710;
+	int result;
+
+	trace_record_attach(&s->transport);
+	metrics_session_start(chip, s->stage == SESSION_STAGE_FILE_SERVER);
+	if (s->stage == SESSION_STAGE_BOOTCODE)
+	{
+		printf("Sending bootcode.bin\n");
+		result = second_stage_boot(s);
+		if (result == 0)
+			start_prefetch(s);
+	}
+	else
+	{
+		// Resolve the overlays for this device once rather than on every request
+		s->layers = session_layers(s, directory);
+		if (layers_compile(s->layers) < 0)
 		{
-			ret = Initialize_Device(&ctx, &usb_device);
-			if(ret == 0)
-			{
-				libusb_get_device_descriptor(libusb_get_device(usb_device), &desc);
+			layers_free(s->layers);
+			s->layers = NULL;
+		}
+		else if (dump_layers)
+		{
+			printf("Files for %s:\n", s->pathname);
+			layers_dump(s->layers, stdout);
+		}
 
-				if(verbose)
-					printf("Found serial number %d\n", desc.iSerialNumber);
+		printf("Second stage boot server\n");
+		result = file_server(s);
+		if (result == 0)
+			manifest_update(s);
+		printf("Boot time %s: %.3f seconds from device connection to second stage done\n",
+			s->pathname, (time_now_us() - s->boot_start_us) / 1e6);
+	}
 
-				// Make sure we've re-enumerated since the last time
-				if(desc.iSerialNumber == last_serial)
-				{
-					ret = -1;
-					libusb_close(usb_device);
-				}
+	s->stats.end_us = time_now_us();
+	metrics_session_end(chip, s->stage == SESSION_STAGE_FILE_SERVER, result,
+		s->stats.end_us - s->stats.discovered_us, s->stats.stage1_bytes);
+	trace_record_finish(&s->transport, s->stage == SESSION_STAGE_BOOTCODE ? "bootcode" : "file_server",
+		chip, s->pathname);
+	stats_write(&s->stats, (const char *) s->serial_num, s->pathname,
+		s->bcm2712 ? "2712" : s->bcm2711 ? "2711" : "2710",
+		s->stage == SESSION_STAGE_BOOTCODE ? "bootcode" : "file_server", result);
+	return result;
+}
 
-				libusb_get_active_config_descriptor(libusb_get_device(usb_device), &config);
-			}
+static void *session_thread(void *arg)
+{
+	struct boot_session *s = arg;
+	int ret;
+
+	if (tune_enabled())
+		s->tune = tune_get(s->bcm2712 ? 2712 : s->bcm2711 ? 2711 : 2710, s->pathname,
+			&s->transfer_size, &s->transfer_depth);
+
+	if (Initialize_Device(s) == 0)
+	{
+		if(verbose)
+			printf("Found serial number %d\n", s->desc.iSerialNumber);
 
-			if (ret)
+		ret = libusb_get_string_descriptor_ascii(s->usb_device, s->desc.iSerialNumber, s->serial_num, sizeof(s->serial_num));
+		// if metadata output is enabled and could not get serial number
+		if (metadata_path && (ret <= 0))
+			s->metadata_disabled = 1;
+
+		session_run(s);
+		session_close_device(s);
+	}
+
+	pthread_mutex_lock(&sessions_lock);
+	s->state = SESSION_STATE_FINISHED;
+	pthread_mutex_unlock(&sessions_lock);
+
+	// Wake the discovery loop to join this thread and pick up any devices
+	// that were waiting for a free session.
+	request_rescan();
+	return NULL;
+}
+
+// Records when the first stage started on a USB path or, for the second
+// stage, returns that time and forgets it.
+static uint64_t boot_start_time(struct boot_session *s)
+{
+	uint64_t now = time_now_us();
+	int i, slot = 0;
+
+	for (i = 0; i < MAX_BOOT_STARTS; i++)
+	{
+		if (strcmp(boot_starts[i].pathname, s->pathname) == 0)
+		{
+			if (s->stage == SESSION_STAGE_FILE_SERVER)
 			{
-				usleep(delay);
+				boot_starts[i].pathname[0] = 0;
+				return boot_starts[i].time_us;
 			}
+			slot = i;
+			break;
 		}
-		while (ret);
+		if (boot_starts[i].time_us < boot_starts[slot].time_us)
+			slot = i;
+	}
 
-		ret = libusb_get_string_descriptor_ascii(usb_device, desc.iSerialNumber, serial_num, sizeof(serial_num));
-		// if metadata output is enabled and could not get serial number
-		if (metadata && (ret <= 0)) {
-			metadata = 0; // disable metadata
+	if (s->stage == SESSION_STAGE_BOOTCODE)
+	{
+		strcpy(boot_starts[slot].pathname, s->pathname);
+		boot_starts[slot].time_us = now;
+	}
+	return now;
+}
+
+static struct boot_session *session_find(uint8_t bus, uint8_t address)
+{
+	struct boot_session *s;
+
+	for (s = sessions; s; s = s->next)
+		if (s->bus == bus && s->address == address)
+			return s;
+	return NULL;
+}
+
+static int sessions_active(void)
+{
+	struct boot_session *s;
+	int active = 0;
+
+	pthread_mutex_lock(&sessions_lock);
+	for (s = sessions; s; s = s->next)
+		if (s->state != SESSION_STATE_IDLE)
+			active++;
+	pthread_mutex_unlock(&sessions_lock);
+	return active;
+}
+
+// Scans the bus for Raspberry Pi devices which do not already have a session
+// and starts a new session for each one. Devices are tracked by bus and
+// device address so a device is only served again once it has re-enumerated.
+// Starts the thread for a new session and adds it to the session list
+static void session_start(struct boot_session *s)
+{
+	s->stage = (s->desc.iSerialNumber == 0 || s->desc.iSerialNumber == 3) ?
+		SESSION_STAGE_BOOTCODE : SESSION_STAGE_FILE_SERVER;
+	s->boot_start_us = boot_start_time(s);
+
+	select_default_directory(s);
+	if (s->stage == SESSION_STAGE_BOOTCODE)
+		load_second_stage(s);
+
+	if (pthread_create(&s->thread, NULL, session_thread, s) != 0)
+	{
+		fprintf(stderr, "Failed to start session thread\n");
+		session_close_device(s);
+		session_free(s);
+		return;
+	}
+
+	pthread_mutex_lock(&sessions_lock);
+	s->next = sessions;
+	sessions = s;
+	pthread_mutex_unlock(&sessions_lock);
+}
+
+#ifdef __linux__
+// With -p the device at that USB path is looked up directly in sysfs,
+// whose device names use the same bus-port.port format, and the usbfs node
+// is opened and wrapped by libusb. Each scan reads a couple of attributes
+// of one device instead of enumerating the whole bus so re-enumeration on
+// the port is seen as a change of devnum.
+#define SYSFS_USB_DEVICES "/sys/bus/usb/devices"
+
+static int sysfs_read_attr(const char *pathname, const char *attr, char *buf, size_t len)
+{
+	char path[MAX_PATH_LEN];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", SYSFS_USB_DEVICES, pathname, attr);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+	return 0;
+}
+
+static long sysfs_read_number(const char *pathname, const char *attr, int base)
+{
+	char buf[16];
+
+	if (sysfs_read_attr(pathname, attr, buf, sizeof(buf)) < 0)
+		return -1;
+	return strtol(buf, NULL, base);
+}
+
+static int direct_attach_supported(void)
+{
+	return targetpathname && strchr(targetpathname, '-') && access(SYSFS_USB_DEVICES, R_OK) == 0;
+}
+
+static void find_device_by_path(libusb_context *ctx)
+{
+	struct libusb_device_descriptor desc;
+	libusb_device_handle *handle = NULL;
+	struct boot_session *s;
+	long busnum, devnum;
+	char node[MAX_PATH_LEN];
+	uint64_t deadline;
+	unsigned delay_us = BACKOFF_MIN_US;
+	int fd;
+
+	busnum = sysfs_read_number(targetpathname, "busnum", 10);
+	devnum = sysfs_read_number(targetpathname, "devnum", 10);
+
+	for (s = sessions; s; s = s->next)
+		s->present = (s->bus == busnum && s->address == devnum);
+	if (busnum < 0 || devnum < 0 || session_find(busnum, devnum))
+		return;
+
+	if (sysfs_read_number(targetpathname, "idVendor", 16) != 0x0a5c ||
+		!is_bcm_product(sysfs_read_number(targetpathname, "idProduct", 16)))
+		return;
+
+	if (sessions_active() >= max_sessions)
+		return;
+
+	if (selection_mode == SELECTION_MODE_SERIAL)
+	{
+		char serial[33];
+
+		if (sysfs_read_attr(targetpathname, "serial", serial, sizeof(serial)) < 0 ||
+			strncmp(target_serialno, serial, 32) != 0)
+			return;
+	}
+
+	// The node may not have been created yet so retry until the deadline
+	snprintf(node, sizeof(node), "/dev/bus/usb/%03ld/%03ld", busnum, devnum);
+	deadline = time_now_us() + OPEN_DEADLINE_MS * 1000;
+	while ((fd = open(node, O_RDWR)) < 0 && errno == ENOENT && backoff(deadline, &delay_us))
+		;
+	if (fd < 0)
+	{
+		if (errno == EACCES)
+		{
+			printf("Permission to access USB device denied. Make sure you are a member of the plugdev group.\n");
+			exit(-1);
+		}
+		if(verbose) printf("Failed to open %s: %s\n", node, strerror(errno));
+		return;
+	}
+	if (libusb_wrap_sys_device(ctx, (intptr_t) fd, &handle) != 0 ||
+		libusb_get_device_descriptor(libusb_get_device(handle), &desc) < 0)
+	{
+		if (handle)
+			libusb_close(handle);
+		close(fd);
+		return;
+	}
+
+	if(verbose)
+		printf("Device located successfully at %s\n", node);
+
+	s = session_create(libusb_get_device(handle), &desc, targetpathname);
+	if (!s)
+	{
+		libusb_close(handle);
+		close(fd);
+		return;
+	}
+	s->bus = busnum;
+	s->address = devnum;
+	s->usb_device = handle;
+	s->sys_fd = fd;
+	session_start(s);
+}
+#endif
+
+static void find_devices(libusb_context *ctx)
+{
+	struct libusb_device **devs;
+	struct libusb_device *dev;
+	struct boot_session *s;
+	uint32_t i = 0;
+	uint8_t portNo;
+
+	if (libusb_get_device_list(ctx, &devs) < 0)
+		return;
+
+	for (s = sessions; s; s = s->next)
+		s->present = 0;
+
+	while ((dev = devs[i++]) != NULL) {
+		struct libusb_device_descriptor desc;
+		libusb_device_handle *handle = NULL;
+		char pathname[USB_PATH_LEN] = {0};
+
+		if (libusb_get_device_descriptor(dev, &desc) < 0)
+			break;
+
+		if (selection_mode == SELECTION_MODE_SERIAL)
+			serial_cache_mark(libusb_get_bus_number(dev), libusb_get_device_address(dev));
+
+		s = session_find(libusb_get_bus_number(dev), libusb_get_device_address(dev));
+		if (s)
+		{
+			s->present = 1;
+			continue;
+		}
+
+		if(overlay || verbose == 2 || targetpathname!=NULL || selection_mode == SELECTION_MODE_SERIAL)
+			get_usb_pathname(dev, pathname);
+
+		/*
+		  http://libusb.sourceforge.net/api-1.0/group__dev.html#ga14879a0ea7daccdcddb68852d86c00c4
+
+		  The port number returned by this call is usually guaranteed to be uniquely tied to a physical port,
+		  meaning that different devices plugged on the same physical port should return the same port number.
+		*/
+		portNo = libusb_get_port_number(dev);
+
+		if(verbose == 2)
+		{
+			printf("Found device %u idVendor=0x%04x idProduct=0x%04x\n", i, desc.idVendor, desc.idProduct);
+			printf("Bus: %d, Device: %d Path: %s\n",libusb_get_bus_number(dev), libusb_get_device_address(dev), pathname);
+		}
+
+		if (desc.idVendor != 0x0a5c || !is_bcm_product(desc.idProduct))
+			continue;
+
+		if(verbose == 2)
+			printf("Found candidate Compute Module...\n");
+
+		// Check if we should match against a specific port number or path
+		if (!((targetPortNo == 99 || portNo == targetPortNo) &&
+			(targetpathname == NULL || strcmp(targetpathname, pathname) == 0)))
+		{
+			if(verbose == 2)
+				printf("Device port / path does not match, trying again\n");
+			continue;
+		}
+
+		if (sessions_active() >= max_sessions)
+			continue;
+
+		// Only Raspberry Pi devices are opened to read the serial number
+		if (selection_mode == SELECTION_MODE_SERIAL &&
+			!serial_matches(dev, &desc, pathname, target_serialno, &handle))
+			continue;
+
+		if(verbose)
+			printf("Device located successfully\n");
+
+		s = session_create(dev, &desc, pathname);
+		if (!s)
+		{
+			if (handle)
+				libusb_close(handle);
+			continue;
+		}
+		s->usb_device = handle;
+		if (s->pathname[0] == 0)
+			get_usb_pathname(dev, s->pathname);
+		session_start(s);
+	}
+
+	if (selection_mode == SELECTION_MODE_SERIAL)
+		serial_cache_sweep();
+	libusb_free_device_list(devs, 1);
+}
+
+// Joins finished session threads and forgets devices which have left the bus.
+// Returns the number of sessions joined and updates the count of second
+// stage (file server) sessions that have completed.
+static int reap_sessions(int *completed)
+{
+	struct boot_session **ps = &sessions;
+	struct boot_session *s;
+	int joined = 0;
+
+	while ((s = *ps) != NULL)
+	{
+		int state;
+
+		pthread_mutex_lock(&sessions_lock);
+		state = s->state;
+		pthread_mutex_unlock(&sessions_lock);
+
+		if (state == SESSION_STATE_FINISHED)
+		{
+			pthread_join(s->thread, NULL);
+			s->state = SESSION_STATE_IDLE;
+			if (s->stage == SESSION_STAGE_FILE_SERVER)
+				(*completed)++;
+			joined++;
+		}
+
+		// Forget devices which have gone away. Sessions which failed to open
+		// the device are also dropped so that it is retried on the next scan.
+		if (s->state == SESSION_STATE_IDLE && (!s->present || !s->opened))
+		{
+			*ps = s->next;
+			session_free(s);
+			continue;
+		}
+		ps = &s->next;
+	}
+	return joined;
+}
+
+struct simulation {
+	int index;
+	pthread_t thread;
+	uint64_t boot_us;
+	uint64_t bytes;
+	int result;
+};
+
+// Boots one simulated device through both stages. As with a real device
+// each stage is a separate session.
+static void *simulate_thread(void *arg)
+{
+	struct simulation *sim = arg;
+	struct boot_session *stage[2];
+	struct sim_device *d = sim_device_create(simulate_files);
+	char pathname[USB_PATH_LEN];
+	uint64_t start = time_now_us();
+	int i;
+
+	sim->result = -1;
+	snprintf(pathname, sizeof(pathname), "sim-%d", sim->index);
+	for (i = 0; i < 2; i++)
+	{
+		struct boot_session *s = stage[i] = session_alloc(pathname);
+
+		if (!s || !d)
+			break;
+		s->bcm2711 = (simulate_chip == 2711);
+		s->bcm2712 = (simulate_chip == 2712);
+		s->stage = i ? SESSION_STAGE_FILE_SERVER : SESSION_STAGE_BOOTCODE;
+		s->boot_start_us = start;
+		s->opened = 1;
+		s->stats.opened_us = time_now_us();
+		snprintf((char *) s->serial_num, sizeof(s->serial_num), "%08x", sim->index);
+		sim_device_attach(d, i ? SIM_STAGE_FILES : SIM_STAGE_BOOTROM, &s->transport);
+		if (s->stage == SESSION_STAGE_BOOTCODE)
+			load_second_stage(s);
+
+		sim->result = session_run(s);
+		if (sim->result != 0 || !sim_device_finished(d))
+		{
+			sim->result = -1;
+			break;
+		}
+	}
+	sim->boot_us = time_now_us() - start;
+	sim->bytes = d ? sim_device_bytes(d) : 0;
+
+	for (i = 0; i < 2; i++)
+		if (stage[i])
+			session_free(stage[i]);
+	sim_device_free(d);
+	return NULL;
+}
+
+// Measures host throughput and latency by booting simulated devices in parallel
+static int run_simulation(void)
+{
+	struct simulation *sims = calloc(simulate_count, sizeof(*sims));
+	struct boot_session probe = {0};
+	uint64_t start, elapsed, bytes = 0, min_us = UINT64_MAX, max_us = 0, total_us = 0;
+	int i, failed = 0;
+
+	if (!sims)
+		return -1;
+
+	probe.bcm2711 = (simulate_chip == 2711);
+	probe.bcm2712 = (simulate_chip == 2712);
+	select_default_directory(&probe);
+
+	start = time_now_us();
+	for (i = 0; i < simulate_count; i++)
+	{
+		sims[i].index = i;
+		if (pthread_create(&sims[i].thread, NULL, simulate_thread, &sims[i]) != 0)
+		{
+			fprintf(stderr, "Failed to start simulation thread\n");
+			exit(-1);
+		}
+	}
+	for (i = 0; i < simulate_count; i++)
+	{
+		pthread_join(sims[i].thread, NULL);
+		if (sims[i].result)
+			failed++;
+		bytes += sims[i].bytes;
+		total_us += sims[i].boot_us;
+		if (sims[i].boot_us < min_us)
+			min_us = sims[i].boot_us;
+		if (sims[i].boot_us > max_us)
+			max_us = sims[i].boot_us;
+	}
+	elapsed = time_now_us() - start;
+
+	printf("Simulated %d devices (%d failed): %llu bytes in %.3f seconds, %.2f MB/s\n",
+		simulate_count, failed, (unsigned long long) bytes, elapsed / 1e6,
+		elapsed ? (double) bytes / elapsed : 0);
+	printf("Simulated boot time min %.3f avg %.3f max %.3f seconds\n",
+		min_us / 1e6, total_us / 1e6 / simulate_count, max_us / 1e6);
+
+	free(sims);
+	return failed ? -1 : 0;
+}
+
+// Runs the host side of each session in a trace against the recorded
+// device requests, one session at a time.
+static int run_replay(void)
+{
+	struct trace *tr = trace_load(replay_path);
+	struct trace_replay_stats total = {0};
+	uint64_t start, elapsed;
+	int i, failed = 0;
+
+	if (!tr)
+	{
+		fprintf(stderr, "Unable to load trace '%s'\n", replay_path);
+		return -1;
+	}
+
+	start = time_now_us();
+	for (i = 0; i < trace_num_sessions(tr); i++)
+	{
+		struct trace_replay_stats stats;
+		char pathname[USB_PATH_LEN];
+		struct boot_session *s;
+		int chip = trace_session_chip(tr, i);
+
+		// usbmon captures don't identify the chip
+		if (chip == 0)
+			chip = simulate_chip;
+		snprintf(pathname, sizeof(pathname), "replay-%d", i);
+		s = session_alloc(pathname);
+		if (!s)
+			break;
+		s->bcm2711 = (chip == 2711);
+		s->bcm2712 = (chip == 2712);
+		s->stage = strcmp(trace_session_stage(tr, i), "bootcode") == 0 ?
+			SESSION_STAGE_BOOTCODE : SESSION_STAGE_FILE_SERVER;
+		s->boot_start_us = time_now_us();
+		s->opened = 1;
+		s->stats.opened_us = s->boot_start_us;
+		select_default_directory(s);
+		trace_replay_attach(tr, i, replay_paced, &s->transport);
+		if (s->stage == SESSION_STAGE_BOOTCODE)
+			load_second_stage(s);
+
+		if (session_run(s) != 0)
+			failed++;
+		trace_replay_finish(&s->transport, &stats);
+		if (stats.mismatches)
+			printf("Session %d differs from the trace in %lu requests\n", i, stats.mismatches);
+		total.bytes += stats.bytes;
+		total.mismatches += stats.mismatches;
+		session_free(s);
+	}
+	elapsed = time_now_us() - start;
+
+	printf("Replayed %d sessions (%d failed, %lu mismatched requests): %llu bytes in %.3f seconds, %.2f MB/s\n",
+		trace_num_sessions(tr), failed, total.mismatches, (unsigned long long) total.bytes,
+		elapsed / 1e6, elapsed ? (double) total.bytes / elapsed : 0);
+
+	trace_free(tr);
+	return failed ? -1 : 0;
+}
+
+// Makes 'dir' the boot directory after checking that it contains bootcode
+// files. A NULL directory selects the default for each chip.
+static int set_boot_directory(char *dir)
+{
+	struct boot_session probe = {0};
+	struct blob *f, *f4, *f5;
+
+	directory = dir;
+	use_bootfiles = 0;
+	bootfiles_path[0] = 0;
+	if (!directory)
+		return 0;
+
+	if (verbose)
+		printf("Boot directory '%s'\n", directory);
+	dirindex_add(directory);
+
+	f = check_file(&probe, directory, "bootfiles.bin", 0);
+	if (f)
+	{
+		snprintf(bootfiles_path, sizeof(bootfiles_path),"%s/%s", directory, "bootfiles.bin");
+		printf("Using %s\n", bootfiles_path);
+		bootfiles_path[sizeof(bootfiles_path) - 1] = 0;
+		use_bootfiles = 1;
+		blob_close(f);
+		f = NULL;
+	}
+	else
+	{
+		f = check_file(&probe, directory, "bootcode.bin", 0);
+		f4 = check_file(&probe, directory, "bootcode4.bin", 0);
+		f5 = check_file(&probe, directory, "bootcode5.bin", 0);
+		if (!f && !f4 && !f5)
+		{
+			fprintf(stderr, "No 'bootcode' files found in '%s'\n", directory);
+			return -1;
 		}
+		blob_close(f);
+		blob_close(f4);
+		blob_close(f5);
+	}
 
-		if (verbose) printf("last_serial %d serial %d\n", last_serial, desc.iSerialNumber);
-		last_serial = desc.iSerialNumber;
-		if(desc.iSerialNumber == 0 || desc.iSerialNumber == 3)
+	if (signed_boot)
+	{
+		f = check_file(&probe, directory, "bootsig.bin", 0);
+		if (!f)
 		{
-			printf("Sending bootcode.bin\n");
-			second_stage_boot(usb_device);
+			fprintf(stderr, "Unable to open 'bootsig.bin' from %s\n", directory);
+			return -1;
+		}
+		blob_close(f);
+	}
+	return 0;
+}
+
+// In daemon mode devices are only looked for while a job is running. The
+// selectors of the job replace the command line ones and it finishes once
+// it has booted the requested number of devices and all of its sessions
+// have ended. Jobs only change while no session is active.
+static struct job *current_job;
+static int current_job_stopping;
+
+// The selectors of the current job are copied since the job belongs to the
+// daemon thread, which frees it once it has finished.
+static char *job_directory;
+static char *job_pathname;
+static char *job_serial;
+static char *job_metadata;
+
+static int job_copy(char **copy, const char *value)
+{
+	free(*copy);
+	*copy = value ? strdup(value) : NULL;
+	return value && !*copy ? -1 : 0;
+}
+
+// Copies the selectors of 'job'. Returns -1 if out of memory.
+static int job_copy_selectors(const struct job *job)
+{
+	int ret = 0;
+
+	ret |= job_copy(&job_directory, job->directory);
+	ret |= job_copy(&job_pathname, job->pathname);
+	ret |= job_copy(&job_serial, job->serial);
+	ret |= job_copy(&job_metadata, job->metadata);
+	return ret;
+}
+
+static void daemon_wake(void)
+{
+	request_rescan();
+}
+
+static void daemon_print_sessions(FILE *out)
+{
+	struct boot_session *s;
+
+	pthread_mutex_lock(&sessions_lock);
+	for (s = sessions; s; s = s->next)
+	{
+		if (s->state == SESSION_STATE_IDLE)
+			continue;
+		fprintf(out, "device %s %s", s->pathname,
+			s->stage == SESSION_STAGE_BOOTCODE ? "bootcode" : "file_server");
+		if (s->serial_num[0])
+			fprintf(out, " serial=%s", (const char *) s->serial_num);
+		if (current_job)
+			fprintf(out, " job=%d", current_job->id);
+		fprintf(out, "\n");
+	}
+	pthread_mutex_unlock(&sessions_lock);
+}
+
+// Returns 1 if there is a job to look for devices for
+static int daemon_update(int completed)
+{
+	if (current_job && !current_job_stopping)
+		current_job_stopping = daemon_job_progress(current_job, completed);
+	if (current_job && current_job_stopping && sessions_active() == 0)
+	{
+		daemon_job_finish(current_job, JOB_DONE);
+		current_job = NULL;
+	}
+
+	while (!current_job && (current_job = daemon_next_job()) != NULL)
+	{
+		printf("Starting job %d\n", current_job->id);
+		current_job_stopping = 0;
+		if (job_copy_selectors(current_job) < 0 || set_boot_directory(job_directory) < 0)
+		{
+			set_boot_directory(NULL);
+			daemon_job_finish(current_job, JOB_FAILED);
+			current_job = NULL;
+			continue;
+		}
+		targetpathname = job_pathname;
+		targetPortNo = current_job->port;
+		target_serialno = job_serial;
+		selection_mode = job_serial ? SELECTION_MODE_SERIAL : SELECTION_MODE_VID;
+		metadata_path = job_metadata;
+#ifdef __linux__
+		direct_attach = direct_attach_supported();
+#endif
+		printf("Waiting for BCM2835/6/7/2711/2712...\n\n");
+	}
+
+	// A cancelled job stops taking new devices
+	if (current_job && !current_job_stopping)
+		current_job_stopping = daemon_job_progress(current_job, 0);
+	return current_job && !current_job_stopping;
+}
+
+int main(int argc, char *argv[])
+{
+	libusb_context *ctx;
+	int completed = 0;
+	int ret;
+
+	get_options(argc, argv);
+	print_version();
+	printf("\nPlease fit the EMMC_DISABLE / nRPIBOOT jumper before connecting the power and USB cables to the target device.\n");
+	printf("If the device fails to connect then please see https://rpltd.co/rpiboot for debugging tips.\n\n");
+
+	// flush immediately
+	setbuf(stdout, NULL);
+
+	cache_init((size_t) cache_size * 1024 * 1024);
+
+	// If the boot directory is specified then check that it contains bootcode files.
+	if (directory && set_boot_directory(directory) < 0)
+		usage(1);
+
+	if (simulate_count || replay_path)
+	{
+		ret = simulate_count ? run_simulation() : run_replay();
+		metrics_close();
+		inventory_close();
+		tune_close();
+		return ret ? 1 : 0;
+	}
+
+	ret = libusb_init(&ctx);
+	if (ret)
+	{
+		printf("Failed to initialise libUSB\n");
+		exit(-1);
+	}
+
+#if LIBUSBX_API_VERSION < 0x01000106
+	libusb_set_debug(ctx, (verbose == 2)? LIBUSB_LOG_LEVEL_WARNING : 0);
+#else
+	libusb_set_option(
+		ctx,
+		LIBUSB_OPTION_LOG_LEVEL,
+		verbose ? verbose == 2 ? LIBUSB_LOG_LEVEL_INFO : LIBUSB_LOG_LEVEL_WARNING : 0
+		);
+#endif
+
+	usb_ctx = ctx;
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+	{
+		libusb_hotplug_callback_handle hotplug_handle;
+
+		ret = libusb_hotplug_register_callback(ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			LIBUSB_HOTPLUG_NO_FLAGS, 0x0a5c, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &hotplug_handle);
+		hotplug = (ret == LIBUSB_SUCCESS);
+	}
+#ifdef __linux__
+	direct_attach = direct_attach_supported();
+#endif
+	if (verbose)
+		printf("Device discovery: %s%s\n", hotplug ? "hotplug events" : "polling",
+			direct_attach ? ", direct attach by path" : "");
+
+	if (daemon_path)
+	{
+		if (daemon_open(daemon_path, daemon_print_sessions, daemon_wake) < 0)
+			exit(-1);
+	}
+	else
+	{
+		printf("Waiting for BCM2835/6/7/2711/2712...\n\n");
+	}
+
+	// Each device is booted by its own session thread. Without -l rpiboot
+	// exits once a device has been through the second stage file server.
+	do
+	{
+		int scan = 1;
+
+		ret = reap_sessions(&completed);
+		if (daemon_path)
+		{
+			scan = daemon_update(completed);
+			completed = 0;
+		}
+		else if (ret && sessions_active() == 0)
+		{
+			if (!loop && completed)
+				break;
+			printf("Waiting for BCM2835/6/7/2711/2712...\n\n");
+		}
+
+		// Rescan after a session finishes to retry devices which failed to
+		// open or were skipped because all of the sessions were in use.
+		if ((!hotplug || take_rescan() || ret) && scan)
+		{
+#ifdef __linux__
+			if (direct_attach)
+				find_device_by_path(ctx);
+			else
+#endif
+			find_devices(ctx);
+		}
+
+		if (hotplug)
+		{
+			struct timeval tv = {HOTPLUG_EVENT_TIMEOUT_MS / 1000, (HOTPLUG_EVENT_TIMEOUT_MS % 1000) * 1000};
+
+			libusb_handle_events_timeout_completed(ctx, &tv, NULL);
 		}
 		else
 		{
-			printf("Second stage boot server\n");
-			file_server(usb_device);
+			usleep(delay);
 		}
+		inventory_flush(0);
+		metrics_flush(0);
+	}
+	while(1);
 
-		libusb_close(usb_device);
-		sleep(1);
+	if (verbose)
+	{
+		struct cache_stats stats;
 
+		cache_get_stats(&stats);
+		printf("File cache: %lu hits %lu misses %lu evictions %d files %lu bytes\n",
+			stats.hits, stats.misses, stats.evictions, stats.entries, (unsigned long) stats.bytes);
 	}
-	while(loop || desc.iSerialNumber == 0 || desc.iSerialNumber == 3);
 
+	daemon_close();
+	metrics_close();
+	inventory_close();
+	tune_close();
 	libusb_exit(ctx);
 
 	return 0;
 }
-
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "manifest.h"
+
+// Boot manifests are stored as text files in the manifest directory, named
+// after a hash of the key. The first line holds the key itself so that
+// a hash collision is treated as a missing manifest, followed by one file
+// name per line in the order the device requested them.
+
+#define MANIFEST_LINE_LEN 512
+
+static void manifest_path(char *path, size_t len, const char *dir, const char *key)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*key)
+	{
+		hash ^= (uint8_t) *key++;
+		hash *= 16777619u;
+	}
+	snprintf(path, len, "%s/%08x.manifest", dir, hash);
+}
+
+// Appends 'name' unless it is already in the manifest
+int manifest_add(struct manifest *m, const char *name)
+{
+	int i;
+
+	for (i = 0; i < m->num_names; i++)
+		if (strcmp(m->names[i], name) == 0)
+			return 0;
+
+	if (m->num_names == m->max_names)
+	{
+		int max_names = m->max_names ? m->max_names * 2 : 16;
+		char **names = realloc(m->names, max_names * sizeof(*names));
+
+		if (!names)
+			return -1;
+		m->names = names;
+		m->max_names = max_names;
+	}
+	m->names[m->num_names] = strdup(name);
+	if (!m->names[m->num_names])
+		return -1;
+	m->num_names++;
+	return 0;
+}
+
+struct manifest *manifest_load(const char *dir, const char *key)
+{
+	char path[MANIFEST_LINE_LEN];
+	char line[MANIFEST_LINE_LEN];
+	struct manifest *m;
+	FILE *fp;
+
+	manifest_path(path, sizeof(path), dir, key);
+	fp = fopen(path, "r");
+	if (!fp)
+		return NULL;
+
+	m = calloc(1, sizeof(*m));
+	if (!m || !fgets(line, sizeof(line), fp) ||
+		strncmp(line, "key ", 4) != 0 || strcspn(line + 4, "\n") != strlen(key) ||
+		strncmp(line + 4, key, strlen(key)) != 0)
+		goto fail;
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		line[strcspn(line, "\n")] = 0;
+		if (line[0] && manifest_add(m, line) < 0)
+			goto fail;
+	}
+	fclose(fp);
+	return m;
+
+fail:
+	fclose(fp);
+	manifest_free(m);
+	return NULL;
+}
+
+int manifest_equal(const struct manifest *a, const struct manifest *b)
+{
+	int i;
+
+	if (!a || !b || a->num_names != b->num_names)
+		return 0;
+	for (i = 0; i < a->num_names; i++)
+		if (strcmp(a->names[i], b->names[i]) != 0)
+			return 0;
+	return 1;
+}
+
+// Writes the manifest to a temporary file and renames it so that sessions
+// loading the manifest concurrently never see a partial file.
+int manifest_save(const char *dir, const char *key, const struct manifest *m)
+{
+	char path[MANIFEST_LINE_LEN];
+	char tmp[MANIFEST_LINE_LEN + 8];
+	FILE *fp;
+	int fd, i;
+
+	manifest_path(path, sizeof(path), dir, key);
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return -1;
+	fp = fdopen(fd, "w");
+	if (!fp)
+	{
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+
+	fprintf(fp, "key %s\n", key);
+	for (i = 0; i < m->num_names; i++)
+		fprintf(fp, "%s\n", m->names[i]);
+	if (fclose(fp) != 0 || rename(tmp, path) != 0)
+	{
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+void manifest_free(struct manifest *m)
+{
+	int i;
+
+	if (!m)
+		return;
+	for (i = 0; i < m->num_names; i++)
+		free(m->names[i]);
+	free(m->names);
+	free(m);
+}
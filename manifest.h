@@ -0,0 +1,17 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+// The ordered list of files requested by the second stage for a given
+// chip, boot directory and overlay.
+struct manifest {
+	char **names;
+	int num_names;
+	int max_names;
+};
+
+struct manifest *manifest_load(const char *dir, const char *key);
+int manifest_add(struct manifest *m, const char *name);
+int manifest_equal(const struct manifest *a, const struct manifest *b);
+int manifest_save(const char *dir, const char *key, const struct manifest *m);
+void manifest_free(struct manifest *m);
+#endif
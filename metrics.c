@@ -0,0 +1,403 @@
+#include <libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "cache.h"
+#include "metrics.h"
+
+// Live counters and histograms in the Prometheus text exposition format.
+// They are either written to a file, which is replaced atomically so that
+// the node_exporter textfile collector never sees a partial file, or served
+// to each client which connects to a Unix domain socket. A client which
+// sends an HTTP GET request gets an HTTP response so that e.g.
+// curl --unix-socket works as well as a plain socat.
+
+#define METRICS_CHIPS		3	// 2710, 2711, 2712
+#define METRICS_STAGES		2	// bootcode, file_server
+#define METRICS_USB_ERRORS	14	// -1 to -12 plus other
+#define METRICS_FLUSH_US	1000000
+
+struct histogram {
+	const double *bounds;
+	int num_bounds;
+	uint64_t counts[16];
+	uint64_t count;
+	double sum;
+};
+
+static const double stage_buckets[] = { 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120 };
+static const double file_buckets[] = { 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 30 };
+static const char *chip_names[METRICS_CHIPS] = { "2710", "2711", "2712" };
+static const char *stage_names[METRICS_STAGES] = { "bootcode", "file_server" };
+
+static struct {
+	uint64_t discovered[METRICS_CHIPS][METRICS_STAGES];
+	uint64_t sessions[METRICS_CHIPS][METRICS_STAGES][2];	// ok, error
+	uint64_t booted[METRICS_CHIPS];
+	uint64_t bytes[METRICS_STAGES];
+	struct histogram stage_seconds[METRICS_STAGES];
+	struct histogram file_seconds;
+	uint64_t ep_write_bytes;
+	double ep_write_seconds;
+	uint64_t usb_errors[2][METRICS_USB_ERRORS];	// ep_read, ep_write
+} metrics;
+
+static char *metrics_file;
+static char *metrics_socket;
+static int metrics_fd = -1;
+static time_t start_time;
+static uint64_t last_flush_us;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t metrics_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void metrics_init(void)
+{
+	int i;
+
+	start_time = time(NULL);
+	for (i = 0; i < METRICS_STAGES; i++)
+	{
+		metrics.stage_seconds[i].bounds = stage_buckets;
+		metrics.stage_seconds[i].num_bounds = sizeof(stage_buckets) / sizeof(stage_buckets[0]);
+	}
+	metrics.file_seconds.bounds = file_buckets;
+	metrics.file_seconds.num_bounds = sizeof(file_buckets) / sizeof(file_buckets[0]);
+}
+
+static int chip_index(int chip)
+{
+	return chip == 2712 ? 2 : chip == 2711 ? 1 : 0;
+}
+
+static void histogram_observe(struct histogram *h, double value)
+{
+	int i;
+
+	for (i = 0; i < h->num_bounds && value > h->bounds[i]; i++)
+		;
+	h->counts[i]++;
+	h->count++;
+	h->sum += value;
+}
+
+static void histogram_write(FILE *fp, const char *name, const char *labels, const struct histogram *h)
+{
+	uint64_t cumulative = 0;
+	int i;
+
+	for (i = 0; i < h->num_bounds; i++)
+	{
+		cumulative += h->counts[i];
+		fprintf(fp, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, *labels ? "," : "",
+			h->bounds[i], (unsigned long long) cumulative);
+	}
+	fprintf(fp, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, *labels ? "," : "",
+		(unsigned long long) h->count);
+	fprintf(fp, "%s_sum%s%s%s %.6f\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", h->sum);
+	fprintf(fp, "%s_count%s%s%s %llu\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+		(unsigned long long) h->count);
+}
+
+static void metrics_write(FILE *fp)
+{
+	struct cache_stats cs;
+	char labels[64];
+	int c, s, i;
+
+	cache_get_stats(&cs);
+
+	pthread_mutex_lock(&metrics_lock);
+	fprintf(fp, "# HELP rpiboot_start_time_seconds Start time of rpiboot since the Unix epoch.\n");
+	fprintf(fp, "# TYPE rpiboot_start_time_seconds gauge\n");
+	fprintf(fp, "rpiboot_start_time_seconds %lld\n", (long long) start_time);
+
+	fprintf(fp, "# HELP rpiboot_devices_discovered_total Device sessions started, by chip and boot stage.\n");
+	fprintf(fp, "# TYPE rpiboot_devices_discovered_total counter\n");
+	for (c = 0; c < METRICS_CHIPS; c++)
+		for (s = 0; s < METRICS_STAGES; s++)
+			fprintf(fp, "rpiboot_devices_discovered_total{chip=\"%s\",stage=\"%s\"} %llu\n",
+				chip_names[c], stage_names[s], (unsigned long long) metrics.discovered[c][s]);
+
+	fprintf(fp, "# HELP rpiboot_devices_booted_total Devices which completed the second stage file server.\n");
+	fprintf(fp, "# TYPE rpiboot_devices_booted_total counter\n");
+	for (c = 0; c < METRICS_CHIPS; c++)
+		fprintf(fp, "rpiboot_devices_booted_total{chip=\"%s\"} %llu\n",
+			chip_names[c], (unsigned long long) metrics.booted[c]);
+
+	fprintf(fp, "# HELP rpiboot_sessions_total Device sessions finished, by chip, boot stage and result.\n");
+	fprintf(fp, "# TYPE rpiboot_sessions_total counter\n");
+	for (c = 0; c < METRICS_CHIPS; c++)
+		for (s = 0; s < METRICS_STAGES; s++)
+			for (i = 0; i < 2; i++)
+				fprintf(fp, "rpiboot_sessions_total{chip=\"%s\",stage=\"%s\",result=\"%s\"} %llu\n",
+					chip_names[c], stage_names[s], i ? "error" : "ok",
+					(unsigned long long) metrics.sessions[c][s][i]);
+
+	fprintf(fp, "# HELP rpiboot_stage_duration_seconds Time from device discovery to the end of each boot stage.\n");
+	fprintf(fp, "# TYPE rpiboot_stage_duration_seconds histogram\n");
+	for (s = 0; s < METRICS_STAGES; s++)
+	{
+		snprintf(labels, sizeof(labels), "stage=\"%s\"", stage_names[s]);
+		histogram_write(fp, "rpiboot_stage_duration_seconds", labels, &metrics.stage_seconds[s]);
+	}
+
+	fprintf(fp, "# HELP rpiboot_bytes_served_total Bytes of bootcode and files sent to devices.\n");
+	fprintf(fp, "# TYPE rpiboot_bytes_served_total counter\n");
+	for (s = 0; s < METRICS_STAGES; s++)
+		fprintf(fp, "rpiboot_bytes_served_total{stage=\"%s\"} %llu\n",
+			stage_names[s], (unsigned long long) metrics.bytes[s]);
+
+	fprintf(fp, "# HELP rpiboot_file_transfer_seconds Time to send each file requested by the second stage.\n");
+	fprintf(fp, "# TYPE rpiboot_file_transfer_seconds histogram\n");
+	histogram_write(fp, "rpiboot_file_transfer_seconds", "", &metrics.file_seconds);
+
+	fprintf(fp, "# HELP rpiboot_ep_write_bytes_total Bytes sent by bulk transfers.\n");
+	fprintf(fp, "# TYPE rpiboot_ep_write_bytes_total counter\n");
+	fprintf(fp, "rpiboot_ep_write_bytes_total %llu\n", (unsigned long long) metrics.ep_write_bytes);
+	fprintf(fp, "# HELP rpiboot_ep_write_seconds_total Time spent in bulk transfers.\n");
+	fprintf(fp, "# TYPE rpiboot_ep_write_seconds_total counter\n");
+	fprintf(fp, "rpiboot_ep_write_seconds_total %.6f\n", metrics.ep_write_seconds);
+
+	fprintf(fp, "# HELP rpiboot_usb_errors_total libusb errors returned by ep_read and ep_write.\n");
+	fprintf(fp, "# TYPE rpiboot_usb_errors_total counter\n");
+	for (i = 0; i < 2; i++)
+		for (c = 0; c < METRICS_USB_ERRORS; c++)
+			if (metrics.usb_errors[i][c])
+				fprintf(fp, "rpiboot_usb_errors_total{op=\"%s\",code=\"%s\"} %llu\n",
+					i ? "ep_write" : "ep_read",
+					c < METRICS_USB_ERRORS - 1 ? libusb_error_name(-c) : "OTHER",
+					(unsigned long long) metrics.usb_errors[i][c]);
+	pthread_mutex_unlock(&metrics_lock);
+
+	fprintf(fp, "# HELP rpiboot_cache_hits_total File cache lookups which found the file.\n");
+	fprintf(fp, "# TYPE rpiboot_cache_hits_total counter\n");
+	fprintf(fp, "rpiboot_cache_hits_total %lu\n", cs.hits);
+	fprintf(fp, "# HELP rpiboot_cache_misses_total File cache lookups which loaded the file.\n");
+	fprintf(fp, "# TYPE rpiboot_cache_misses_total counter\n");
+	fprintf(fp, "rpiboot_cache_misses_total %lu\n", cs.misses);
+	fprintf(fp, "# HELP rpiboot_cache_evictions_total Files evicted from the file cache.\n");
+	fprintf(fp, "# TYPE rpiboot_cache_evictions_total counter\n");
+	fprintf(fp, "rpiboot_cache_evictions_total %lu\n", cs.evictions);
+	fprintf(fp, "# HELP rpiboot_cache_bytes Size of the files in the file cache.\n");
+	fprintf(fp, "# TYPE rpiboot_cache_bytes gauge\n");
+	fprintf(fp, "rpiboot_cache_bytes %lu\n", (unsigned long) cs.bytes);
+	fprintf(fp, "# HELP rpiboot_cache_files Number of files in the file cache.\n");
+	fprintf(fp, "# TYPE rpiboot_cache_files gauge\n");
+	fprintf(fp, "rpiboot_cache_files %d\n", cs.entries);
+}
+
+int metrics_open_file(const char *path)
+{
+	metrics_file = strdup(path);
+	if (!metrics_file)
+		return -1;
+	metrics_init();
+	return 0;
+}
+
+static void metrics_serve(int fd)
+{
+	struct timeval tv = { 0, 200000 };
+	char request[256];
+	ssize_t n;
+	FILE *fp;
+
+	// Only HTTP clients send a request; anything else just gets the metrics.
+	// A client which stops reading is dropped after the same timeout.
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	n = read(fd, request, sizeof(request));
+
+	fp = fdopen(fd, "w");
+	if (!fp)
+	{
+		close(fd);
+		return;
+	}
+	if (n >= 4 && strncmp(request, "GET ", 4) == 0)
+		fprintf(fp, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+	metrics_write(fp);
+	fclose(fp);
+}
+
+static void *metrics_thread(void *arg)
+{
+	(void) arg;
+	for (;;)
+	{
+		int fd = accept(metrics_fd, NULL, NULL);
+
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		metrics_serve(fd);
+	}
+	return NULL;
+}
+
+int metrics_open_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	pthread_attr_t attr;
+	pthread_t thread;
+	mode_t mask;
+	int ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	metrics_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (metrics_fd < 0)
+		return -1;
+	unlink(path);
+
+	// A scraper which hangs up mid-response mustn't kill rpiboot
+	signal(SIGPIPE, SIG_IGN);
+
+	// Only the user running rpiboot may read the metrics
+	mask = umask(077);
+	ret = bind(metrics_fd, (struct sockaddr *) &addr, sizeof(addr));
+	umask(mask);
+	if (ret < 0 || listen(metrics_fd, 8) < 0)
+	{
+		close(metrics_fd);
+		metrics_fd = -1;
+		return -1;
+	}
+	metrics_socket = strdup(path);
+	metrics_init();
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, metrics_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (ret != 0)
+	{
+		metrics_close();
+		return -1;
+	}
+	return 0;
+}
+
+int metrics_enabled(void)
+{
+	return metrics_file || metrics_fd >= 0;
+}
+
+void metrics_session_start(int chip, int file_server)
+{
+	if (!metrics_enabled())
+		return;
+	pthread_mutex_lock(&metrics_lock);
+	metrics.discovered[chip_index(chip)][file_server]++;
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+void metrics_session_end(int chip, int file_server, int result, uint64_t duration_us, uint64_t bytes)
+{
+	int c = chip_index(chip);
+
+	if (!metrics_enabled())
+		return;
+	pthread_mutex_lock(&metrics_lock);
+	metrics.sessions[c][file_server][result != 0]++;
+	if (file_server && result == 0)
+		metrics.booted[c]++;
+	// The file server counts the bytes of each file as it is sent
+	if (!file_server)
+		metrics.bytes[0] += bytes;
+	histogram_observe(&metrics.stage_seconds[file_server], duration_us / 1e6);
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+void metrics_file_served(size_t size, uint64_t duration_us)
+{
+	if (!metrics_enabled())
+		return;
+	pthread_mutex_lock(&metrics_lock);
+	metrics.bytes[1] += size;
+	histogram_observe(&metrics.file_seconds, duration_us / 1e6);
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+void metrics_ep_write(size_t bytes, uint64_t duration_us)
+{
+	if (!metrics_enabled())
+		return;
+	pthread_mutex_lock(&metrics_lock);
+	metrics.ep_write_bytes += bytes;
+	metrics.ep_write_seconds += duration_us / 1e6;
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+void metrics_usb_error(int ep_write, int code)
+{
+	int index = code < 0 && code > -(METRICS_USB_ERRORS - 1) ? -code : METRICS_USB_ERRORS - 1;
+
+	if (!metrics_enabled())
+		return;
+	pthread_mutex_lock(&metrics_lock);
+	metrics.usb_errors[ep_write != 0][index]++;
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+// Rewrites the textfile at most once a second unless 'force' is set
+void metrics_flush(int force)
+{
+	char tmp[4096];
+	uint64_t now;
+	FILE *fp;
+
+	if (!metrics_file)
+		return;
+	now = metrics_now_us();
+	if (!force && now - last_flush_us < METRICS_FLUSH_US)
+		return;
+	last_flush_us = now;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_file);
+	fp = fopen(tmp, "w");
+	if (!fp)
+		return;
+	metrics_write(fp);
+	if (fclose(fp) != 0 || rename(tmp, metrics_file) != 0)
+		unlink(tmp);
+}
+
+void metrics_close(void)
+{
+	metrics_flush(1);
+	free(metrics_file);
+	metrics_file = NULL;
+	if (metrics_fd >= 0)
+	{
+		close(metrics_fd);
+		metrics_fd = -1;
+		unlink(metrics_socket);
+	}
+	free(metrics_socket);
+	metrics_socket = NULL;
+}
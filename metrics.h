@@ -0,0 +1,16 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <stddef.h>
+#include <stdint.h>
+
+int metrics_open_file(const char *path);
+int metrics_open_socket(const char *path);
+int metrics_enabled(void);
+void metrics_session_start(int chip, int file_server);
+void metrics_session_end(int chip, int file_server, int result, uint64_t duration_us, uint64_t bytes);
+void metrics_file_served(size_t size, uint64_t duration_us);
+void metrics_ep_write(size_t bytes, uint64_t duration_us);
+void metrics_usb_error(int ep_write, int code);
+void metrics_flush(int force);
+void metrics_close(void);
+#endif
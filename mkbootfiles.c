@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bootfiles.h"
+#include "sha256.h"
+
+// Packs a directory, or converts an existing bootfiles.bin, into the v2
+// layout described in bootfiles.h. The output is still a valid tar archive
+// so older versions of rpiboot and tar itself can read it.
+
+#define BLOCK_SIZE	512
+#define COPY_BUF_SIZE	(1024 * 1024)
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char csum[8];
+	char type;
+	char link[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+} __attribute__((packed));
+
+struct member {
+	char name[100];
+	uint8_t header[BLOCK_SIZE];	// Original header when converting an archive
+	int have_header;
+	int dir;
+	const char *src;		// Source file, or NULL for archive data
+	uint64_t src_offset;
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t offset;		// Offset of the data in the output
+	uint8_t digest[SHA256_DIGEST_SIZE];
+};
+
+static struct member *members;
+static int num_members, max_members;
+static uint8_t copy_buf[COPY_BUF_SIZE];
+
+static void die(const char *fmt, const char *arg)
+{
+	fprintf(stderr, fmt, arg, strerror(errno));
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void put64(uint8_t *p, uint64_t v)
+{
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+static struct member *member_add(const char *name, int dir)
+{
+	struct member *m;
+	int i;
+
+	if (strlen(name) >= sizeof(m->name))
+	{
+		errno = ENAMETOOLONG;
+		die("Name too long for tar: %s (%s)", name);
+	}
+	// The first member with a name wins, as it does when reading a tar
+	for (i = 0; i < num_members; i++)
+		if (strcasecmp(members[i].name, name) == 0)
+		{
+			fprintf(stderr, "Skipping duplicate %s\n", name);
+			return NULL;
+		}
+	if (num_members == max_members)
+	{
+		max_members = max_members ? max_members * 2 : 64;
+		members = realloc(members, max_members * sizeof(*members));
+		if (!members)
+			die("%s: %s", "Out of memory");
+	}
+	m = &members[num_members++];
+	memset(m, 0, sizeof(*m));
+	snprintf(m->name, sizeof(m->name), "%s", name);
+	m->dir = dir;
+	return m;
+}
+
+static int name_compare(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Adds the files below 'dir' in name order
+static void scan_dir(const char *dir, const char *prefix)
+{
+	DIR *d = opendir(dir);
+	struct dirent *de;
+	char **names = NULL;
+	int num = 0, max = 0, i;
+
+	if (!d)
+		die("Failed to open %s: %s", dir);
+	while ((de = readdir(d)) != NULL)
+	{
+		if (de->d_name[0] == '.')
+			continue;
+		if (num == max)
+		{
+			max = max ? max * 2 : 32;
+			names = realloc(names, max * sizeof(*names));
+			if (!names)
+				die("%s: %s", "Out of memory");
+		}
+		names[num++] = strdup(de->d_name);
+	}
+	closedir(d);
+	qsort(names, num, sizeof(*names), name_compare);
+
+	for (i = 0; i < num; i++)
+	{
+		char path[4096], name[4096];
+		struct member *m;
+		struct stat st;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		if (stat(path, &st) < 0)
+			die("Failed to read %s: %s", path);
+		if (S_ISDIR(st.st_mode))
+		{
+			snprintf(name, sizeof(name), "%s%s/", prefix, names[i]);
+			m = member_add(name, 1);
+			if (m)
+				m->mtime = st.st_mtime;
+			scan_dir(path, name);
+		}
+		else if (S_ISREG(st.st_mode))
+		{
+			snprintf(name, sizeof(name), "%s%s", prefix, names[i]);
+			m = member_add(name, 0);
+			if (m)
+			{
+				m->src = strdup(path);
+				m->size = st.st_size;
+				m->mtime = st.st_mtime;
+			}
+		}
+		free(names[i]);
+	}
+	free(names);
+}
+
+// Adds the members of an existing archive, dropping any v2 padding and index.
+// rpiboot only reads the 100 character name field so archives with longer
+// names (GNU long name or pax records, or a ustar prefix) are rejected.
+static void scan_archive(const char *archive)
+{
+	FILE *fp = fopen(archive, "rb");
+	uint64_t offset = 0;
+
+	if (!fp)
+		die("Failed to open %s: %s", archive);
+	for (;;)
+	{
+		uint8_t block[BLOCK_SIZE];
+		const struct tar_header *hdr = (const struct tar_header *) block;
+		char name[sizeof(hdr->name) + 1], size_str[sizeof(hdr->size) + 1];
+		struct member *m;
+		uint64_t size;
+
+		if (fseeko(fp, offset, SEEK_SET) != 0 || fread(block, 1, sizeof(block), fp) != sizeof(block) ||
+			hdr->name[0] == 0)
+			break;
+		memcpy(name, hdr->name, sizeof(hdr->name));
+		name[sizeof(hdr->name)] = 0;
+		memcpy(size_str, hdr->size, sizeof(hdr->size));
+		size_str[sizeof(hdr->size)] = 0;
+		size = strtoull(size_str, NULL, 8);
+		offset += BLOCK_SIZE;
+
+		if (hdr->type == 'L' || hdr->type == 'K' || hdr->type == 'x' || hdr->type == 'g' ||
+			(memcmp(hdr->magic, "ustar", 5) == 0 && hdr->prefix[0]))
+		{
+			fprintf(stderr, "%s: unsupported long name or extended header at %s\n", archive, name);
+			exit(1);
+		}
+
+		if (strcmp(name, BOOTFILES_V2_PAD) != 0 && strcmp(name, BOOTFILES_V2_INDEX) != 0 &&
+			(hdr->type == '0' || hdr->type == 0 || hdr->type == '5'))
+		{
+			m = member_add(name, hdr->type == '5');
+			if (m)
+			{
+				memcpy(m->header, block, sizeof(block));
+				m->have_header = 1;
+				m->src = archive;
+				m->src_offset = offset;
+				m->size = m->dir ? 0 : size;
+			}
+		}
+		offset += (size + BLOCK_SIZE - 1) & ~(uint64_t) (BLOCK_SIZE - 1);
+	}
+	fclose(fp);
+}
+
+static void tar_header(uint8_t *block, const char *name, char type, uint64_t size, uint64_t mtime,
+	const uint8_t *original)
+{
+	struct tar_header *hdr = (struct tar_header *) block;
+	unsigned sum = 0;
+	int i;
+
+	if (original)
+	{
+		memcpy(block, original, BLOCK_SIZE);
+	}
+	else
+	{
+		memset(block, 0, BLOCK_SIZE);
+		snprintf(hdr->mode, sizeof(hdr->mode), "%07o", type == '5' ? 0755 : 0644);
+		snprintf(hdr->uid, sizeof(hdr->uid), "%07o", 0);
+		snprintf(hdr->gid, sizeof(hdr->gid), "%07o", 0);
+		snprintf(hdr->mtime, sizeof(hdr->mtime), "%011llo", (unsigned long long) mtime);
+		memcpy(hdr->magic, "ustar", 6);
+		memcpy(hdr->version, "00", 2);
+		snprintf(hdr->uname, sizeof(hdr->uname), "root");
+		snprintf(hdr->gname, sizeof(hdr->gname), "root");
+	}
+	memset(hdr->name, 0, sizeof(hdr->name));
+	memcpy(hdr->name, name, strlen(name) < sizeof(hdr->name) ? strlen(name) : sizeof(hdr->name));
+	hdr->type = type;
+	snprintf(hdr->size, sizeof(hdr->size), "%011llo", (unsigned long long) size);
+	memset(hdr->csum, ' ', sizeof(hdr->csum));
+	for (i = 0; i < BLOCK_SIZE; i++)
+		sum += block[i];
+	snprintf(hdr->csum, sizeof(hdr->csum), "%06o", sum);
+}
+
+static void write_all(FILE *out, const void *buf, size_t len, const char *path)
+{
+	if (fwrite(buf, 1, len, out) != len)
+		die("Failed to write %s: %s", path);
+}
+
+static void write_zeros(FILE *out, uint64_t len, const char *path)
+{
+	static const uint8_t zeros[BLOCK_SIZE];
+
+	while (len)
+	{
+		size_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+
+		write_all(out, zeros, n, path);
+		len -= n;
+	}
+}
+
+// Copies a member's data to the output, computing its digest
+static void member_copy(FILE *out, struct member *m, const char *path)
+{
+	struct sha256 s;
+	uint64_t pos = 0;
+	int fd = open(m->src, O_RDONLY);
+
+	if (fd < 0)
+		die("Failed to open %s: %s", m->src);
+	sha256_init(&s);
+	while (pos < m->size)
+	{
+		size_t len = m->size - pos < COPY_BUF_SIZE ? m->size - pos : COPY_BUF_SIZE;
+
+		if (pread(fd, copy_buf, len, m->src_offset + pos) != (ssize_t) len)
+		{
+			if (errno == 0)
+				errno = EIO;
+			die("Failed to read %s: %s", m->src);
+		}
+		sha256_update(&s, copy_buf, len);
+		write_all(out, copy_buf, len, path);
+		pos += len;
+	}
+	close(fd);
+	sha256_final(&s, m->digest);
+	write_zeros(out, (BLOCK_SIZE - m->size % BLOCK_SIZE) % BLOCK_SIZE, path);
+}
+
+static void write_index(FILE *out, uint64_t offset, int files, const char *path)
+{
+	uint32_t num_buckets = 16, strings_size = 0, name = 0;
+	uint64_t index_size;
+	uint8_t *index;
+	uint8_t *buckets;
+	char *strings;
+	struct bootfiles_v2_footer *footer;
+	int i, n;
+
+	while (num_buckets < (uint32_t) files * 2)
+		num_buckets <<= 1;
+	for (i = 0; i < num_members; i++)
+		if (!members[i].dir)
+			strings_size += strlen(members[i].name) + 1;
+	index_size = (uint64_t) files * sizeof(struct bootfiles_v2_entry) + num_buckets * 4 + strings_size +
+		sizeof(*footer);
+	index_size = (index_size + BLOCK_SIZE - 1) & ~(uint64_t) (BLOCK_SIZE - 1);
+	index = calloc(1, index_size);
+	if (!index)
+		die("%s: %s", "Out of memory");
+	buckets = index + (size_t) files * sizeof(struct bootfiles_v2_entry);
+	strings = (char *) buckets + (size_t) num_buckets * 4;
+
+	for (i = 0, n = 0; i < num_members; i++)
+	{
+		struct member *m = &members[i];
+		struct bootfiles_v2_entry *e = (struct bootfiles_v2_entry *) index + n;
+		uint32_t hash = bootfiles_hash(m->name);
+		uint8_t *bucket = buckets + (hash & (num_buckets - 1)) * 4;
+
+		if (m->dir)
+			continue;
+		put32((uint8_t *) &e->hash, hash);
+		// Push onto the front of the bucket; names are unique
+		memcpy(&e->next, bucket, 4);
+		put32(bucket, n + 1);
+		put32((uint8_t *) &e->name, name);
+		put64((uint8_t *) &e->offset, m->offset);
+		put64((uint8_t *) &e->size, m->size);
+		memcpy(e->digest, m->digest, sizeof(e->digest));
+		strcpy(strings + name, m->name);
+		name += strlen(m->name) + 1;
+		n++;
+	}
+
+	footer = (struct bootfiles_v2_footer *) (index + index_size - sizeof(*footer));
+	memcpy(footer->magic, BOOTFILES_V2_MAGIC, sizeof(BOOTFILES_V2_MAGIC));
+	put64((uint8_t *) &footer->index_offset, offset + BLOCK_SIZE);
+	put32((uint8_t *) &footer->num_entries, files);
+	put32((uint8_t *) &footer->num_buckets, num_buckets);
+	put32((uint8_t *) &footer->strings_size, strings_size);
+
+	{
+		uint8_t block[BLOCK_SIZE];
+
+		tar_header(block, BOOTFILES_V2_INDEX, '0', index_size, 0, NULL);
+		write_all(out, block, sizeof(block), path);
+	}
+	write_all(out, index, index_size, path);
+	free(index);
+}
+
+static void pack(const char *output)
+{
+	char tmp[4096];
+	uint64_t offset = 0;
+	int i, files = 0;
+	FILE *out;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", output);
+	out = fopen(tmp, "wb");
+	if (!out)
+		die("Failed to create %s: %s", tmp);
+
+	for (i = 0; i < num_members; i++)
+	{
+		struct member *m = &members[i];
+		uint8_t block[BLOCK_SIZE];
+
+		if (!m->dir && m->size)
+		{
+			// Pad so that the data after the header starts on an aligned boundary
+			uint64_t data = (offset + BLOCK_SIZE + BOOTFILES_V2_ALIGN - 1) & ~(uint64_t) (BOOTFILES_V2_ALIGN - 1);
+			uint64_t gap = data - BLOCK_SIZE - offset;
+
+			if (gap)
+			{
+				tar_header(block, BOOTFILES_V2_PAD, '0', gap - BLOCK_SIZE, 0, NULL);
+				write_all(out, block, sizeof(block), tmp);
+				write_zeros(out, gap - BLOCK_SIZE, tmp);
+				offset += gap;
+			}
+		}
+
+		tar_header(block, m->name, m->dir ? '5' : '0', m->size, m->mtime, m->have_header ? m->header : NULL);
+		write_all(out, block, sizeof(block), tmp);
+		offset += BLOCK_SIZE;
+		m->offset = offset;
+		if (!m->dir)
+		{
+			member_copy(out, m, tmp);
+			offset += (m->size + BLOCK_SIZE - 1) & ~(uint64_t) (BLOCK_SIZE - 1);
+			files++;
+		}
+	}
+
+	write_index(out, offset, files, tmp);
+	write_zeros(out, 2 * BLOCK_SIZE, tmp);
+	if (fclose(out) != 0 || rename(tmp, output) != 0)
+		die("Failed to write %s: %s", output);
+	printf("Packed %d files into %s\n", files, output);
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s -o OUTPUT SOURCE\n\n", name);
+	printf("Writes a bootfiles.bin with page aligned members and an index so that rpiboot\n");
+	printf("can find each file without reading the whole archive. SOURCE is either a\n");
+	printf("directory, whose files are added in name order, or an existing bootfiles.bin.\n");
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *output = NULL;
+	struct stat st;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ho:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'o': output = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (!output || optind != argc - 1)
+		usage(argv[0]);
+
+	if (stat(argv[optind], &st) < 0)
+		die("Failed to read %s: %s", argv[optind]);
+	if (S_ISDIR(st.st_mode))
+		scan_dir(argv[optind], "");
+	else
+		scan_archive(argv[optind]);
+	pack(output);
+	return 0;
+}
@@ -0,0 +1,1316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+// Builds a FAT boot.img from a directory without mkfs.fat, mtools or a
+// loop mount. It is a native replacement for tools/make-boot-image and
+// takes the same options and environment variables.
+//
+// The layout is deterministic: the files of each directory are sorted by
+// name and written to contiguous clusters in that order. The layout is
+// recorded in OUTPUT.state so that a later build from the same directory
+// structure only rewrites the clusters, directory entries and FAT sectors
+// of the files which have changed, plus the volume serial number. Anything
+// else, e.g. adding or removing a file or changing SOURCE_DATE_EPOCH,
+// rebuilds the whole image.
+
+#define STATE_MAGIC	"mkbootimg 1"
+#define COPY_BUF_SIZE	(1024 * 1024)
+#define DIRENT_SIZE	32
+#define LFN_CHARS	13
+#define MAX_NAME	255
+#define MAX_OPTIONS	256
+
+struct node {
+	char *name;		// Long name
+	char *src;		// Source path
+	char *path;		// Path within the image
+	int dir;
+	uint64_t size;
+	int64_t mtime;
+	long mtime_ns;
+	uint8_t short_name[11];
+	uint8_t case_flags;	// Lower case base name / extension without an LFN
+	int lfn_entries;
+	uint32_t first_cluster;
+	uint32_t clusters;
+	uint64_t dirent_offset;	// Image offset of the short entry
+	struct node **children;
+	int num_children;
+	struct node *parent;
+};
+
+struct geometry {
+	uint32_t sector_size;
+	uint32_t spc;		// Sectors per cluster
+	uint32_t fat_bits;
+	uint32_t total_sectors;
+	uint32_t reserved;
+	uint32_t fat_sectors;
+	uint32_t root_entries;	// FAT12/16 fixed root directory
+	uint32_t cluster_size;
+	uint32_t clusters;
+	uint64_t fat_offset;
+	uint64_t root_offset;
+	uint64_t data_offset;
+};
+
+struct state_entry {
+	int dir;
+	uint64_t size;
+	int64_t mtime;
+	long mtime_ns;
+	uint32_t first_cluster;
+	uint64_t dirent_offset;
+	char *path;
+};
+
+static struct {
+	struct geometry g;
+	char options[MAX_OPTIONS];
+	uint64_t image_size;
+	int64_t image_mtime;
+	struct state_entry *entries;
+	int num_entries;
+} state;
+
+static const char *board = "";
+static int arch = 32;
+static int64_t source_date_epoch = -1;
+static uint8_t *fat;
+static uint8_t *fat_dirty;	// Per FAT sector
+static uint32_t next_free;
+static uint8_t copy_buf[COPY_BUF_SIZE];
+
+static void die(const char *fmt, const char *arg)
+{
+	fprintf(stderr, fmt, arg, strerror(errno));
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static uint32_t env_number(const char *name, uint32_t def)
+{
+	const char *value = getenv(name);
+
+	return value && *value ? (uint32_t) strtoul(value, NULL, 0) : def;
+}
+
+static void put16(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static uint32_t get16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+// Board specific pruning from make-boot-image, applied to the top level only
+static int excluded(const char *name)
+{
+	static const char *pi4_files[] = {
+		"kernel.img", "kernel7.img", "bootcode.bin",
+		"start.elf", "fixup.dat", "start_cd.elf", "fixup_cd.dat", "start_db.elf",
+		"fixup_db.dat", "start_x.elf", "fixup_x.dat", "start4cd.elf", "fixup4cd.dat",
+		"start4db.elf", "fixup4db.dat", "start4x.elf", "fixup4x.dat",
+		"kernel_2712.img", "initramfs_2712", NULL
+	};
+	static const char *pi4_prefixes[] = { "bcm2708", "bcm2709", "bcm2710", NULL };
+	int i;
+
+	if (name[0] == '.')
+		return 1;
+	if ((arch == 32 && strcmp(name, "kernel8.img") == 0) ||
+		(arch == 64 && strcmp(name, "kernel7l.img") == 0))
+		return 1;
+	if (strcmp(board, "pi4") == 0 || strcmp(board, "pi400") == 0 || strcmp(board, "cm4") == 0)
+	{
+		for (i = 0; pi4_files[i]; i++)
+			if (strcmp(name, pi4_files[i]) == 0)
+				return 1;
+		for (i = 0; pi4_prefixes[i]; i++)
+			if (strncmp(name, pi4_prefixes[i], strlen(pi4_prefixes[i])) == 0)
+				return 1;
+	}
+	return 0;
+}
+
+// Short names
+
+static int short_char_valid(int c)
+{
+	return isupper(c) || isdigit(c) || c >= 0x80 || strchr("!#$%&'()-@^_`{}~", c);
+}
+
+// Sets the short name if 'name' is a valid 8.3 name, possibly in lower case
+static int short_name_exact(struct node *n)
+{
+	const char *name = n->name;
+	const char *dot = strrchr(name, '.');
+	size_t base_len = dot ? (size_t) (dot - name) : strlen(name);
+	size_t ext_len = dot ? strlen(dot + 1) : 0;
+	int lower[2] = { 0, 0 }, upper[2] = { 0, 0 };
+	size_t i;
+
+	if (base_len < 1 || base_len > 8 || ext_len > 3 || (dot && ext_len == 0))
+		return 0;
+
+	memset(n->short_name, ' ', sizeof(n->short_name));
+	for (i = 0; name[i]; i++)
+	{
+		int part = dot && name + i > dot;
+		int c = (unsigned char) name[i];
+
+		if (name + i == dot)
+			continue;
+		if (c >= 0x80)
+			return 0;
+		lower[part] |= islower(c) != 0;
+		upper[part] |= isupper(c) != 0;
+		c = toupper(c);
+		if (!short_char_valid(c))
+			return 0;
+		n->short_name[part ? 8 + (size_t) (name + i - dot - 1) : i] = c;
+	}
+	// A mixture of cases in either part needs a long name
+	if ((lower[0] && upper[0]) || (lower[1] && upper[1]))
+		return 0;
+	n->case_flags = (lower[0] ? 0x08 : 0) | (lower[1] ? 0x10 : 0);
+	return 1;
+}
+
+static void short_name_generate(struct node *n, int tail)
+{
+	const char *name = n->name;
+	const char *dot = strrchr(name, '.');
+	char suffix[12];
+	int base_len, len, i;
+
+	while (*name == '.')
+		name++;
+	if (dot && dot < name)
+		dot = NULL;
+
+	memset(n->short_name, ' ', sizeof(n->short_name));
+	len = snprintf(suffix, sizeof(suffix), "~%d", tail);
+	for (i = 0, base_len = 0; name + i != dot && name[i] && base_len < 8 - len; i++)
+	{
+		int c = toupper((unsigned char) name[i]);
+
+		if (c == ' ' || c == '.')
+			continue;
+		n->short_name[base_len++] = short_char_valid(c) && c < 0x80 ? c : '_';
+	}
+	memcpy(n->short_name + base_len, suffix, len);
+	for (i = 0, len = 0; dot && dot[1 + i] && len < 3; i++)
+	{
+		int c = toupper((unsigned char) dot[1 + i]);
+
+		if (c == ' ')
+			continue;
+		n->short_name[8 + len++] = short_char_valid(c) && c < 0x80 ? c : '_';
+	}
+	if (n->short_name[0] == 0xe5)
+		n->short_name[0] = 0x05;
+}
+
+// Converts UTF-8 to UTF-16. Bytes which aren't valid UTF-8 are taken as Latin-1.
+static int utf16_encode(const char *s, uint16_t *out, int max)
+{
+	const uint8_t *p = (const uint8_t *) s;
+	int len = 0;
+
+	while (*p && len < max)
+	{
+		uint32_t c = *p++;
+		int extra = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+		int i;
+
+		if (extra)
+		{
+			uint32_t v = c & (0x3f >> extra);
+
+			for (i = 0; i < extra && (p[i] & 0xc0) == 0x80; i++)
+				v = (v << 6) | (p[i] & 0x3f);
+			if (i == extra)
+			{
+				c = v;
+				p += extra;
+			}
+		}
+		if (c >= 0x10000)
+		{
+			if (len + 2 > max)
+				break;
+			c -= 0x10000;
+			out[len++] = 0xd800 | (c >> 10);
+			c = 0xdc00 | (c & 0x3ff);
+		}
+		out[len++] = c;
+	}
+	return len;
+}
+
+// Gives each child of 'd' a short name. The exact 8.3 names are assigned
+// first so that the generated ~N names are checked against all of them.
+static void node_names(struct node *d)
+{
+	int i, j;
+
+	for (i = 0; i < d->num_children; i++)
+	{
+		struct node *n = d->children[i];
+		uint16_t utf16[MAX_NAME + 1];
+
+		for (j = 0; j < i; j++)
+			if (strcasecmp(d->children[j]->name, n->name) == 0)
+			{
+				errno = EEXIST;
+				die("Names differ only in case: %s (%s)", n->path);
+			}
+
+		if (short_name_exact(n))
+		{
+			n->lfn_entries = 0;
+			continue;
+		}
+		memset(n->short_name, 0, sizeof(n->short_name));
+		n->lfn_entries = (utf16_encode(n->name, utf16, MAX_NAME) + LFN_CHARS - 1) / LFN_CHARS;
+	}
+
+	for (i = 0; i < d->num_children; i++)
+	{
+		struct node *n = d->children[i];
+		int tail;
+
+		if (!n->lfn_entries)
+			continue;
+		for (tail = 1; ; tail++)
+		{
+			short_name_generate(n, tail);
+			for (j = 0; j < d->num_children; j++)
+				if (j != i && memcmp(d->children[j]->short_name, n->short_name, 11) == 0)
+					break;
+			if (j == d->num_children)
+				break;
+		}
+	}
+}
+
+// Source tree
+
+static int node_compare(const void *a, const void *b)
+{
+	return strcmp((*(struct node * const *) a)->name, (*(struct node * const *) b)->name);
+}
+
+static struct node *node_scan(const char *src, const char *name, const char *path, struct node *parent)
+{
+	struct node *n = calloc(1, sizeof(*n));
+	struct stat st;
+
+	if (!n || stat(src, &st) < 0)
+		die("Failed to read %s: %s", src);
+	n->name = strdup(name);
+	n->src = strdup(src);
+	n->path = strdup(path);
+	n->parent = parent;
+	n->dir = S_ISDIR(st.st_mode);
+	n->size = n->dir ? 0 : (uint64_t) st.st_size;
+	n->mtime = st.st_mtime;
+#ifdef __linux__
+	n->mtime_ns = st.st_mtim.tv_nsec;
+#endif
+	if (!n->dir && n->size > 0xffffffffULL)
+	{
+		errno = EFBIG;
+		die("%s is too large for FAT: %s", src);
+	}
+
+	if (n->dir)
+	{
+		DIR *dir = opendir(src);
+		struct dirent *de;
+		int max = 0;
+
+		if (!dir)
+			die("Failed to open %s: %s", src);
+		while ((de = readdir(dir)) != NULL)
+		{
+			char child_src[4096], child_path[4096];
+
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+				continue;
+			if (!parent && excluded(de->d_name))
+				continue;
+			if (strlen(de->d_name) > MAX_NAME)
+			{
+				errno = ENAMETOOLONG;
+				die("Name too long: %s (%s)", de->d_name);
+			}
+			if (n->num_children == max)
+			{
+				max = max ? max * 2 : 16;
+				n->children = realloc(n->children, max * sizeof(*n->children));
+				if (!n->children)
+					die("%s: %s", "Out of memory");
+			}
+			snprintf(child_src, sizeof(child_src), "%s/%s", src, de->d_name);
+			snprintf(child_path, sizeof(child_path), "%s%s%s", path, *path ? "/" : "", de->d_name);
+			n->children[n->num_children++] = node_scan(child_src, de->d_name, child_path, n);
+		}
+		closedir(dir);
+		qsort(n->children, n->num_children, sizeof(*n->children), node_compare);
+		node_names(n);
+	}
+	return n;
+}
+
+static uint32_t dir_entries(const struct node *d)
+{
+	uint32_t entries = d->parent ? 2 : 1;	// "." and "..", or the volume label
+	int i;
+
+	for (i = 0; i < d->num_children; i++)
+		entries += d->children[i]->lfn_entries + 1;
+	return entries;
+}
+
+// Sets the number of clusters used by every node. Returns the total.
+static uint64_t node_clusters(struct node *n, const struct geometry *g)
+{
+	uint64_t total = 0;
+	int i;
+
+	if (!n->dir)
+	{
+		n->clusters = (n->size + g->cluster_size - 1) / g->cluster_size;
+		return n->clusters;
+	}
+
+	if (!n->parent && g->fat_bits != 32)
+	{
+		n->clusters = 0;
+	}
+	else
+	{
+		n->clusters = ((uint64_t) dir_entries(n) * DIRENT_SIZE + g->cluster_size - 1) / g->cluster_size;
+		if (!n->clusters)
+			n->clusters = 1;
+	}
+	total = n->clusters;
+	for (i = 0; i < n->num_children; i++)
+		total += node_clusters(n->children[i], g);
+	return total;
+}
+
+// Geometry
+
+static void geometry_derive(struct geometry *g)
+{
+	uint32_t root_sectors = g->fat_bits == 32 ? 0 :
+		(g->root_entries * DIRENT_SIZE + g->sector_size - 1) / g->sector_size;
+	uint32_t meta = g->reserved + g->fat_sectors + root_sectors;
+
+	g->cluster_size = g->sector_size * g->spc;
+	g->fat_offset = (uint64_t) g->reserved * g->sector_size;
+	g->root_offset = g->fat_offset + (uint64_t) g->fat_sectors * g->sector_size;
+	g->data_offset = (uint64_t) meta * g->sector_size;
+	g->clusters = g->total_sectors > meta ? (g->total_sectors - meta) / g->spc : 0;
+}
+
+// Sizes the FAT for the image
+static void geometry_layout(struct geometry *g, uint32_t fat_bits)
+{
+	g->fat_bits = fat_bits;
+	g->reserved = fat_bits == 32 ? 32 : 1;
+	g->fat_sectors = 1;
+	for (;;)
+	{
+		uint64_t bytes;
+		uint32_t needed;
+
+		geometry_derive(g);
+		bytes = ((uint64_t) g->clusters + 2) * fat_bits / 8 + 1;
+		needed = (bytes + g->sector_size - 1) / g->sector_size;
+		if (needed <= g->fat_sectors)
+			break;
+		g->fat_sectors = needed;
+	}
+}
+
+static int fat_bits_valid(uint32_t bits, uint32_t clusters)
+{
+	return bits == 12 ? clusters < 4085 : bits == 16 ? clusters >= 4085 && clusters < 65525 : clusters >= 65525;
+}
+
+// Chooses the FAT type and, unless the size is given, the smallest image
+// with room for 'needed' clusters plus the overhead.
+static int geometry_choose(struct geometry *g, struct node *root, uint32_t size_kib, uint32_t forced_bits,
+	uint32_t overhead_kib)
+{
+	static const uint32_t types[] = { 12, 16, 32 };
+	int t;
+
+	for (t = 0; t < 3; t++)
+	{
+		uint32_t bits = types[t];
+		uint64_t needed;
+
+		if (forced_bits && bits != forced_bits)
+			continue;
+		g->fat_bits = bits;
+		g->cluster_size = g->sector_size * g->spc;
+		needed = node_clusters(root, g);
+
+		if (size_kib)
+		{
+			g->total_sectors = (uint64_t) size_kib * 1024 / g->sector_size;
+			geometry_layout(g, bits);
+		}
+		else
+		{
+			uint64_t min = bits == 16 ? 4085 : bits == 32 ? 65525 : 1;
+
+			g->total_sectors = (uint32_t) ((needed > min ? needed : min) * g->spc +
+				(uint64_t) overhead_kib * 1024 / g->sector_size);
+			for (;;)
+			{
+				geometry_layout(g, bits);
+				if (g->clusters >= needed && g->clusters >= min)
+					break;
+				g->total_sectors += ((needed > min ? needed : min) - g->clusters) * g->spc;
+			}
+		}
+		if (fat_bits_valid(bits, g->clusters) && g->clusters >= needed)
+			return 0;
+	}
+	return -1;
+}
+
+// FAT table
+
+static uint32_t fat_eoc(void)
+{
+	return state.g.fat_bits == 12 ? 0xfff : state.g.fat_bits == 16 ? 0xffff : 0x0fffffff;
+}
+
+static uint32_t fat_get(uint32_t n)
+{
+	const struct geometry *g = &state.g;
+
+	if (g->fat_bits == 12)
+	{
+		uint32_t o = n * 3 / 2;
+		uint32_t v = fat[o] | (fat[o + 1] << 8);
+
+		return n & 1 ? v >> 4 : v & 0xfff;
+	}
+	if (g->fat_bits == 16)
+		return get16(fat + n * 2);
+	return (get16(fat + n * 4) | (get16(fat + n * 4 + 2) << 16)) & 0x0fffffff;
+}
+
+static void fat_set(uint32_t n, uint32_t v)
+{
+	const struct geometry *g = &state.g;
+	uint32_t o;
+
+	if (g->fat_bits == 12)
+	{
+		o = n * 3 / 2;
+		if (n & 1)
+		{
+			fat[o] = (fat[o] & 0x0f) | ((v << 4) & 0xf0);
+			fat[o + 1] = v >> 4;
+		}
+		else
+		{
+			fat[o] = v;
+			fat[o + 1] = (fat[o + 1] & 0xf0) | ((v >> 8) & 0x0f);
+		}
+		fat_dirty[(o + 1) / g->sector_size] = 1;
+	}
+	else if (g->fat_bits == 16)
+	{
+		o = n * 2;
+		put16(fat + o, v);
+	}
+	else
+	{
+		o = n * 4;
+		put32(fat + o, (v & 0x0fffffff) | (get16(fat + o + 2) & 0xf000) << 16);
+	}
+	fat_dirty[o / g->sector_size] = 1;
+}
+
+static void fat_init(void)
+{
+	const struct geometry *g = &state.g;
+
+	free(fat);
+	free(fat_dirty);
+	fat = calloc(g->fat_sectors, g->sector_size);
+	fat_dirty = calloc(g->fat_sectors, 1);
+	if (!fat || !fat_dirty)
+		die("%s: %s", "Out of memory");
+	next_free = 2;
+}
+
+// Allocates 'count' clusters from the lowest free clusters and links them
+// to 'prev' if it is non-zero. Returns the first cluster.
+static uint32_t fat_alloc(uint32_t count, uint32_t prev)
+{
+	uint32_t first = 0;
+
+	while (count--)
+	{
+		while (next_free < state.g.clusters + 2 && fat_get(next_free) != 0)
+			next_free++;
+		if (next_free >= state.g.clusters + 2)
+			return 0;
+		if (prev)
+			fat_set(prev, next_free);
+		else
+			first = next_free;
+		fat_set(next_free, fat_eoc());
+		prev = next_free;
+	}
+	return first ? first : prev;
+}
+
+static uint64_t cluster_offset(uint32_t cluster)
+{
+	return state.g.data_offset + (uint64_t) (cluster - 2) * state.g.cluster_size;
+}
+
+// Directory entries
+
+static void fat_time(int64_t t, uint8_t *time_p, uint8_t *date_p)
+{
+	time_t tt = source_date_epoch >= 0 ? source_date_epoch : t;
+	struct tm tm;
+
+	if (!gmtime_r(&tt, &tm) || tm.tm_year < 80)
+	{
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_year = 80;
+		tm.tm_mday = 1;
+	}
+	put16(time_p, (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+	put16(date_p, ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+}
+
+static void dirent_short(uint8_t *e, const uint8_t *name, uint8_t attr, uint8_t case_flags,
+	uint32_t cluster, uint32_t size, int64_t mtime)
+{
+	memset(e, 0, DIRENT_SIZE);
+	memcpy(e, name, 11);
+	e[11] = attr;
+	e[12] = case_flags;
+	fat_time(mtime, e + 14, e + 16);
+	memcpy(e + 18, e + 16, 2);
+	put16(e + 20, cluster >> 16);
+	memcpy(e + 22, e + 14, 4);
+	put16(e + 26, cluster);
+	put32(e + 28, size);
+}
+
+static uint8_t lfn_checksum(const uint8_t *name)
+{
+	uint8_t sum = 0;
+	int i;
+
+	for (i = 0; i < 11; i++)
+		sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+	return sum;
+}
+
+static uint8_t *dirent_lfn(uint8_t *e, const struct node *n)
+{
+	static const int offsets[LFN_CHARS] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+	uint16_t utf16[MAX_NAME + LFN_CHARS];
+	int len = utf16_encode(n->name, utf16, MAX_NAME);
+	uint8_t sum = lfn_checksum(n->short_name);
+	int seq, i;
+
+	// Terminated with a 0 and padded with 0xffff
+	for (i = len; i < n->lfn_entries * LFN_CHARS; i++)
+		utf16[i] = i == len ? 0 : 0xffff;
+
+	for (seq = n->lfn_entries; seq >= 1; seq--, e += DIRENT_SIZE)
+	{
+		memset(e, 0, DIRENT_SIZE);
+		e[0] = seq | (seq == n->lfn_entries ? 0x40 : 0);
+		e[11] = 0x0f;
+		e[13] = sum;
+		for (i = 0; i < LFN_CHARS; i++)
+			put16(e + offsets[i], utf16[(seq - 1) * LFN_CHARS + i]);
+	}
+	return e;
+}
+
+// Builds the entries of a directory and records where each entry is
+static void dir_build(struct node *d, uint8_t *buf, uint64_t base)
+{
+	static const uint8_t label[11] = { 'B', 'O', 'O', 'T', ' ', ' ', ' ', ' ', ' ', ' ', ' ' };
+	static const uint8_t dot[11] = { '.', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ' };
+	static const uint8_t dotdot[11] = { '.', '.', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ' };
+	uint8_t *e = buf;
+	int i;
+
+	if (!d->parent)
+	{
+		dirent_short(e, label, 0x08, 0, 0, 0, d->mtime);
+		e += DIRENT_SIZE;
+	}
+	else
+	{
+		// The root directory is cluster 0 in ".." entries, even on FAT32
+		uint32_t parent = d->parent->parent ? d->parent->first_cluster : 0;
+
+		dirent_short(e, dot, 0x10, 0, d->first_cluster, 0, d->mtime);
+		dirent_short(e + DIRENT_SIZE, dotdot, 0x10, 0, parent, 0, d->parent->mtime);
+		e += 2 * DIRENT_SIZE;
+	}
+
+	for (i = 0; i < d->num_children; i++)
+	{
+		struct node *n = d->children[i];
+
+		if (n->lfn_entries)
+			e = dirent_lfn(e, n);
+		dirent_short(e, n->short_name, n->dir ? 0x10 : 0x20, n->case_flags,
+			n->first_cluster, (uint32_t) n->size, n->mtime);
+		n->dirent_offset = base + (e - buf);
+		e += DIRENT_SIZE;
+	}
+}
+
+// Full build
+
+static void node_allocate(struct node *d)
+{
+	int i;
+
+	if (d->clusters)
+		d->first_cluster = fat_alloc(d->clusters, 0);
+	for (i = 0; i < d->num_children; i++)
+		if (!d->children[i]->dir && d->children[i]->clusters)
+			d->children[i]->first_cluster = fat_alloc(d->children[i]->clusters, 0);
+	for (i = 0; i < d->num_children; i++)
+		if (d->children[i]->dir)
+			node_allocate(d->children[i]);
+}
+
+static void write_at(int fd, const void *buf, size_t len, uint64_t offset, const char *path)
+{
+	if (pwrite(fd, buf, len, offset) != (ssize_t) len)
+		die("Failed to write %s: %s", path);
+}
+
+// Copies a file to its clusters, zero filling the last cluster
+static void file_write(int fd, const struct node *n, const char *image)
+{
+	int in = open(n->src, O_RDONLY);
+	uint64_t pos = 0;
+	uint32_t cluster = n->first_cluster;
+
+	if (in < 0)
+		die("Failed to open %s: %s", n->src);
+	while (pos < n->size)
+	{
+		// Gather a run of consecutive clusters
+		uint32_t run = 1;
+		uint64_t len;
+		ssize_t got;
+
+		while (run * (uint64_t) state.g.cluster_size < COPY_BUF_SIZE &&
+			pos + run * (uint64_t) state.g.cluster_size < n->size &&
+			fat_get(cluster + run - 1) == cluster + run)
+			run++;
+		len = run * (uint64_t) state.g.cluster_size;
+		if (len > COPY_BUF_SIZE)
+			len = COPY_BUF_SIZE;
+		memset(copy_buf, 0, len);
+		got = pread(in, copy_buf, len < n->size - pos ? len : n->size - pos, pos);
+		if (got <= 0)
+			die("Failed to read %s: %s", n->src);
+		write_at(fd, copy_buf, (got + state.g.cluster_size - 1) / state.g.cluster_size * state.g.cluster_size,
+			cluster_offset(cluster), image);
+		pos += got;
+		cluster += run - 1;
+		if (pos < n->size)
+			cluster = fat_get(cluster);
+	}
+	close(in);
+}
+
+static void node_write(int fd, struct node *d, const char *image)
+{
+	uint64_t len = d->clusters ? (uint64_t) d->clusters * state.g.cluster_size :
+		(uint64_t) state.g.root_entries * DIRENT_SIZE;
+	uint64_t base = d->clusters ? cluster_offset(d->first_cluster) : state.g.root_offset;
+	uint8_t *buf = calloc(1, len);
+	int i;
+
+	if (!buf)
+		die("%s: %s", "Out of memory");
+	dir_build(d, buf, base);
+	write_at(fd, buf, len, base, image);
+	free(buf);
+
+	for (i = 0; i < d->num_children; i++)
+	{
+		if (d->children[i]->dir)
+			node_write(fd, d->children[i], image);
+		else if (d->children[i]->size)
+			file_write(fd, d->children[i], image);
+	}
+}
+
+static uint32_t volume_id(const struct node *d, uint32_t hash)
+{
+	const char *p;
+	int i;
+
+	for (p = d->path; *p; p++)
+		hash = (hash ^ (uint8_t) *p) * 16777619u;
+	hash = (hash ^ (uint32_t) d->size) * 16777619u;
+	for (i = 0; i < d->num_children; i++)
+		hash = volume_id(d->children[i], hash);
+	return hash;
+}
+
+static uint32_t volume_serial(const struct node *root)
+{
+	return source_date_epoch >= 0 ? (uint32_t) source_date_epoch : volume_id(root, 2166136261u);
+}
+
+// Offset of the volume serial number in the boot sector
+static uint32_t volume_serial_offset(void)
+{
+	return (state.g.fat_bits == 32 ? 64 : 36) + 3;
+}
+
+static void boot_sector(uint8_t *s, const struct node *root)
+{
+	const struct geometry *g = &state.g;
+	uint8_t *ext;
+
+	memset(s, 0, g->sector_size);
+	s[0] = 0xeb;
+	s[1] = g->fat_bits == 32 ? 0x58 : 0x3c;
+	s[2] = 0x90;
+	memcpy(s + 3, "RPIBOOT ", 8);
+	put16(s + 11, g->sector_size);
+	s[13] = g->spc;
+	put16(s + 14, g->reserved);
+	s[16] = 1;				// One FAT, as make-boot-image
+	put16(s + 17, g->fat_bits == 32 ? 0 : g->root_entries);
+	put16(s + 19, g->total_sectors < 0x10000 && g->fat_bits != 32 ? g->total_sectors : 0);
+	s[21] = 0xf8;
+	put16(s + 22, g->fat_bits == 32 ? 0 : g->fat_sectors);
+	put16(s + 24, 1);			// Geometry 1/1, as make-boot-image
+	put16(s + 26, 1);
+	put32(s + 32, g->total_sectors < 0x10000 && g->fat_bits != 32 ? 0 : g->total_sectors);
+	if (g->fat_bits == 32)
+	{
+		put32(s + 36, g->fat_sectors);
+		put32(s + 44, root->first_cluster);
+		put16(s + 48, 1);		// FSInfo
+		put16(s + 50, 6);		// Backup boot sector
+		ext = s + 64;
+	}
+	else
+	{
+		ext = s + 36;
+	}
+	ext[0] = 0x80;
+	ext[2] = 0x29;
+	put32(ext + 3, volume_serial(root));
+	memcpy(ext + 7, "BOOT       ", 11);
+	memcpy(ext + 18, g->fat_bits == 32 ? "FAT32   " : g->fat_bits == 16 ? "FAT16   " : "FAT12   ", 8);
+	s[510] = 0x55;
+	s[511] = 0xaa;
+}
+
+static void fat_write(int fd, const char *image, int all)
+{
+	uint32_t i;
+
+	for (i = 0; i < state.g.fat_sectors; i++)
+	{
+		if (!all && !fat_dirty[i])
+			continue;
+		write_at(fd, fat + (uint64_t) i * state.g.sector_size, state.g.sector_size,
+			state.g.fat_offset + (uint64_t) i * state.g.sector_size, image);
+		fat_dirty[i] = 0;
+	}
+}
+
+static void image_build(const char *image, struct node *root)
+{
+	const struct geometry *g = &state.g;
+	char tmp[4096];
+	uint8_t *sector = calloc(1, g->sector_size);
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", image);
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || !sector)
+		die("Failed to create %s: %s", tmp);
+	if (ftruncate(fd, (off_t) g->total_sectors * g->sector_size) < 0)
+		die("Failed to size %s: %s", tmp);
+
+	fat_init();
+	fat_set(0, (fat_eoc() & ~0xffu) | 0xf8);
+	fat_set(1, fat_eoc());
+	node_allocate(root);
+
+	boot_sector(sector, root);
+	write_at(fd, sector, g->sector_size, 0, tmp);
+	if (g->fat_bits == 32)
+	{
+		write_at(fd, sector, g->sector_size, 6 * (uint64_t) g->sector_size, tmp);
+		memset(sector, 0, g->sector_size);
+		put32(sector, 0x41615252);
+		put32(sector + 484, 0x61417272);
+		put32(sector + 488, 0xffffffff);	// Free count and next free unknown
+		put32(sector + 492, 0xffffffff);
+		put32(sector + 508, 0xaa550000);
+		write_at(fd, sector, g->sector_size, g->sector_size, tmp);
+		write_at(fd, sector, g->sector_size, 7 * (uint64_t) g->sector_size, tmp);
+	}
+	free(sector);
+
+	node_write(fd, root, tmp);
+	fat_write(fd, tmp, 1);
+	if (close(fd) != 0 || rename(tmp, image) != 0)
+		die("Failed to write %s: %s", image);
+}
+
+// State
+
+static void state_path(char *path, size_t len, const char *image)
+{
+	snprintf(path, len, "%s.state", image);
+}
+
+// Everything other than the source files which the layout depends on, so
+// that changing the options or geometry rebuilds the image.
+static void state_options(char *buf, size_t len)
+{
+	snprintf(buf, len, "%.64s:%d:%u:%u:%u:%u:%u:%u:%lld", *board ? board : "-", arch,
+		env_number("SECTOR_SIZE", 512), env_number("SECTORS_PER_CLUSTER", 1),
+		env_number("ROOT_DIR_ENTRIES", 256), env_number("FAT_SIZE", 0),
+		env_number("IMAGE_SIZE", 0), env_number("FAT_OVERHEAD", 16),
+		(long long) source_date_epoch);
+}
+
+static void state_write_node(FILE *fp, const struct node *n)
+{
+	int i;
+
+	if (n->parent)
+	{
+		if (n->dir)
+			fprintf(fp, "dir %s\n", n->path);
+		else
+			fprintf(fp, "file %llu %lld %ld %lu %llu %s\n", (unsigned long long) n->size,
+				(long long) n->mtime, n->mtime_ns, (unsigned long) n->first_cluster,
+				(unsigned long long) n->dirent_offset, n->path);
+	}
+	for (i = 0; i < n->num_children; i++)
+		state_write_node(fp, n->children[i]);
+}
+
+static void state_save(const char *image, const struct node *root)
+{
+	const struct geometry *g = &state.g;
+	char path[4096], options[MAX_OPTIONS];
+	struct stat st;
+	FILE *fp;
+
+	if (stat(image, &st) < 0)
+		return;
+	state_path(path, sizeof(path), image);
+	state_options(options, sizeof(options));
+	fp = fopen(path, "w");
+	if (!fp)
+		return;
+	fprintf(fp, "%s\n", STATE_MAGIC);
+	fprintf(fp, "geometry %u %u %u %u %u %u %u\n", g->sector_size, g->spc, g->fat_bits,
+		g->total_sectors, g->reserved, g->fat_sectors, g->root_entries);
+	fprintf(fp, "options %s\n", options);
+	fprintf(fp, "image %llu %lld\n", (unsigned long long) st.st_size, (long long) st.st_mtime);
+	state_write_node(fp, root);
+	if (fclose(fp) != 0)
+		unlink(path);
+}
+
+static int state_load(const char *image)
+{
+	char path[4096], line[4600];
+	struct geometry *g = &state.g;
+	int max = 0;
+	FILE *fp;
+
+	state_path(path, sizeof(path), image);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	if (!fgets(line, sizeof(line), fp) || strncmp(line, STATE_MAGIC, strlen(STATE_MAGIC)) != 0)
+		goto fail;
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		struct state_entry e = {0};
+		unsigned long long size, offset;
+		long long mtime, image_size;
+		unsigned long cluster;
+		int n;
+
+		line[strcspn(line, "\n")] = 0;
+		if (sscanf(line, "geometry %u %u %u %u %u %u %u", &g->sector_size, &g->spc, &g->fat_bits,
+			&g->total_sectors, &g->reserved, &g->fat_sectors, &g->root_entries) == 7)
+			continue;
+		if (sscanf(line, "options %255s", state.options) == 1)
+			continue;
+		if (sscanf(line, "image %llu %lld", &size, &mtime) == 2)
+		{
+			state.image_size = size;
+			state.image_mtime = mtime;
+			continue;
+		}
+		if (strncmp(line, "dir ", 4) == 0)
+		{
+			e.dir = 1;
+			e.path = strdup(line + 4);
+		}
+		else if (sscanf(line, "file %llu %lld %ld %lu %llu %n", &size, &image_size, &e.mtime_ns,
+			&cluster, &offset, &n) == 5)
+		{
+			e.size = size;
+			e.mtime = image_size;
+			e.first_cluster = cluster;
+			e.dirent_offset = offset;
+			e.path = strdup(line + n);
+		}
+		else
+		{
+			goto fail;
+		}
+		if (state.num_entries == max)
+		{
+			max = max ? max * 2 : 64;
+			state.entries = realloc(state.entries, max * sizeof(*state.entries));
+			if (!state.entries)
+				goto fail;
+		}
+		state.entries[state.num_entries++] = e;
+	}
+	fclose(fp);
+	if (!g->sector_size || !g->spc)
+		return -1;
+	geometry_derive(g);
+	return 0;
+
+fail:
+	fclose(fp);
+	return -1;
+}
+
+// Incremental update
+
+// Pairs each node with its state entry. Returns -1 if the set of files or
+// directories has changed.
+static int state_match(struct node *d, struct node **nodes, int *index)
+{
+	int i;
+
+	for (i = 0; i < d->num_children; i++)
+	{
+		struct node *n = d->children[i];
+
+		if (*index >= state.num_entries || state.entries[*index].dir != n->dir ||
+			strcmp(state.entries[*index].path, n->path) != 0)
+			return -1;
+		nodes[(*index)++] = n;
+		if (n->dir && state_match(n, nodes, index) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+// Copies the image to 'tmp' and returns a descriptor for the copy. The
+// copy shares its blocks with the image where the filesystem supports it.
+static int image_copy(const char *image, const char *tmp)
+{
+	int in = open(image, O_RDONLY), out;
+	ssize_t len;
+
+	if (in < 0)
+		return -1;
+	out = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (out < 0)
+	{
+		close(in);
+		return -1;
+	}
+#ifdef FICLONE
+	if (ioctl(out, FICLONE, in) == 0)
+	{
+		close(in);
+		return out;
+	}
+#endif
+	while ((len = read(in, copy_buf, sizeof(copy_buf))) > 0)
+	{
+		if (write(out, copy_buf, len) != len)
+		{
+			len = -1;
+			break;
+		}
+	}
+	close(in);
+	if (len < 0)
+	{
+		close(out);
+		unlink(tmp);
+		return -1;
+	}
+	return out;
+}
+
+// Returns the number of files rewritten or -1 if the image must be rebuilt.
+// The changes are made to a copy which then replaces the image, so a reader
+// of the image (e.g. rpiboot) never sees a partly updated one.
+static int image_update(const char *image, struct node *root)
+{
+	const struct geometry *g = &state.g;
+	struct node **nodes;
+	char path[4096], tmp[4096], options[MAX_OPTIONS];
+	struct stat st;
+	int fd, i, index = 0, changed = 0;
+
+	state_options(options, sizeof(options));
+	if (strcmp(options, state.options) != 0 || stat(image, &st) < 0 ||
+		(uint64_t) st.st_size != state.image_size || st.st_mtime != state.image_mtime)
+		return -1;
+
+	nodes = calloc(state.num_entries ? state.num_entries : 1, sizeof(*nodes));
+	if (!nodes || state_match(root, nodes, &index) < 0 || index != state.num_entries)
+	{
+		free(nodes);
+		return -1;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", image);
+	fd = image_copy(image, tmp);
+	if (fd < 0)
+	{
+		free(nodes);
+		return -1;
+	}
+	fat_init();
+	if (pread(fd, fat, (size_t) g->fat_sectors * g->sector_size, g->fat_offset) !=
+		(ssize_t) ((size_t) g->fat_sectors * g->sector_size))
+	{
+		close(fd);
+		unlink(tmp);
+		free(nodes);
+		return -1;
+	}
+
+	for (i = 0; i < state.num_entries; i++)
+	{
+		const struct state_entry *e = &state.entries[i];
+		struct node *n = nodes[i];
+		uint32_t old = 0, c, prev = 0, keep;
+		uint8_t dirent[DIRENT_SIZE];
+
+		n->first_cluster = e->first_cluster;
+		n->dirent_offset = e->dirent_offset;
+		if (n->dir || (e->size == n->size && e->mtime == n->mtime && e->mtime_ns == n->mtime_ns))
+			continue;
+
+		// Keep as much of the old chain as is needed and free the rest
+		n->clusters = (n->size + g->cluster_size - 1) / g->cluster_size;
+		for (c = e->first_cluster; c >= 2 && c < g->clusters + 2; c = fat_get(c))
+		{
+			old++;
+			if (old > g->clusters)
+				break;
+		}
+		keep = old < n->clusters ? old : n->clusters;
+		for (c = e->first_cluster, old = 0; c >= 2 && c < g->clusters + 2; old++)
+		{
+			uint32_t next = fat_get(c);
+
+			if (old + 1 == keep)
+				fat_set(c, fat_eoc());
+			else if (old >= keep)
+				fat_set(c, 0);
+			if (old < keep)
+				prev = c;
+			c = next;
+		}
+		next_free = 2;
+		if (n->clusters > keep)
+		{
+			c = fat_alloc(n->clusters - keep, prev);
+			if (!c)
+			{
+				fprintf(stderr, "Not enough free space to update %s\n", n->path);
+				close(fd);
+				unlink(tmp);
+				free(nodes);
+				return -1;
+			}
+			if (!keep)
+				prev = c;
+		}
+		n->first_cluster = n->clusters ? (keep ? e->first_cluster : prev) : 0;
+		if (n->size)
+			file_write(fd, n, tmp);
+
+		if (pread(fd, dirent, sizeof(dirent), n->dirent_offset) != sizeof(dirent))
+			die("Failed to read %s: %s", tmp);
+		put16(dirent + 20, n->first_cluster >> 16);
+		put16(dirent + 26, n->first_cluster);
+		put32(dirent + 28, (uint32_t) n->size);
+		// Creation, access and modification times as dirent_short sets them
+		fat_time(n->mtime, dirent + 14, dirent + 16);
+		memcpy(dirent + 18, dirent + 16, 2);
+		memcpy(dirent + 22, dirent + 14, 4);
+		write_at(fd, dirent, sizeof(dirent), n->dirent_offset, tmp);
+		changed++;
+	}
+	fat_write(fd, tmp, 0);
+
+	// The serial number depends on the file sizes so it is updated as a
+	// full build would set it, in the FAT32 backup boot sector too.
+	if (changed)
+	{
+		uint8_t serial[4];
+
+		put32(serial, volume_serial(root));
+		write_at(fd, serial, sizeof(serial), volume_serial_offset(), tmp);
+		if (g->fat_bits == 32)
+			write_at(fd, serial, sizeof(serial), 6 * (uint64_t) g->sector_size + volume_serial_offset(), tmp);
+	}
+
+	state_path(path, sizeof(path), image);
+	unlink(path);
+	if (close(fd) != 0 || rename(tmp, image) != 0)
+		die("Failed to write %s: %s", image);
+	free(nodes);
+	return changed;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s -d SOURCE_DIR -o OUTPUT [-a 32|64] [-b BOARD] [-f]\n\n", name);
+	printf("Builds a FAT boot image from the files in SOURCE_DIR without mkfs.fat or mtools.\n\n");
+	printf("   -a Select 32 or 64 bit kernel\n");
+	printf("   -b Optionally prune the files to those required for the given board type\n");
+	printf("   -d The directory containing the files to include in the boot image\n");
+	printf("   -o The filename for the boot image\n");
+	printf("   -f Rebuild the whole image even if only some files have changed\n");
+	printf("   -h Display help text and exit\n\n");
+	printf("The layout is recorded in OUTPUT.state and later builds only rewrite the files\n");
+	printf("which have changed. The SECTOR_SIZE, SECTORS_PER_CLUSTER, ROOT_DIR_ENTRIES,\n");
+	printf("FAT_SIZE, IMAGE_SIZE (KiB) and FAT_OVERHEAD (KiB) environment variables are used\n");
+	printf("as by make-boot-image. SOURCE_DATE_EPOCH sets every timestamp.\n");
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *source = NULL, *output = NULL;
+	struct geometry *g = &state.g;
+	struct node *root;
+	int force = 0, opt, changed;
+
+	while ((opt = getopt(argc, argv, "a:b:d:fho:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'a': arch = atoi(optarg); break;
+			case 'b': board = optarg; break;
+			case 'd': source = optarg; break;
+			case 'f': force = 1; break;
+			case 'o': output = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (!source || !output)
+		usage(argv[0]);
+	if (getenv("SOURCE_DATE_EPOCH"))
+		source_date_epoch = strtoll(getenv("SOURCE_DATE_EPOCH"), NULL, 10);
+
+	root = node_scan(source, "", "", NULL);
+
+	if (!force && state_load(output) == 0)
+	{
+		node_clusters(root, g);
+		changed = image_update(output, root);
+		if (changed >= 0)
+		{
+			state_save(output, root);
+			printf("Updated %s: %d file%s rewritten\n", output, changed, changed == 1 ? "" : "s");
+			return 0;
+		}
+		printf("Rebuilding %s\n", output);
+	}
+
+	memset(g, 0, sizeof(*g));
+	g->sector_size = env_number("SECTOR_SIZE", 512);
+	g->spc = env_number("SECTORS_PER_CLUSTER", 1);
+	g->root_entries = env_number("ROOT_DIR_ENTRIES", 256);
+	if (g->sector_size < 512 || g->sector_size > 4096 || (g->sector_size & (g->sector_size - 1)) ||
+		!g->spc || g->spc > 128 || (g->spc & (g->spc - 1)))
+	{
+		fprintf(stderr, "Invalid SECTOR_SIZE or SECTORS_PER_CLUSTER\n");
+		return 1;
+	}
+	if (geometry_choose(g, root, env_number("IMAGE_SIZE", 0), env_number("FAT_SIZE", 0),
+		env_number("FAT_OVERHEAD", 16)) < 0)
+	{
+		fprintf(stderr, "The files don't fit in a FAT%s image of the requested size\n",
+			getenv("FAT_SIZE") ? getenv("FAT_SIZE") : "");
+		return 1;
+	}
+	if (g->fat_bits != 32 && dir_entries(root) > g->root_entries)
+	{
+		fprintf(stderr, "Too many files in the root directory for ROOT_DIR_ENTRIES=%u\n", g->root_entries);
+		return 1;
+	}
+
+	image_build(output, root);
+	state_save(output, root);
+	printf("Created image %s: FAT%u, %u KiB\n", output, g->fat_bits,
+		(unsigned) ((uint64_t) g->total_sectors * g->sector_size / 1024));
+	return 0;
+}
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "eeprom.h"
+
+// Generates a pieeprom.bin and pieeprom.sig for each of many bootloader
+// configs, e.g. one per board serial number. The source image is parsed
+// once and the images are generated in parallel. Each config NAME.conf
+// gives OUTDIR/NAME/pieeprom.bin so with -o DIR/serial the images are
+// picked up by rpiboot -o from the per-serial overlays.
+
+struct job {
+	const char *config;
+	char name[256];
+};
+
+static struct job *jobs;
+static int num_jobs, max_jobs;
+static int next_job;
+static int failed;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *output_dir;
+static uint8_t *original;
+static struct eeprom_layout layout;
+static uint64_t timestamp;
+
+static void *read_file(const char *path, size_t *size)
+{
+	struct stat st;
+	uint8_t *buf = NULL;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+	{
+		buf = malloc(st.st_size ? st.st_size : 1);
+		if (buf && read(fd, buf, st.st_size) != st.st_size)
+		{
+			free(buf);
+			buf = NULL;
+		}
+		*size = st.st_size;
+	}
+	close(fd);
+	return buf;
+}
+
+static int write_file(const char *path, const void *data, size_t size)
+{
+	char tmp[4096];
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "wb");
+	if (!fp)
+		return -1;
+	if (fwrite(data, 1, size, fp) != size)
+	{
+		fclose(fp);
+		unlink(tmp);
+		return -1;
+	}
+	if (fclose(fp) != 0 || rename(tmp, path) != 0)
+	{
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static void job_add(const char *config)
+{
+	const char *base = strrchr(config, '/') ? strrchr(config, '/') + 1 : config;
+	const char *ext = strrchr(base, '.');
+	int name_len = ext && ext != base ? (int) (ext - base) : (int) strlen(base);
+	struct job *job;
+
+	if (num_jobs == max_jobs)
+	{
+		max_jobs = max_jobs ? max_jobs * 2 : 256;
+		jobs = realloc(jobs, max_jobs * sizeof(*jobs));
+		if (!jobs)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	job = &jobs[num_jobs++];
+	job->config = config;
+	snprintf(job->name, sizeof(job->name), "%.*s", name_len, base);
+}
+
+// Adds every .conf file in 'dir'
+static void job_add_dir(const char *dir)
+{
+	DIR *d = opendir(dir);
+	struct dirent *de;
+
+	if (!d)
+	{
+		fprintf(stderr, "Failed to open %s: %s\n", dir, strerror(errno));
+		exit(1);
+	}
+	while ((de = readdir(d)) != NULL)
+	{
+		size_t len = strlen(de->d_name);
+		char path[4096];
+
+		if (de->d_name[0] == '.' || len < 6 || strcmp(de->d_name + len - 5, ".conf") != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		job_add(strdup(path));
+	}
+	closedir(d);
+}
+
+static int job_run(const struct job *job, uint8_t *image)
+{
+	char dir[4000], path[4096], sig[EEPROM_SIG_MAX];
+	size_t config_len = 0;
+	void *config = read_file(job->config, &config_len);
+	int ret = -1, len;
+
+	if (!config)
+	{
+		fprintf(stderr, "Failed to read %s: %s\n", job->config, strerror(errno));
+		return -1;
+	}
+
+	// Signed configs and public keys need the signing key, which only
+	// update-pieeprom.sh can use, so don't generate unsigned images for them.
+	len = strrchr(job->config, '/') ? (int) (strrchr(job->config, '/') - job->config) + 1 : 0;
+	snprintf(path, sizeof(path), "%.*sbootconf.sig", len, job->config);
+	if (access(path, F_OK) != 0)
+		snprintf(path, sizeof(path), "%.*spubkey.bin", len, job->config);
+	if (access(path, F_OK) == 0)
+	{
+		fprintf(stderr, "%s: not generating an unsigned image because of %s\n", job->config, path);
+		goto end;
+	}
+
+	memcpy(image, original, layout.size);
+	if (eeprom_set_config(image, &layout, config, config_len) < 0)
+	{
+		fprintf(stderr, "%s: failed to update image\n", job->config);
+		goto end;
+	}
+	len = eeprom_sig(image, layout.size, timestamp, sig, sizeof(sig));
+
+	snprintf(dir, sizeof(dir), "%s/%s", output_dir, job->name);
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "Failed to create %s: %s\n", dir, strerror(errno));
+		goto end;
+	}
+	snprintf(path, sizeof(path), "%s/pieeprom.bin", dir);
+	if (write_file(path, image, layout.size) == 0)
+	{
+		snprintf(path, sizeof(path), "%s/pieeprom.sig", dir);
+		if (write_file(path, sig, len) == 0)
+			ret = 0;
+	}
+	if (ret < 0)
+		fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+end:
+	free(config);
+	return ret;
+}
+
+static void *worker(void *arg)
+{
+	uint8_t *image = malloc(layout.size);
+
+	(void) arg;
+	for (;;)
+	{
+		int n;
+
+		pthread_mutex_lock(&job_lock);
+		n = next_job < num_jobs ? next_job++ : -1;
+		pthread_mutex_unlock(&job_lock);
+		if (n < 0)
+			break;
+		if (!image || job_run(&jobs[n], image) < 0)
+		{
+			pthread_mutex_lock(&job_lock);
+			failed++;
+			pthread_mutex_unlock(&job_lock);
+		}
+	}
+	free(image);
+	return NULL;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s -i pieeprom.original.bin -o OUTDIR [-j JOBS] [-t TIMESTAMP] CONFIG...\n\n", name);
+	printf("Writes OUTDIR/NAME/pieeprom.bin and pieeprom.sig for each bootloader config\n");
+	printf("NAME.conf, as update-pieeprom.sh does for a single boot.conf. A CONFIG which is\n");
+	printf("a directory adds every .conf file in it.\n\n");
+	printf("   -i The source EEPROM image\n");
+	printf("   -o The directory for the generated images\n");
+	printf("   -j The number of images to generate in parallel (default: one per CPU)\n");
+	printf("   -t The update timestamp in the .sig files (default: now)\n");
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *input = NULL;
+	pthread_t *threads;
+	size_t size = 0;
+	long threads_num = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, i;
+
+	timestamp = time(NULL);
+	while ((opt = getopt(argc, argv, "hi:j:o:t:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'i': input = optarg; break;
+			case 'j': threads_num = atoi(optarg); break;
+			case 'o': output_dir = optarg; break;
+			case 't': timestamp = strtoull(optarg, NULL, 0); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (!input || !output_dir || optind == argc)
+		usage(argv[0]);
+
+	for (i = optind; i < argc; i++)
+	{
+		struct stat st;
+
+		if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+			job_add_dir(argv[i]);
+		else
+			job_add(argv[i]);
+	}
+	if (!num_jobs)
+	{
+		fprintf(stderr, "No bootloader configs found\n");
+		return 1;
+	}
+
+	original = read_file(input, &size);
+	if (!original)
+	{
+		fprintf(stderr, "Failed to read %s: %s\n", input, strerror(errno));
+		return 1;
+	}
+	if (eeprom_parse(original, size, &layout) < 0)
+		return 1;
+	if (mkdir(output_dir, 0755) < 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "Failed to create %s: %s\n", output_dir, strerror(errno));
+		return 1;
+	}
+
+	if (threads_num < 1)
+		threads_num = 1;
+	if (threads_num > num_jobs)
+		threads_num = num_jobs;
+	threads = calloc(threads_num, sizeof(*threads));
+	if (!threads)
+		return 1;
+	for (i = 0; i < threads_num; i++)
+		if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+			break;
+	if (i == 0)
+		worker(NULL);
+	while (i--)
+		pthread_join(threads[i], NULL);
+
+	printf("Generated %d of %d EEPROM images in %s\n", num_jobs - failed, num_jobs, output_dir);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,203 @@
+#include <libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simulate.h"
+#include "transport.h"
+
+// An in-process model of the device side of the boot protocol.
+//
+// In the bootrom stage the device receives the boot message, the second
+// stage and then returns a zero return code. In the file stage the device
+// requests each file in the list in turn with GetFileSize followed by
+// ReadFile and then sends Done. Names starting with '*' are metadata
+// messages which only get a zero length reply. Bulk data is copied into a
+// scratch buffer to model the cost of the host controller reading it.
+
+#define SIM_MAX_FILES 64
+#define SIM_FNAME_LEN 256
+#define SIM_SCRATCH_SIZE (64 * 1024)
+
+struct sim_message {
+	int command;
+	char fname[SIM_FNAME_LEN];
+};
+
+struct sim_device {
+	struct transport *t;
+	int stage;
+	int finished;
+	char *files[SIM_MAX_FILES];
+	int num_files;
+	int next_message;	// Two messages (GetFileSize, ReadFile) per file
+	int last_command;
+	uint32_t expect;	// Bulk bytes announced by the last control_out
+	uint32_t received;
+	int boot_state;
+	uint32_t second_stage_len;
+	uint64_t bytes;
+	uint8_t scratch[SIM_SCRATCH_SIZE];
+};
+
+#define BOOT_WAIT_MESSAGE	0
+#define BOOT_WAIT_CODE		1
+#define BOOT_WAIT_RETCODE	2
+
+static int sim_control_out(struct transport *t, uint32_t length)
+{
+	struct sim_device *d = t->priv;
+
+	if (d->received != d->expect)
+		return LIBUSB_ERROR_PIPE;
+
+	d->expect = 0;
+	d->received = 0;
+	if (d->stage == SIM_STAGE_BOOTROM)
+	{
+		if (d->boot_state == BOOT_WAIT_CODE && length != d->second_stage_len)
+			return LIBUSB_ERROR_PIPE;
+		d->expect = length;
+	}
+	else if (d->last_command == 1)
+	{
+		// Only a ReadFile reply is followed by data. Replies to GetFileSize
+		// and metadata messages just carry the length.
+		d->expect = length;
+	}
+	return 0;
+}
+
+static int sim_control_in(struct transport *t, void *buf, int len)
+{
+	struct sim_device *d = t->priv;
+	struct sim_message message;
+	int index;
+
+	if (d->received != d->expect)
+		return LIBUSB_ERROR_PIPE;
+
+	if (d->stage == SIM_STAGE_BOOTROM)
+	{
+		if (d->boot_state != BOOT_WAIT_RETCODE || len != sizeof(int))
+			return LIBUSB_ERROR_PIPE;
+		memset(buf, 0, len);
+		d->finished = 1;
+		return len;
+	}
+
+	if (len < (int) sizeof(message))
+		return LIBUSB_ERROR_OVERFLOW;
+
+	memset(&message, 0, sizeof(message));
+	index = d->next_message / 2;
+	if (index >= d->num_files)
+	{
+		message.command = 2;
+		d->finished = 1;
+	}
+	else
+	{
+		const char *name = d->files[index];
+
+		snprintf(message.fname, sizeof(message.fname), "%s", name);
+		message.command = d->next_message % 2;
+		// Metadata messages are only sent once
+		d->next_message += (name[0] == '*') ? 2 : 1;
+	}
+	d->last_command = message.command;
+	memcpy(buf, &message, sizeof(message));
+	return sizeof(message);
+}
+
+static int sim_bulk_out(struct transport *t, const uint8_t *buf, int len, int *ret)
+{
+	struct sim_device *d = t->priv;
+	int sent = 0;
+
+	if ((uint32_t) len > d->expect - d->received)
+	{
+		*ret = LIBUSB_ERROR_OVERFLOW;
+		return 0;
+	}
+
+	if (d->stage == SIM_STAGE_BOOTROM && d->boot_state == BOOT_WAIT_MESSAGE && d->received == 0)
+		memcpy(&d->second_stage_len, buf, sizeof(d->second_stage_len));
+
+	while (sent < len)
+	{
+		int chunk = len - sent < SIM_SCRATCH_SIZE ? len - sent : SIM_SCRATCH_SIZE;
+
+		memcpy(d->scratch, buf + sent, chunk);
+		sent += chunk;
+	}
+	d->received += sent;
+	d->bytes += sent;
+
+	if (d->stage == SIM_STAGE_BOOTROM && d->received == d->expect)
+		d->boot_state = d->boot_state == BOOT_WAIT_MESSAGE ? BOOT_WAIT_CODE : BOOT_WAIT_RETCODE;
+
+	*ret = 0;
+	return sent;
+}
+
+static const struct transport_ops sim_transport_ops = {
+	.name = "simulated",
+	.control_out = sim_control_out,
+	.control_in = sim_control_in,
+	.bulk_out = sim_bulk_out,
+};
+
+// 'files' is a comma separated list of the files requested in the second stage
+struct sim_device *sim_device_create(const char *files)
+{
+	struct sim_device *d = calloc(1, sizeof(*d));
+	char *list, *name, *saveptr;
+
+	if (!d)
+		return NULL;
+
+	list = strdup(files);
+	for (name = strtok_r(list, ",", &saveptr); name && d->num_files < SIM_MAX_FILES;
+		name = strtok_r(NULL, ",", &saveptr))
+		d->files[d->num_files++] = strdup(name);
+	free(list);
+	return d;
+}
+
+// Resets the device to the start of 'stage', as if it had re-enumerated,
+// and connects it to the transport used by the host session.
+void sim_device_attach(struct sim_device *d, int stage, struct transport *t)
+{
+	d->t = t;
+	d->stage = stage;
+	d->finished = 0;
+	d->next_message = 0;
+	d->last_command = -1;
+	d->expect = 0;
+	d->received = 0;
+	d->boot_state = BOOT_WAIT_MESSAGE;
+	t->ops = &sim_transport_ops;
+	t->priv = d;
+}
+
+int sim_device_finished(const struct sim_device *d)
+{
+	return d->finished;
+}
+
+uint64_t sim_device_bytes(const struct sim_device *d)
+{
+	return d->bytes;
+}
+
+void sim_device_free(struct sim_device *d)
+{
+	int i;
+
+	if (!d)
+		return;
+	for (i = 0; i < d->num_files; i++)
+		free(d->files[i]);
+	free(d);
+}
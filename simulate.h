@@ -0,0 +1,16 @@
+#ifndef SIMULATE_H
+#define SIMULATE_H
+#include <stdint.h>
+
+struct transport;
+struct sim_device;
+
+#define SIM_STAGE_BOOTROM	0
+#define SIM_STAGE_FILES		1
+
+struct sim_device *sim_device_create(const char *files);
+void sim_device_attach(struct sim_device *d, int stage, struct transport *t);
+int sim_device_finished(const struct sim_device *d);
+uint64_t sim_device_bytes(const struct sim_device *d);
+void sim_device_free(struct sim_device *d);
+#endif
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+// Writes one JSON object per line (NDJSON) for each device session so that
+// the time spent in each boot stage and file transfer can be analysed.
+
+static FILE *stats_fp;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void stats_open(const char *path)
+{
+	if (path == NULL)
+	{
+		stats_fp = stdout;
+		return;
+	}
+
+	stats_fp = fopen(path, "a");
+	if (!stats_fp)
+	{
+		fprintf(stderr, "Failed to open stats file: %s\nWriting to stdout instead...\n", path);
+		stats_fp = stdout;
+	}
+	setvbuf(stats_fp, NULL, _IOLBF, 0);
+}
+
+int stats_enabled(void)
+{
+	return stats_fp != NULL;
+}
+
+struct file_stats *stats_add_file(struct session_stats *st, const char *name)
+{
+	struct file_stats *f;
+
+	if (!stats_fp)
+		return NULL;
+
+	if (st->num_files == st->max_files)
+	{
+		int max_files = st->max_files ? st->max_files * 2 : 16;
+		f = realloc(st->files, max_files * sizeof(*f));
+		if (!f)
+			return NULL;
+		st->files = f;
+		st->max_files = max_files;
+	}
+	f = &st->files[st->num_files++];
+	memset(f, 0, sizeof(*f));
+	snprintf(f->name, sizeof(f->name), "%s", name);
+	return f;
+}
+
+static void write_string(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for (; *str; str++)
+	{
+		if (*str == '"' || *str == '\\')
+			fprintf(fp, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			fprintf(fp, "\\u%04x", *str);
+		else
+			fputc(*str, fp);
+	}
+	fputc('"', fp);
+}
+
+static double elapsed_ms(uint64_t start, uint64_t end)
+{
+	return (start && end >= start) ? (end - start) / 1000.0 : 0;
+}
+
+void stats_write(const struct session_stats *st, const char *serial,
+	const char *pathname, const char *chip, const char *stage, int result)
+{
+	int i;
+
+	if (!stats_fp)
+		return;
+
+	pthread_mutex_lock(&stats_lock);
+	fprintf(stats_fp, "{\"serial\":");
+	write_string(stats_fp, serial);
+	fprintf(stats_fp, ",\"path\":");
+	write_string(stats_fp, pathname);
+	fprintf(stats_fp, ",\"chip\":\"%s\",\"stage\":\"%s\",\"result\":%d", chip, stage, result);
+	fprintf(stats_fp, ",\"enumeration_to_open_ms\":%.3f", elapsed_ms(st->discovered_us, st->opened_us));
+	if (st->stage1_start_us)
+	{
+		double ms = elapsed_ms(st->stage1_start_us, st->stage1_end_us);
+		fprintf(stats_fp, ",\"stage1_bytes\":%zu,\"stage1_upload_ms\":%.3f,\"stage1_mbps\":%.2f",
+			st->stage1_bytes, ms, ms > 0 ? st->stage1_bytes / ms / 1000.0 : 0);
+	}
+	fprintf(stats_fp, ",\"files\":[");
+	for (i = 0; i < st->num_files; i++)
+	{
+		const struct file_stats *f = &st->files[i];
+		double transfer_ms = elapsed_ms(f->read_start_us, f->read_end_us);
+
+		fprintf(stats_fp, "%s{\"name\":", i ? "," : "");
+		write_string(stats_fp, f->name);
+		fprintf(stats_fp, ",\"source\":\"%s\",\"size\":%zu", f->source ? f->source : "none", f->size);
+		if (f->read_start_us)
+			fprintf(stats_fp, ",\"request_gap_ms\":%.3f,\"transfer_ms\":%.3f,\"mbps\":%.2f",
+				elapsed_ms(f->get_size_us, f->read_start_us), transfer_ms,
+				transfer_ms > 0 ? f->size / transfer_ms / 1000.0 : 0);
+		fprintf(stats_fp, "}");
+	}
+	fprintf(stats_fp, "],\"total_ms\":%.3f}\n", elapsed_ms(st->discovered_us, st->end_us));
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_free(struct session_stats *st)
+{
+	free(st->files);
+	st->files = NULL;
+	st->num_files = st->max_files = 0;
+}
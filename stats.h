@@ -0,0 +1,35 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stddef.h>
+#include <stdint.h>
+
+// Timings for a single file served by file_server()
+struct file_stats {
+	char name[256];
+	const char *source;	// Where check_file() found the file
+	size_t size;
+	uint64_t get_size_us;	// GetFileSize request
+	uint64_t read_start_us;	// ReadFile request
+	uint64_t read_end_us;	// Transfer complete
+};
+
+// Timings for one device session. All times are from time_now_us().
+struct session_stats {
+	uint64_t discovered_us;
+	uint64_t opened_us;
+	uint64_t stage1_start_us;
+	uint64_t stage1_end_us;
+	uint64_t end_us;
+	size_t stage1_bytes;
+	struct file_stats *files;
+	int num_files;
+	int max_files;
+};
+
+void stats_open(const char *path);
+int stats_enabled(void);
+struct file_stats *stats_add_file(struct session_stats *st, const char *name);
+void stats_write(const struct session_stats *st, const char *serial,
+	const char *pathname, const char *chip, const char *stage, int result);
+void stats_free(struct session_stats *st);
+#endif
@@ -0,0 +1,794 @@
+#include <libusb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "transport.h"
+
+// Boot session traces.
+//
+// A trace is a text file holding one or more sessions. Each session starts
+// with a "session" line giving the stage, the chip and the USB path and
+// ends with "end". In between each protocol exchange is one line starting
+// with its time in microseconds from the start of the session:
+//
+//   # rpiboot trace 1
+//   session file_server 2712 1-1.3
+//   1843 in 260 00000000636f6e6669672e747874   # GetFileSize config.txt
+//   1902 out 1187
+//   ...
+//   end
+//
+// "out" is a vendor OUT request with its 32-bit length, "bulk" is bulk OUT
+// data and "in" is a vendor IN request with the data returned by the device
+// in hex (trailing zeros are omitted). Comments are ignored.
+//
+// Replay acts as the device: IN requests return the recorded data, at the
+// recorded time if pacing is enabled, and OUT requests and bulk data are
+// checked against the trace.
+
+extern int verbose;
+
+#define TRACE_MAGIC "# rpiboot trace 1\n"
+#define TRACE_LINE_LEN 1024
+#define FILE_MESSAGE_LEN 260
+#define REPLAY_SCRATCH_SIZE (64 * 1024)
+
+struct trace_op {
+	uint64_t time_us;
+	char type;		// 'o' out, 'b' bulk, 'i' in
+	uint32_t len;
+	uint8_t *data;		// 'in' only, len bytes
+};
+
+struct trace_session {
+	char stage[16];
+	int chip;
+	char pathname[32];
+	struct trace_op *ops;
+	int num_ops;
+	int max_ops;
+};
+
+struct trace {
+	struct trace_session *sessions;
+	int num_sessions;
+};
+
+static uint64_t trace_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void trace_write_op(FILE *fp, uint64_t time_us, char type, uint32_t len, const uint8_t *data)
+{
+	uint32_t i, n = 0;
+
+	if (type == 'o')
+	{
+		fprintf(fp, "%llu out %u\n", (unsigned long long) time_us, len);
+		return;
+	}
+	if (type == 'b')
+	{
+		fprintf(fp, "%llu bulk %u\n", (unsigned long long) time_us, len);
+		return;
+	}
+
+	for (i = 0; i < len; i++)
+		if (data[i])
+			n = i + 1;
+	fprintf(fp, "%llu in %u ", (unsigned long long) time_us, len);
+	for (i = 0; i < n; i++)
+		fprintf(fp, "%02x", data[i]);
+	if (n == 0)
+		fprintf(fp, "-");
+
+	// Annotate file_message requests from the second stage
+	if (len == FILE_MESSAGE_LEN)
+	{
+		static const char *commands[] = { "GetFileSize", "ReadFile", "Done" };
+		int command = data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24;
+
+		int name_len = strnlen((const char *) data + 4, len - 4);
+
+		fprintf(fp, "   # %s%s%.*s", command >= 0 && command <= 2 ? commands[command] : "?",
+			name_len ? " " : "", name_len, (const char *) data + 4);
+	}
+	fprintf(fp, "\n");
+}
+
+// Recording
+
+static FILE *record_fp;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct trace_recorder {
+	struct transport inner;
+	uint64_t start_us;
+	char *buf;
+	size_t buf_size;
+	FILE *fp;		// Session buffer, appended to record_fp when finished
+};
+
+int trace_record_open(const char *path)
+{
+	record_fp = fopen(path, "w");
+	if (!record_fp)
+		return -1;
+	fputs(TRACE_MAGIC, record_fp);
+	fflush(record_fp);
+	return 0;
+}
+
+int trace_recording(void)
+{
+	return record_fp != NULL;
+}
+
+static int record_control_out(struct transport *t, uint32_t length)
+{
+	struct trace_recorder *r = t->priv;
+	int ret = r->inner.ops->control_out(&r->inner, length);
+
+	if (ret >= 0)
+		trace_write_op(r->fp, trace_now_us() - r->start_us, 'o', length, NULL);
+	return ret;
+}
+
+static int record_control_in(struct transport *t, void *buf, int len)
+{
+	struct trace_recorder *r = t->priv;
+	int ret = r->inner.ops->control_in(&r->inner, buf, len);
+
+	if (ret >= 0)
+		trace_write_op(r->fp, trace_now_us() - r->start_us, 'i', ret, buf);
+	return ret;
+}
+
+static int record_bulk_out(struct transport *t, const uint8_t *buf, int len, int *ret)
+{
+	struct trace_recorder *r = t->priv;
+	int sent = r->inner.ops->bulk_out(&r->inner, buf, len, ret);
+
+	if (sent > 0)
+		trace_write_op(r->fp, trace_now_us() - r->start_us, 'b', sent, NULL);
+	return sent;
+}
+
+static const struct transport_ops record_ops = {
+	.name = "record",
+	.control_out = record_control_out,
+	.control_in = record_control_in,
+	.bulk_out = record_bulk_out,
+};
+
+// Wraps the transport so that every request is also written to the
+// session's buffer.
+void trace_record_attach(struct transport *t)
+{
+	struct trace_recorder *r;
+
+	if (!record_fp)
+		return;
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return;
+	r->fp = open_memstream(&r->buf, &r->buf_size);
+	if (!r->fp)
+	{
+		free(r);
+		return;
+	}
+	r->inner = *t;
+	r->start_us = trace_now_us();
+	t->ops = &record_ops;
+	t->priv = r;
+}
+
+// Appends the session to the trace and restores the original transport
+void trace_record_finish(struct transport *t, const char *stage, int chip, const char *pathname)
+{
+	struct trace_recorder *r;
+
+	if (t->ops != &record_ops)
+		return;
+	r = t->priv;
+	fclose(r->fp);
+
+	pthread_mutex_lock(&record_lock);
+	fprintf(record_fp, "session %s %d %s\n", stage, chip, pathname[0] ? pathname : "-");
+	fwrite(r->buf, 1, r->buf_size, record_fp);
+	fprintf(record_fp, "end\n");
+	fflush(record_fp);
+	pthread_mutex_unlock(&record_lock);
+
+	*t = r->inner;
+	free(r->buf);
+	free(r);
+}
+
+// Loading
+
+static struct trace_session *trace_add_session(struct trace *tr, const char *stage, int chip, const char *pathname)
+{
+	struct trace_session *sessions, *ts;
+
+	sessions = realloc(tr->sessions, (tr->num_sessions + 1) * sizeof(*sessions));
+	if (!sessions)
+		return NULL;
+	tr->sessions = sessions;
+	ts = &sessions[tr->num_sessions++];
+	memset(ts, 0, sizeof(*ts));
+	snprintf(ts->stage, sizeof(ts->stage), "%s", stage);
+	snprintf(ts->pathname, sizeof(ts->pathname), "%s", pathname);
+	ts->chip = chip;
+	return ts;
+}
+
+static struct trace_op *trace_add_op(struct trace_session *ts, uint64_t time_us, char type, uint32_t len)
+{
+	struct trace_op *op;
+
+	if (ts->num_ops == ts->max_ops)
+	{
+		int max_ops = ts->max_ops ? ts->max_ops * 2 : 64;
+		struct trace_op *ops = realloc(ts->ops, max_ops * sizeof(*ops));
+
+		if (!ops)
+			return NULL;
+		ts->ops = ops;
+		ts->max_ops = max_ops;
+	}
+	op = &ts->ops[ts->num_ops++];
+	op->time_us = time_us;
+	op->type = type;
+	op->len = len;
+	op->data = NULL;
+	if (type == 'i')
+	{
+		op->data = calloc(1, len ? len : 1);
+		if (!op->data)
+		{
+			ts->num_ops--;
+			return NULL;
+		}
+	}
+	return op;
+}
+
+static int hex_decode(const char *hex, uint8_t *out, uint32_t len)
+{
+	uint32_t i;
+
+	if (strcmp(hex, "-") == 0)
+		return 0;
+	for (i = 0; hex[0] && hex[1]; i++, hex += 2)
+	{
+		unsigned int byte;
+
+		if (i >= len || sscanf(hex, "%2x", &byte) != 1)
+			return -1;
+		out[i] = byte;
+	}
+	return hex[0] ? -1 : 0;
+}
+
+struct trace *trace_load(const char *path)
+{
+	struct trace *tr;
+	struct trace_session *ts = NULL;
+	char line[TRACE_LINE_LEN];
+	int lineno = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return NULL;
+	tr = calloc(1, sizeof(*tr));
+	if (!tr)
+		goto fail;
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		char stage[16], pathname[32], type[8], hex[2 * TRACE_LINE_LEN];
+		unsigned long long time_us;
+		unsigned int len;
+		struct trace_op *op;
+		char *comment;
+		int chip;
+
+		lineno++;
+		comment = strchr(line, '#');
+		if (comment)
+			*comment = 0;
+		if (strspn(line, " \t\r\n") == strlen(line))
+			continue;
+
+		if (sscanf(line, "session %15s %d %31s", stage, &chip, pathname) == 3)
+		{
+			ts = trace_add_session(tr, stage, chip, pathname);
+			if (!ts)
+				goto fail;
+		}
+		else if (strncmp(line, "end", 3) == 0)
+		{
+			ts = NULL;
+		}
+		else if (ts && sscanf(line, "%llu %7s %u", &time_us, type, &len) == 3)
+		{
+			if (strcmp(type, "out") == 0)
+				op = trace_add_op(ts, time_us, 'o', len);
+			else if (strcmp(type, "bulk") == 0)
+				op = trace_add_op(ts, time_us, 'b', len);
+			else if (strcmp(type, "in") == 0 && len <= TRACE_LINE_LEN &&
+				 sscanf(line, "%*u %*s %*u %2047s", hex) == 1)
+			{
+				op = trace_add_op(ts, time_us, 'i', len);
+				if (op && hex_decode(hex, op->data, len) < 0)
+					goto bad;
+			}
+			else
+				goto bad;
+			if (!op)
+				goto fail;
+		}
+		else
+			goto bad;
+	}
+	fclose(fp);
+	return tr;
+
+bad:
+	fprintf(stderr, "%s:%d: Invalid trace record\n", path, lineno);
+fail:
+	fclose(fp);
+	trace_free(tr);
+	return NULL;
+}
+
+int trace_num_sessions(const struct trace *tr)
+{
+	return tr->num_sessions;
+}
+
+const char *trace_session_stage(const struct trace *tr, int session)
+{
+	return tr->sessions[session].stage;
+}
+
+int trace_session_chip(const struct trace *tr, int session)
+{
+	return tr->sessions[session].chip;
+}
+
+static void trace_clear(struct trace *tr)
+{
+	int i, j;
+
+	for (i = 0; i < tr->num_sessions; i++)
+	{
+		for (j = 0; j < tr->sessions[i].num_ops; j++)
+			free(tr->sessions[i].ops[j].data);
+		free(tr->sessions[i].ops);
+	}
+	free(tr->sessions);
+	tr->sessions = NULL;
+	tr->num_sessions = 0;
+}
+
+void trace_free(struct trace *tr)
+{
+	if (!tr)
+		return;
+	trace_clear(tr);
+	free(tr);
+}
+
+// Replay
+
+struct trace_replay {
+	const struct trace_session *ts;
+	int pos;
+	uint32_t bulk_left;	// Bytes remaining in the current bulk op
+	int paced;
+	uint64_t start_us;
+	struct trace_replay_stats stats;
+	uint8_t scratch[REPLAY_SCRATCH_SIZE];
+};
+
+static void replay_mismatch(struct trace_replay *r, const char *what, uint32_t expected, uint32_t actual)
+{
+	r->stats.mismatches++;
+	if (verbose)
+		printf("Replay %s op %d: %s expected %u got %u\n", r->ts->pathname, r->pos, what, expected, actual);
+}
+
+// Skips trace ops the host didn't perform up to the next op of 'type' or
+// the next IN request, whichever comes first.
+static const struct trace_op *replay_skip(struct trace_replay *r, char type)
+{
+	while (r->pos < r->ts->num_ops)
+	{
+		const struct trace_op *op = &r->ts->ops[r->pos];
+
+		if (op->type == type || op->type == 'i')
+			return op;
+		replay_mismatch(r, op->type == 'o' ? "out" : "bulk", op->len, 0);
+		r->pos++;
+		r->bulk_left = 0;
+	}
+	return NULL;
+}
+
+static int replay_control_out(struct transport *t, uint32_t length)
+{
+	struct trace_replay *r = t->priv;
+	const struct trace_op *op;
+
+	if (r->bulk_left)
+	{
+		replay_mismatch(r, "bulk", r->bulk_left, 0);
+		r->pos++;
+		r->bulk_left = 0;
+	}
+
+	op = replay_skip(r, 'o');
+	if (!op || op->type != 'o')
+	{
+		replay_mismatch(r, "out", 0, length);
+		return 0;
+	}
+	if (op->len != length)
+		replay_mismatch(r, "out", op->len, length);
+	r->pos++;
+	return 0;
+}
+
+static int replay_control_in(struct transport *t, void *buf, int len)
+{
+	struct trace_replay *r = t->priv;
+	const struct trace_op *op;
+
+	if (r->bulk_left)
+	{
+		replay_mismatch(r, "bulk", r->bulk_left, 0);
+		r->pos++;
+		r->bulk_left = 0;
+	}
+
+	op = replay_skip(r, 'i');
+	if (!op)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	if (r->paced)
+	{
+		uint64_t now = trace_now_us() - r->start_us;
+
+		if (op->time_us > now)
+			usleep(op->time_us - now);
+	}
+
+	if ((uint32_t) len > op->len)
+		len = op->len;
+	memcpy(buf, op->data, len);
+	r->pos++;
+	return len;
+}
+
+static int replay_bulk_out(struct transport *t, const uint8_t *buf, int len, int *ret)
+{
+	struct trace_replay *r = t->priv;
+	int remaining = len;
+	int i;
+
+	// Read the data as the host controller would
+	for (i = 0; i < len; i += REPLAY_SCRATCH_SIZE)
+		memcpy(r->scratch, buf + i, len - i < REPLAY_SCRATCH_SIZE ? len - i : REPLAY_SCRATCH_SIZE);
+
+	while (remaining > 0)
+	{
+		const struct trace_op *op;
+		uint32_t n;
+
+		if (!r->bulk_left)
+		{
+			op = r->pos < r->ts->num_ops ? &r->ts->ops[r->pos] : NULL;
+			if (!op || op->type != 'b')
+			{
+				replay_mismatch(r, "bulk", 0, remaining);
+				break;
+			}
+			r->bulk_left = op->len;
+		}
+		n = (uint32_t) remaining < r->bulk_left ? (uint32_t) remaining : r->bulk_left;
+		r->bulk_left -= n;
+		remaining -= n;
+		if (!r->bulk_left)
+			r->pos++;
+	}
+
+	r->stats.bytes += len;
+	*ret = 0;
+	return len;
+}
+
+static const struct transport_ops replay_ops = {
+	.name = "replay",
+	.control_out = replay_control_out,
+	.control_in = replay_control_in,
+	.bulk_out = replay_bulk_out,
+};
+
+void trace_replay_attach(struct trace *tr, int session, int paced, struct transport *t)
+{
+	struct trace_replay *r = calloc(1, sizeof(*r));
+
+	t->ops = &replay_ops;
+	t->priv = r;
+	if (!r)
+	{
+		fprintf(stderr, "Failed to allocate replay\n");
+		exit(-1);
+	}
+	r->ts = &tr->sessions[session];
+	r->paced = paced;
+	r->start_us = trace_now_us();
+}
+
+// Reports the bytes received and the number of differences from the trace
+void trace_replay_finish(struct transport *t, struct trace_replay_stats *stats)
+{
+	struct trace_replay *r = t->priv;
+
+	if (t->ops != &replay_ops)
+		return;
+	// Anything left apart from trailing IN requests was not sent by the host
+	while (r->pos < r->ts->num_ops)
+	{
+		if (r->ts->ops[r->pos].type != 'i')
+			r->stats.mismatches++;
+		r->pos++;
+	}
+	if (stats)
+		*stats = r->stats;
+	free(r);
+	t->ops = NULL;
+	t->priv = NULL;
+}
+
+// usbmon import
+//
+// Captures from Linux usbmon (e.g. tcpdump -i usbmon1 -w boot.pcap or
+// Wireshark) use the DLT_USB_LINUX or DLT_USB_LINUX_MMAPPED link types.
+// Every vendor control request belongs to the boot protocol so each device
+// (bus and address) that makes one becomes a session. The chip isn't in the
+// capture so it is recorded as 0.
+
+#define DLT_USB_LINUX		189
+#define DLT_USB_LINUX_MMAPPED	220
+#define USBMON_HEADER_LEN	48
+#define USBMON_MMAPPED_HEADER_LEN 64
+#define USBMON_MAX_DEVICES	128
+
+#define USB_XFER_CONTROL	2
+#define USB_XFER_BULK		3
+
+struct usbmon_device {
+	int bus;
+	int devnum;
+	int session;		// Index in the trace, which may be reallocated
+	uint64_t start_us;
+	uint64_t pending_id;	// Submitted vendor IN request
+	uint32_t pending_len;
+	int pending;
+};
+
+static uint32_t get_le16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	return get_le32(p) | (uint64_t) get_le32(p + 4) << 32;
+}
+
+static int usbmon_parse(FILE *fp, struct trace *tr, int header_len)
+{
+	struct usbmon_device devices[USBMON_MAX_DEVICES];
+	int num_devices = 0;
+	uint8_t rec[16];
+	uint8_t *pkt = NULL;
+	uint32_t pkt_max = 0;
+
+	while (fread(rec, sizeof(rec), 1, fp) == 1)
+	{
+		uint32_t incl_len = get_le32(rec + 8);
+		struct usbmon_device *dev = NULL;
+		uint64_t id, time_us;
+		uint8_t type, xfer_type, epnum, devnum;
+		uint32_t length, len_cap;
+		int bus, i;
+
+		if (incl_len > pkt_max)
+		{
+			uint8_t *p = realloc(pkt, incl_len);
+
+			if (!p)
+				goto fail;
+			pkt = p;
+			pkt_max = incl_len;
+		}
+		if (fread(pkt, 1, incl_len, fp) != incl_len)
+			break;
+		if (incl_len < (uint32_t) header_len)
+			continue;
+
+		id = get_le64(pkt);
+		type = pkt[8];
+		xfer_type = pkt[9];
+		epnum = pkt[10];
+		devnum = pkt[11];
+		bus = get_le16(pkt + 12);
+		time_us = (uint64_t) get_le64(pkt + 16) * 1000000 + get_le32(pkt + 24);
+		length = get_le32(pkt + 32);
+		len_cap = get_le32(pkt + 36);
+
+		for (i = 0; i < num_devices; i++)
+			if (devices[i].bus == bus && devices[i].devnum == devnum)
+				dev = &devices[i];
+
+		if (xfer_type == USB_XFER_CONTROL && type == 'S' && pkt[14] == 0)
+		{
+			const uint8_t *setup = pkt + 40;
+			uint8_t request_type = setup[0];
+
+			if (request_type != 0x40 && request_type != 0xc0)
+				continue;
+			if (!dev)
+			{
+				char pathname[32];
+
+				if (num_devices == USBMON_MAX_DEVICES)
+					continue;
+				dev = &devices[num_devices++];
+				memset(dev, 0, sizeof(*dev));
+				dev->bus = bus;
+				dev->devnum = devnum;
+				dev->start_us = time_us;
+				snprintf(pathname, sizeof(pathname), "%d.%d", bus, devnum);
+				if (!trace_add_session(tr, "bootcode", 0, pathname))
+					goto fail;
+				dev->session = tr->num_sessions - 1;
+			}
+
+			if (request_type == 0x40)
+			{
+				if (!trace_add_op(&tr->sessions[dev->session], time_us - dev->start_us, 'o',
+					get_le16(setup + 2) | get_le16(setup + 4) << 16))
+					goto fail;
+			}
+			else
+			{
+				dev->pending = 1;
+				dev->pending_id = id;
+				dev->pending_len = get_le16(setup + 6);
+			}
+		}
+		else if (xfer_type == USB_XFER_CONTROL && type == 'C' && dev && dev->pending && id == dev->pending_id)
+		{
+			struct trace_op *op;
+			uint32_t n = len_cap < incl_len - header_len ? len_cap : incl_len - header_len;
+
+			dev->pending = 0;
+			if ((int32_t) get_le32(pkt + 28) < 0)
+				continue;
+			if (n > length)
+				n = length;
+			op = trace_add_op(&tr->sessions[dev->session], time_us - dev->start_us, 'i', length);
+			if (!op)
+				goto fail;
+			memcpy(op->data, pkt + header_len, n);
+			// The second stage asks for files with file_message requests
+			if (length == FILE_MESSAGE_LEN)
+				strcpy(tr->sessions[dev->session].stage, "file_server");
+		}
+		else if (xfer_type == USB_XFER_BULK && type == 'S' && !(epnum & 0x80) && dev && length)
+		{
+			if (!trace_add_op(&tr->sessions[dev->session], time_us - dev->start_us, 'b', length))
+				goto fail;
+		}
+	}
+	free(pkt);
+	return 0;
+
+fail:
+	free(pkt);
+	return -1;
+}
+
+static int trace_save(const struct trace *tr, const char *path)
+{
+	FILE *fp = fopen(path, "w");
+	int i, j;
+
+	if (!fp)
+		return -1;
+	fputs(TRACE_MAGIC, fp);
+	for (i = 0; i < tr->num_sessions; i++)
+	{
+		const struct trace_session *ts = &tr->sessions[i];
+
+		fprintf(fp, "session %s %d %s\n", ts->stage, ts->chip, ts->pathname);
+		for (j = 0; j < ts->num_ops; j++)
+			trace_write_op(fp, ts->ops[j].time_us, ts->ops[j].type, ts->ops[j].len, ts->ops[j].data);
+		fprintf(fp, "end\n");
+	}
+	return fclose(fp);
+}
+
+// Converts a usbmon capture to a trace
+int trace_import_usbmon(const char *pcap, const char *path)
+{
+	struct trace tr = {0};
+	uint8_t hdr[24];
+	uint32_t magic, linktype;
+	int ret = -1;
+	FILE *fp;
+
+	fp = fopen(pcap, "rb");
+	if (!fp)
+	{
+		fprintf(stderr, "Unable to open '%s'\n", pcap);
+		return -1;
+	}
+	if (fread(hdr, sizeof(hdr), 1, fp) != 1)
+		goto bad;
+
+	// usbmon headers are in host order so only little-endian captures
+	// are supported.
+	magic = get_le32(hdr);
+	if (magic != 0xa1b2c3d4 && magic != 0xa1b23c4d)
+		goto bad;
+	linktype = get_le32(hdr + 20);
+	if (linktype != DLT_USB_LINUX && linktype != DLT_USB_LINUX_MMAPPED)
+	{
+		fprintf(stderr, "'%s' is not a usbmon capture (link type %u)\n", pcap, linktype);
+		goto end;
+	}
+
+	if (usbmon_parse(fp, &tr, linktype == DLT_USB_LINUX ? USBMON_HEADER_LEN : USBMON_MMAPPED_HEADER_LEN) < 0)
+	{
+		fprintf(stderr, "Failed to import '%s'\n", pcap);
+		goto end;
+	}
+
+	if (trace_save(&tr, path) < 0)
+	{
+		fprintf(stderr, "Unable to write '%s'\n", path);
+		goto end;
+	}
+	printf("Imported %d sessions from %s to %s\n", tr.num_sessions, pcap, path);
+	ret = 0;
+	goto end;
+
+bad:
+	fprintf(stderr, "'%s' is not a little-endian pcap file\n", pcap);
+end:
+	fclose(fp);
+	trace_clear(&tr);
+	return ret;
+}
@@ -0,0 +1,30 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdint.h>
+
+struct transport;
+struct trace;
+
+// Recording wraps the transport of a session and appends the session to
+// the trace file when it finishes.
+int trace_record_open(const char *path);
+int trace_recording(void);
+void trace_record_attach(struct transport *t);
+void trace_record_finish(struct transport *t, const char *stage, int chip, const char *pathname);
+
+// Replay acts as the device from a recorded session
+struct trace_replay_stats {
+	uint64_t bytes;
+	unsigned long mismatches;
+};
+
+struct trace *trace_load(const char *path);
+int trace_num_sessions(const struct trace *tr);
+const char *trace_session_stage(const struct trace *tr, int session);
+int trace_session_chip(const struct trace *tr, int session);
+void trace_replay_attach(struct trace *tr, int session, int paced, struct transport *t);
+void trace_replay_finish(struct transport *t, struct trace_replay_stats *stats);
+void trace_free(struct trace *tr);
+
+int trace_import_usbmon(const char *pcap, const char *path);
+#endif
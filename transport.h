@@ -0,0 +1,25 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+#include <stdint.h>
+
+// The USB requests used by the boot protocol. Real devices use libusb and
+// the simulated device (simulate.c) implements the device side in-process
+// so that the host code can be benchmarked without hardware.
+struct transport;
+
+struct transport_ops {
+	const char *name;
+	// Vendor OUT request with a 32-bit length in wValue and wIndex
+	int (*control_out)(struct transport *t, uint32_t length);
+	// Vendor IN request. Returns the number of bytes read or a LIBUSB_ERROR
+	int (*control_in)(struct transport *t, void *buf, int len);
+	// Bulk OUT data. Returns the number of bytes sent and sets *ret to 0
+	// or a LIBUSB_ERROR.
+	int (*bulk_out)(struct transport *t, const uint8_t *buf, int len, int *ret);
+};
+
+struct transport {
+	const struct transport_ops *ops;
+	void *priv;
+};
+#endif
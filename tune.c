@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "tune.h"
+
+// Finds the bulk transfer size and queue depth which give the highest
+// throughput for each USB path, since this depends on the hubs, cables and
+// host controller between rpiboot and the device.
+//
+// The throughput of the current settings is measured over samples of the
+// data sent by the file server. The transfer size is doubled while that
+// improves the throughput, otherwise it is halved while that improves it,
+// and then the same is done for the queue depth. The search continues
+// across boots until it converges and the results are kept in a file with
+// one line per chip and USB path:
+//
+//   <chip> <path> <transfer size> <depth> <MB/s> <converged>
+
+extern int verbose;
+extern int transfer_size;
+extern int transfer_depth;
+
+#define TUNE_MAX_PATHS		256
+#define TUNE_PATH_LEN		32
+#define TUNE_SAMPLE_BYTES	(4 * 1024 * 1024)
+#define TUNE_MIN_SIZE		(16 * 1024)
+#define TUNE_MAX_SIZE		(512 * 1024)
+#define TUNE_MIN_DEPTH		1
+#define TUNE_MAX_DEPTH		32
+#define TUNE_GAIN		1.03	// Required improvement to accept a change
+
+#define TUNE_BASELINE		0
+#define TUNE_SIZE_UP		1
+#define TUNE_SIZE_DOWN		2
+#define TUNE_DEPTH_UP		3
+#define TUNE_DEPTH_DOWN		4
+#define TUNE_CONVERGED		5
+
+struct tune {
+	int chip;
+	char path[TUNE_PATH_LEN];
+	int size;		// Best settings found so far
+	int depth;
+	double mbps;
+	int phase;
+	int moved;		// The current phase improved the throughput
+	int trial_size;		// Settings being measured
+	int trial_depth;
+	uint64_t sample_bytes;
+	uint64_t sample_us;
+};
+
+static char *tune_path;
+static struct tune tunes[TUNE_MAX_PATHS];
+static int num_tunes;
+static pthread_mutex_t tune_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int tune_valid(int size, int depth)
+{
+	return size >= TUNE_MIN_SIZE && size <= TUNE_MAX_SIZE &&
+		depth >= TUNE_MIN_DEPTH && depth <= TUNE_MAX_DEPTH &&
+		(long) size * depth <= TUNE_MAX_IN_FLIGHT;
+}
+
+int tune_open(const char *path)
+{
+	char line[128];
+	FILE *fp;
+
+	tune_path = strdup(path);
+	if (!tune_path)
+		return -1;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	while (num_tunes < TUNE_MAX_PATHS && fgets(line, sizeof(line), fp))
+	{
+		struct tune *t = &tunes[num_tunes];
+		int converged;
+
+		memset(t, 0, sizeof(*t));
+		if (sscanf(line, "%d %31s %d %d %lf %d", &t->chip, t->path, &t->size,
+			&t->depth, &t->mbps, &converged) != 6 || !tune_valid(t->size, t->depth))
+			continue;
+		t->phase = converged ? TUNE_CONVERGED : TUNE_BASELINE;
+		t->trial_size = t->size;
+		t->trial_depth = t->depth;
+		num_tunes++;
+	}
+	fclose(fp);
+	if (verbose)
+		printf("Loaded transfer settings for %d USB paths from %s\n", num_tunes, path);
+	return 0;
+}
+
+int tune_enabled(void)
+{
+	return tune_path != NULL;
+}
+
+static void tune_save(void)
+{
+	char tmp[4096];
+	FILE *fp;
+	int fd, i;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", tune_path);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+	fp = fdopen(fd, "w");
+	if (!fp)
+	{
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	for (i = 0; i < num_tunes; i++)
+		fprintf(fp, "%d %s %d %d %.2f %d\n", tunes[i].chip, tunes[i].path, tunes[i].size,
+			tunes[i].depth, tunes[i].mbps, tunes[i].phase == TUNE_CONVERGED);
+	if (fclose(fp) != 0 || rename(tmp, tune_path) != 0)
+		unlink(tmp);
+}
+
+// Returns the settings for the next sample of the current phase or -1 if
+// the phase has nothing left to try
+static int tune_try(struct tune *t)
+{
+	int size = t->size;
+	int depth = t->depth;
+
+	switch (t->phase)
+	{
+		case TUNE_SIZE_UP: size *= 2; break;
+		case TUNE_SIZE_DOWN: size /= 2; break;
+		case TUNE_DEPTH_UP: depth *= 2; break;
+		case TUNE_DEPTH_DOWN: depth /= 2; break;
+		default: return -1;
+	}
+	if (!tune_valid(size, depth))
+		return -1;
+	t->trial_size = size;
+	t->trial_depth = depth;
+	return 0;
+}
+
+// Moves on from a phase which didn't improve the throughput. Going down is
+// only tried if going up didn't help.
+static void tune_next_phase(struct tune *t)
+{
+	switch (t->phase)
+	{
+		case TUNE_SIZE_UP: t->phase = t->moved ? TUNE_DEPTH_UP : TUNE_SIZE_DOWN; break;
+		case TUNE_SIZE_DOWN: t->phase = TUNE_DEPTH_UP; break;
+		case TUNE_DEPTH_UP: t->phase = t->moved ? TUNE_CONVERGED : TUNE_DEPTH_DOWN; break;
+		default: t->phase = TUNE_CONVERGED; break;
+	}
+	if (t->phase == TUNE_DEPTH_UP || t->phase == TUNE_SIZE_UP)
+		t->moved = 0;
+}
+
+// Returns the tuning state for the USB path and the settings to use
+struct tune *tune_get(int chip, const char *pathname, int *size, int *depth)
+{
+	struct tune *t = NULL;
+	int i;
+
+	pthread_mutex_lock(&tune_lock);
+	for (i = 0; i < num_tunes; i++)
+	{
+		if (tunes[i].chip == chip && strcmp(tunes[i].path, pathname) == 0)
+		{
+			t = &tunes[i];
+			break;
+		}
+	}
+	if (!t && num_tunes < TUNE_MAX_PATHS && tune_valid(transfer_size, transfer_depth))
+	{
+		t = &tunes[num_tunes++];
+		memset(t, 0, sizeof(*t));
+		t->chip = chip;
+		snprintf(t->path, sizeof(t->path), "%s", pathname);
+		t->size = t->trial_size = transfer_size;
+		t->depth = t->trial_depth = transfer_depth;
+	}
+	if (t)
+	{
+		// A sample is only measured within one session
+		t->sample_bytes = t->sample_us = 0;
+		*size = t->trial_size;
+		*depth = t->trial_depth;
+	}
+	pthread_mutex_unlock(&tune_lock);
+	return t;
+}
+
+// Returns the number of bytes to send before the next report, or 0 once
+// the settings have converged
+size_t tune_sample_left(struct tune *t)
+{
+	size_t left;
+
+	pthread_mutex_lock(&tune_lock);
+	left = t->phase == TUNE_CONVERGED ? 0 : TUNE_SAMPLE_BYTES - t->sample_bytes;
+	pthread_mutex_unlock(&tune_lock);
+	return left;
+}
+
+// Adds a successful bulk write to the current sample and, once the sample
+// is complete, updates the settings
+void tune_report(struct tune *t, size_t bytes, uint64_t elapsed_us, int *size, int *depth)
+{
+	double mbps;
+
+	pthread_mutex_lock(&tune_lock);
+	if (t->phase == TUNE_CONVERGED)
+		goto end;
+	t->sample_bytes += bytes;
+	t->sample_us += elapsed_us;
+	if (t->sample_bytes < TUNE_SAMPLE_BYTES || !t->sample_us)
+		goto end;
+
+	mbps = (double) t->sample_bytes / t->sample_us;
+	t->sample_bytes = t->sample_us = 0;
+	if (verbose)
+		printf("Tuning %s: %d x %d bytes %.2f MB/s\n", t->path, t->trial_depth, t->trial_size, mbps);
+
+	if (t->phase == TUNE_BASELINE)
+	{
+		t->mbps = mbps;
+		t->phase = TUNE_SIZE_UP;
+		t->moved = 0;
+	}
+	else if (mbps > t->mbps * TUNE_GAIN)
+	{
+		t->size = t->trial_size;
+		t->depth = t->trial_depth;
+		t->mbps = mbps;
+		t->moved = 1;
+	}
+	else
+	{
+		tune_next_phase(t);
+	}
+
+	while (t->phase != TUNE_CONVERGED && tune_try(t) < 0)
+		tune_next_phase(t);
+
+	if (t->phase == TUNE_CONVERGED)
+	{
+		t->trial_size = t->size;
+		t->trial_depth = t->depth;
+		printf("Transfer settings for %s: %d x %d bytes (%.2f MB/s)\n", t->path,
+			t->depth, t->size, t->mbps);
+		tune_save();
+	}
+	*size = t->trial_size;
+	*depth = t->trial_depth;
+end:
+	pthread_mutex_unlock(&tune_lock);
+}
+
+void tune_close(void)
+{
+	if (!tune_path)
+		return;
+	pthread_mutex_lock(&tune_lock);
+	tune_save();
+	pthread_mutex_unlock(&tune_lock);
+	free(tune_path);
+	tune_path = NULL;
+	num_tunes = 0;
+}
@@ -0,0 +1,17 @@
+#ifndef TUNE_H
+#define TUNE_H
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest transfer size * depth which is tried
+#define TUNE_MAX_IN_FLIGHT	(2 * 1024 * 1024)
+
+struct tune;
+
+int tune_open(const char *path);
+int tune_enabled(void);
+struct tune *tune_get(int chip, const char *pathname, int *size, int *depth);
+size_t tune_sample_left(struct tune *t);
+void tune_report(struct tune *t, size_t bytes, uint64_t elapsed_us, int *size, int *depth);
+void tune_close(void);
+#endif